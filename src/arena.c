@@ -158,10 +158,14 @@ void *_arena_alloc(arena *a, size_t size, size_t alignment) {
     return NULL;
   }
 
+  // allocation bigger than chunk gets own chunk (regions are page aligned),
+  // linked after current one, so space left in current chunk isn't lost
   if (size > a->chunkSize) {
-    fprintf(stderr, "arena_alloc error: allocation size %zu > chunk size %zu\n",
-            size, a->chunkSize);
-    return NULL;
+    _arena_chunk *big = alloc_chunk(size);
+    big->index = size;
+    big->next = a->curr->next;
+    a->curr->next = big;
+    return big->region;
   }
 
   _arena_chunk *chunk = a->curr;
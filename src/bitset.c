@@ -0,0 +1,206 @@
+#include "bitset.h"
+#include "common.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(BITSET_SIMD) && defined(__GNUC__) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#define BITSET_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// sets with less words than this are handled inline by scalar code, since
+// dispatch costs more than the op itself
+#define BITSET_SIMD_MIN_WORDS 4
+
+void bitset_init(bitset *s, size_t bits) {
+  s->words = BITSET_WORDS(bits);
+  s->w = calloc(s->words ? s->words : 1, sizeof(uint64_t));
+  assert(s->w);
+}
+
+void bitset_init_on(bitset *s, uint64_t *storage, size_t bits) {
+  s->words = BITSET_WORDS(bits);
+  s->w = storage;
+}
+
+void bitset_free(bitset *s) {
+  free(s->w);
+  s->w = NULL;
+  s->words = 0;
+}
+
+void bitset_fill(bitset *s, size_t bits) {
+  memset(s->w, 0xff, sizeof(uint64_t) * s->words);
+  if (bits % 64 != 0)
+    s->w[s->words - 1] = ((uint64_t)1 << (bits % 64)) - 1;
+}
+
+bool bitset_eq(const bitset *a, const bitset *b) {
+  return memcmp(a->w, b->w, sizeof(uint64_t) * a->words) == 0;
+}
+
+size_t bitset_count(const bitset *s) {
+  size_t res = 0;
+  for (size_t i = 0; i < s->words; ++i)
+    res += __builtin_popcountll(s->w[i]);
+  return res;
+}
+
+// All kernels share one signature: d is destination, a, b, c are operands
+// (unused ones may be NULL), n is amount of words. Return true if d changed.
+typedef bool (*bitset_kernel)(uint64_t *d, const uint64_t *a,
+                              const uint64_t *b, const uint64_t *c, size_t n);
+
+// word expressions of ops, `old` is current word of d
+#define UNION_OP(old, a, b, c) ((old) | (a))
+#define INTERSECT_OP(old, a, b, c) ((old) & (a))
+#define DIFF_OP(old, a, b, c) ((old) & ~(a))
+#define GEN_KILL_OP(old, a, b, c) ((a) | ((b) & ~(c)))
+
+#define SCALAR_KERNEL(name, OP)                                                \
+  static bool name##_scalar(uint64_t *d, const uint64_t *a,                    \
+                            const uint64_t *b, const uint64_t *c, size_t n) {  \
+    (void)b, (void)c;                                                          \
+    uint64_t changed = 0;                                                      \
+    for (size_t i = 0; i < n; ++i) {                                           \
+      uint64_t old = d[i];                                                     \
+      uint64_t v = OP(old, a[i], b ? b[i] : 0, c ? c[i] : 0);                  \
+      d[i] = v;                                                                \
+      changed |= v ^ old;                                                      \
+    }                                                                          \
+    return changed != 0;                                                       \
+  }
+
+SCALAR_KERNEL(union, UNION_OP)
+SCALAR_KERNEL(intersect, INTERSECT_OP)
+SCALAR_KERNEL(diff, DIFF_OP)
+SCALAR_KERNEL(gen_kill, GEN_KILL_OP)
+
+#ifdef BITSET_X86_SIMD
+
+// vector versions of ops, `old` is current vector of d
+#define UNION_OP_128(old, a, b, c) _mm_or_si128(old, a)
+#define INTERSECT_OP_128(old, a, b, c) _mm_and_si128(old, a)
+#define DIFF_OP_128(old, a, b, c) _mm_andnot_si128(a, old)
+#define GEN_KILL_OP_128(old, a, b, c) _mm_or_si128(a, _mm_andnot_si128(c, b))
+
+#define UNION_OP_256(old, a, b, c) _mm256_or_si256(old, a)
+#define INTERSECT_OP_256(old, a, b, c) _mm256_and_si256(old, a)
+#define DIFF_OP_256(old, a, b, c) _mm256_andnot_si256(a, old)
+#define GEN_KILL_OP_256(old, a, b, c)                                          \
+  _mm256_or_si256(a, _mm256_andnot_si256(c, b))
+
+#define LOAD_128(p, i)                                                         \
+  ((p) ? _mm_loadu_si128((const __m128i *)((p) + (i))) : zero)
+#define LOAD_256(p, i)                                                         \
+  ((p) ? _mm256_loadu_si256((const __m256i *)((p) + (i))) : zero)
+
+// 2 words per step, tail is done by scalar kernel
+#define SSE2_KERNEL(name, OP)                                                  \
+  __attribute__((target("sse2"))) static bool name##_sse2(                     \
+      uint64_t *d, const uint64_t *a, const uint64_t *b, const uint64_t *c,    \
+      size_t n) {                                                              \
+    const __m128i zero = _mm_setzero_si128();                                  \
+    __m128i changed = zero;                                                    \
+    size_t i = 0;                                                              \
+    for (; i + 2 <= n; i += 2) {                                               \
+      __m128i old = _mm_loadu_si128((const __m128i *)(d + i));                 \
+      __m128i v = OP(old, LOAD_128(a, i), LOAD_128(b, i), LOAD_128(c, i));     \
+      _mm_storeu_si128((__m128i *)(d + i), v);                                 \
+      changed = _mm_or_si128(changed, _mm_xor_si128(v, old));                  \
+    }                                                                          \
+    bool res = _mm_movemask_epi8(_mm_cmpeq_epi8(changed, zero)) != 0xffff;     \
+    if (i < n)                                                                 \
+      res |= name##_scalar(d + i, a + i, b ? b + i : NULL, c ? c + i : NULL,   \
+                           n - i);                                             \
+    return res;                                                                \
+  }
+
+// 4 words per step, tail is done by scalar kernel
+#define AVX2_KERNEL(name, OP)                                                  \
+  __attribute__((target("avx2"))) static bool name##_avx2(                     \
+      uint64_t *d, const uint64_t *a, const uint64_t *b, const uint64_t *c,    \
+      size_t n) {                                                              \
+    const __m256i zero = _mm256_setzero_si256();                               \
+    __m256i changed = zero;                                                    \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+      __m256i old = _mm256_loadu_si256((const __m256i *)(d + i));              \
+      __m256i v = OP(old, LOAD_256(a, i), LOAD_256(b, i), LOAD_256(c, i));     \
+      _mm256_storeu_si256((__m256i *)(d + i), v);                              \
+      changed = _mm256_or_si256(changed, _mm256_xor_si256(v, old));            \
+    }                                                                          \
+    bool res = !_mm256_testz_si256(changed, changed);                          \
+    if (i < n)                                                                 \
+      res |= name##_scalar(d + i, a + i, b ? b + i : NULL, c ? c + i : NULL,   \
+                           n - i);                                             \
+    return res;                                                                \
+  }
+
+SSE2_KERNEL(union, UNION_OP_128)
+SSE2_KERNEL(intersect, INTERSECT_OP_128)
+SSE2_KERNEL(diff, DIFF_OP_128)
+SSE2_KERNEL(gen_kill, GEN_KILL_OP_128)
+
+AVX2_KERNEL(union, UNION_OP_256)
+AVX2_KERNEL(intersect, INTERSECT_OP_256)
+AVX2_KERNEL(diff, DIFF_OP_256)
+AVX2_KERNEL(gen_kill, GEN_KILL_OP_256)
+
+#endif
+
+static bitset_kernel union_kernel = union_scalar;
+static bitset_kernel intersect_kernel = intersect_scalar;
+static bitset_kernel diff_kernel = diff_scalar;
+static bitset_kernel gen_kill_kernel = gen_kill_scalar;
+
+// picks best kernels supported by cpu, once
+static void select_kernels(void) {
+#ifdef BITSET_X86_SIMD
+  static bool selected = false;
+  if (selected)
+    return;
+  selected = true;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    union_kernel = union_avx2;
+    intersect_kernel = intersect_avx2;
+    diff_kernel = diff_avx2;
+    gen_kill_kernel = gen_kill_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    union_kernel = union_sse2;
+    intersect_kernel = intersect_sse2;
+    diff_kernel = diff_sse2;
+    gen_kill_kernel = gen_kill_sse2;
+  }
+#endif
+}
+
+#define DISPATCH(name, d, a, b, c, n)                                          \
+  do {                                                                         \
+    if ((n) < BITSET_SIMD_MIN_WORDS)                                           \
+      return name##_scalar(d, a, b, c, n);                                     \
+    select_kernels();                                                          \
+    return name##_kernel(d, a, b, c, n);                                       \
+  } while (0)
+
+bool bitset_union(bitset *dst, const bitset *src) {
+  DISPATCH(union, dst->w, src->w, NULL, NULL, dst->words);
+}
+
+bool bitset_intersect(bitset *dst, const bitset *src) {
+  DISPATCH(intersect, dst->w, src->w, NULL, NULL, dst->words);
+}
+
+bool bitset_diff(bitset *dst, const bitset *src) {
+  DISPATCH(diff, dst->w, src->w, NULL, NULL, dst->words);
+}
+
+bool bitset_gen_kill(bitset *dst, const bitset *gen, const bitset *in,
+                     const bitset *kill) {
+  DISPATCH(gen_kill, dst->w, gen->w, in->w, kill->w, dst->words);
+}
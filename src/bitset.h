@@ -0,0 +1,79 @@
+#ifndef _ASCC_BITSET_H
+#define _ASCC_BITSET_H
+
+#include "common.h"
+#include <string.h>
+
+// Dense bitset over [0, bits), stored as 64 bit words. Words past `bits` are
+// always kept zero, so set operations can work on whole words.
+
+typedef struct _bitset bitset;
+
+struct _bitset {
+  uint64_t *w;  // words
+  size_t words; // amount of words
+};
+
+#define BITSET_WORDS(bits) (((bits) + 63) / 64)
+
+// allocates zeroed bitset which can hold `bits` bits
+void bitset_init(bitset *s, size_t bits);
+
+// makes bitset view over `storage`, which should have BITSET_WORDS(bits)
+// zeroed words
+void bitset_init_on(bitset *s, uint64_t *storage, size_t bits);
+
+// frees bitset created by bitset_init
+void bitset_free(bitset *s);
+
+static inline void bitset_set(bitset *s, size_t i) {
+  s->w[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void bitset_unset(bitset *s, size_t i) {
+  s->w[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static inline bool bitset_test(const bitset *s, size_t i) {
+  return (s->w[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bitset_clear(bitset *s) {
+  memset(s->w, 0, sizeof(uint64_t) * s->words);
+}
+
+static inline void bitset_copy(bitset *dst, const bitset *src) {
+  memcpy(dst->w, src->w, sizeof(uint64_t) * dst->words);
+}
+
+// sets bits [0, bits)
+void bitset_fill(bitset *s, size_t bits);
+
+// all binary ops expect sets of same size
+
+// dst |= src, returns true if dst changed
+bool bitset_union(bitset *dst, const bitset *src);
+
+// dst &= src, returns true if dst changed
+bool bitset_intersect(bitset *dst, const bitset *src);
+
+// dst &= ~src, returns true if dst changed
+bool bitset_diff(bitset *dst, const bitset *src);
+
+// dst = gen | (in & ~kill), returns true if dst changed. Transfer function of
+// most gen/kill dataflow problems
+bool bitset_gen_kill(bitset *dst, const bitset *gen, const bitset *in,
+                     const bitset *kill);
+
+bool bitset_eq(const bitset *a, const bitset *b);
+
+size_t bitset_count(const bitset *s);
+
+// iterates over set bits of bitset in increasing order, `i` is size_t index
+#define bitset_foreach(s, i)                                                   \
+  for (size_t _w = 0, i = 0; _w < (s)->words; ++_w)                            \
+    for (uint64_t _bits = (s)->w[_w];                                          \
+         _bits != 0 && ((i = _w * 64 + __builtin_ctzll(_bits)), 1);            \
+         _bits &= _bits - 1)
+
+#endif
@@ -0,0 +1,521 @@
+#include "cfg.h"
+#include "bitset.h"
+#include "common.h"
+#include "dataflow.h"
+#include "strings.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern int label_idx_counter; // defined in resolve.c
+
+tacv *taci_dst(taci *i) {
+  switch (i->op) {
+  case TAC_INC:
+  case TAC_DEC:
+    return &i->v.s.src1;
+  case TAC_NEGATE:
+  case TAC_COMPLEMENT:
+  case TAC_NOT:
+  case TAC_CPY:
+  case TAC_ASADD:
+  case TAC_ASSUB:
+  case TAC_ASMUL:
+  case TAC_ASDIV:
+  case TAC_ASMOD:
+  case TAC_ASAND:
+  case TAC_ASOR:
+  case TAC_ASXOR:
+  case TAC_ASLSHIFT:
+  case TAC_ASRSHIFT:
+  case TAC_SIGN_EXTEND:
+  case TAC_ZERO_EXTEND:
+  case TAC_TRUNCATE:
+  case TAC_ADD:
+  case TAC_SUB:
+  case TAC_MUL:
+  case TAC_DIV:
+  case TAC_MOD:
+  case TAC_AND:
+  case TAC_OR:
+  case TAC_XOR:
+  case TAC_LSHIFT:
+  case TAC_RSHIFT:
+  case TAC_EQ:
+  case TAC_NE:
+  case TAC_LT:
+  case TAC_LE:
+  case TAC_GT:
+  case TAC_GE:
+  case TAC_CALL:
+    return &i->dst;
+  case TAC_RET:
+  case TAC_JMP:
+  case TAC_JZ:
+  case TAC_JNZ:
+  case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
+  case TAC_LABEL:
+  case TAC_JTAB:
+    return NULL;
+  }
+
+  UNREACHABLE();
+}
+
+void taci_foreach_src(taci *i, void (*fn)(tacv *v, void *ctx), void *ctx) {
+  switch (i->op) {
+  case TAC_RET:
+  case TAC_INC:
+  case TAC_DEC:
+  case TAC_NEGATE:
+  case TAC_COMPLEMENT:
+  case TAC_NOT:
+  case TAC_CPY:
+  case TAC_SIGN_EXTEND:
+  case TAC_ZERO_EXTEND:
+  case TAC_TRUNCATE:
+  case TAC_JZ:
+  case TAC_JNZ:
+    fn(&i->v.s.src1, ctx);
+    break;
+  case TAC_ASADD:
+  case TAC_ASSUB:
+  case TAC_ASMUL:
+  case TAC_ASDIV:
+  case TAC_ASMOD:
+  case TAC_ASAND:
+  case TAC_ASOR:
+  case TAC_ASXOR:
+  case TAC_ASLSHIFT:
+  case TAC_ASRSHIFT:
+    fn(&i->dst, ctx);
+    fn(&i->v.s.src1, ctx);
+    break;
+  case TAC_ADD:
+  case TAC_SUB:
+  case TAC_MUL:
+  case TAC_DIV:
+  case TAC_MOD:
+  case TAC_AND:
+  case TAC_OR:
+  case TAC_XOR:
+  case TAC_LSHIFT:
+  case TAC_RSHIFT:
+  case TAC_EQ:
+  case TAC_NE:
+  case TAC_LT:
+  case TAC_LE:
+  case TAC_GT:
+  case TAC_GE:
+  case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
+    fn(&i->v.s.src1, ctx);
+    fn(&i->v.s.src2, ctx);
+    break;
+  case TAC_CALL:
+    for (size_t j = 0; j < i->v.call.args_len; ++j)
+      fn(&i->v.call.args[j], ctx);
+    break;
+  case TAC_JTAB:
+    fn(&i->v.jtab.idx, ctx);
+    break;
+  case TAC_JMP:
+  case TAC_LABEL:
+    break;
+  }
+}
+
+static bool is_terminator(taci *i) {
+  switch (i->op) {
+  case TAC_RET:
+  case TAC_JMP:
+  case TAC_JZ:
+  case TAC_JNZ:
+  case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
+  case TAC_JTAB:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_falling_through(taci *last) {
+  return last->op != TAC_RET && last->op != TAC_JMP && last->op != TAC_JTAB;
+}
+
+int cfg_var_idx(cfg *g, tacv *v) {
+  if (v->t != TACV_VAR)
+    return -1;
+  return (int)(intptr_t)ht_get(g->var_idx, v->v.var) - 1;
+}
+
+static void register_var(tacv *v, void *ctx) {
+  cfg *g = ctx;
+  if (v->t != TACV_VAR || ht_get(g->var_idx, v->v.var) != NULL)
+    return;
+
+  syme *e = ht_get(g->st->t, v->v.var);
+  assert(e);
+  if (e->a.t != ATTR_LOCAL)
+    return;
+
+  vec_push_back(g->vars, v->v.var);
+  ht_set(g->var_idx, v->v.var, (void *)(intptr_t)g->vars.size);
+}
+
+static void new_block(cfg *g, taci *first) {
+  cfg_block b;
+  b.idx = g->blocks.size;
+  b.first = b.last = first;
+  vec_init(b.succs);
+  vec_init(b.preds);
+  vec_push_back(g->blocks, b);
+}
+
+static void add_edge(cfg *g, int from, int to) {
+  vec_foreach(int, g->blocks.data[from].succs, it) {
+    if (*it == to)
+      return;
+  }
+  vec_push_back(g->blocks.data[from].succs, to);
+  vec_push_back(g->blocks.data[to].preds, from);
+}
+
+typedef struct {
+  cfg *g;
+  cfg_block *b;
+} use_ctx;
+
+static void collect_use(tacv *v, void *ctx) {
+  use_ctx *c = ctx;
+  int idx = cfg_var_idx(c->g, v);
+  if (idx >= 0 && idx < c->g->live_vars && !bitset_test(&c->b->def, idx))
+    bitset_set(&c->b->use, idx);
+}
+
+static void compute_use_def(cfg *g, cfg_block *b) {
+  use_ctx c = {g, b};
+  for (taci *i = b->first;; i = i->next) {
+    taci_foreach_src(i, collect_use, &c);
+    tacv *dst = taci_dst(i);
+    if (dst != NULL) {
+      int idx = cfg_var_idx(g, dst);
+      if (idx >= 0 && idx < g->live_vars)
+        bitset_set(&b->def, idx);
+    }
+    if (i == b->last)
+      break;
+  }
+}
+
+typedef struct {
+  cfg *g;
+  int b;
+  int *def_block; // var idx -> idx of last block which has written var
+  bool *exposed;  // var idx -> true if var is read before written in block
+} exposed_ctx;
+
+static void mark_exposed(tacv *v, void *ctx) {
+  exposed_ctx *c = ctx;
+  int idx = cfg_var_idx(c->g, v);
+  if (idx >= 0 && c->def_block[idx] != c->b)
+    c->exposed[idx] = true;
+}
+
+// renumbers vars, so ones which are read before written in some block come
+// first
+static void find_live_vars(cfg *g) {
+  size_t n = g->vars.size;
+  exposed_ctx c;
+  c.g = g;
+  c.def_block = malloc(sizeof(int) * (n ? n : 1));
+  c.exposed = calloc(n ? n : 1, sizeof(bool));
+  assert(c.def_block && c.exposed);
+  memset(c.def_block, -1, sizeof(int) * n);
+
+  vec_foreach(cfg_block, g->blocks, b) {
+    c.b = b->idx;
+    for (taci *i = b->first;; i = i->next) {
+      taci_foreach_src(i, mark_exposed, &c);
+      tacv *dst = taci_dst(i);
+      int idx = dst != NULL ? cfg_var_idx(g, dst) : -1;
+      if (idx >= 0)
+        c.def_block[idx] = b->idx;
+      if (i == b->last)
+        break;
+    }
+  }
+
+  // params are defined before entry block
+  for (int i = 0; i < g->f->params_len; ++i) {
+    int idx = (int)(intptr_t)ht_get(g->var_idx, g->f->params[i]) - 1;
+    if (idx >= 0)
+      c.exposed[idx] = true;
+  }
+
+  VEC(string) ordered;
+  vec_init(ordered);
+  vec_reserve(ordered, n);
+  for (size_t i = 0; i < n; ++i)
+    if (c.exposed[i])
+      vec_push_back(ordered, g->vars.data[i]);
+  g->live_vars = ordered.size;
+  for (size_t i = 0; i < n; ++i)
+    if (!c.exposed[i])
+      vec_push_back(ordered, g->vars.data[i]);
+
+  for (size_t i = 0; i < n; ++i)
+    ht_set(g->var_idx, ordered.data[i], (void *)(intptr_t)(i + 1));
+
+  vec_free(g->vars);
+  g->vars.data = ordered.data;
+  g->vars.size = ordered.size;
+  g->vars.cap = ordered.cap;
+
+  free(c.def_block);
+  free(c.exposed);
+}
+
+void build_cfg(cfg *g, tacf *f, sym_table *st) {
+  g->f = f;
+  g->st = st;
+  g->var_idx = ht_create();
+  vec_init(g->vars);
+  vec_init(g->blocks);
+
+  // number vars and find biggest label
+  int max_label = 0;
+  for (int i = 0; i < f->params_len; ++i) {
+    tacv p;
+    p.t = TACV_VAR;
+    p.v.var = f->params[i];
+    register_var(&p, g);
+  }
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    taci_foreach_src(i, register_var, g);
+    tacv *dst = taci_dst(i);
+    if (dst != NULL)
+      register_var(dst, g);
+    if (i->op == TAC_LABEL && i->label_idx > max_label)
+      max_label = i->label_idx;
+  }
+
+  // split into blocks
+  int *label_block = malloc(sizeof(int) * (max_label + 1));
+  assert(label_block);
+  memset(label_block, -1, sizeof(int) * (max_label + 1));
+
+  taci *prev = NULL;
+  for (taci *i = f->firsti; i != NULL; prev = i, i = i->next) {
+    if (prev == NULL || is_terminator(prev) || i->op == TAC_LABEL)
+      new_block(g, i);
+    else
+      vec_back(g->blocks).last = i;
+
+    if (i->op == TAC_LABEL)
+      label_block[i->label_idx] = vec_back(g->blocks).idx;
+  }
+
+  // link blocks
+  for (size_t b = 0; b < g->blocks.size; ++b) {
+    taci *last = g->blocks.data[b].last;
+    bool falls_through = is_falling_through(last);
+
+    if (last->op == TAC_JMP || (last->op >= TAC_JZ && last->op <= TAC_JGE)) {
+      assert(last->label_idx <= max_label && label_block[last->label_idx] >= 0);
+      add_edge(g, b, label_block[last->label_idx]);
+    }
+    if (last->op == TAC_JTAB) {
+      for (size_t j = 0; j < last->v.jtab.labels_len; ++j) {
+        int l = last->v.jtab.labels[j];
+        assert(l <= max_label && label_block[l] >= 0);
+        add_edge(g, b, label_block[l]);
+      }
+    }
+
+    if (falls_through && b + 1 < g->blocks.size)
+      add_edge(g, b, b + 1);
+  }
+
+  free(label_block);
+
+  find_live_vars(g);
+
+  // alloc bitsets
+  size_t words = BITSET_WORDS(g->live_vars);
+  g->sets = calloc(words * 4 * g->blocks.size + 1, sizeof(uint64_t));
+  assert(g->sets);
+
+  uint64_t *s = g->sets;
+  vec_foreach(cfg_block, g->blocks, b) {
+    bitset_init_on(&b->use, s, g->live_vars);
+    bitset_init_on(&b->def, s + words, g->live_vars);
+    bitset_init_on(&b->live_in, s + words * 2, g->live_vars);
+    bitset_init_on(&b->live_out, s + words * 3, g->live_vars);
+    s += words * 4;
+    compute_use_def(g, b);
+  }
+}
+
+static int_vec *block_succs(int node, void *ctx) {
+  return &((cfg *)ctx)->blocks.data[node].succs;
+}
+
+static int_vec *block_preds(int node, void *ctx) {
+  return &((cfg *)ctx)->blocks.data[node].preds;
+}
+
+static bool liveness_transfer(int node, bitset *res, const bitset *input,
+                              void *ctx) {
+  cfg_block *b = &((cfg *)ctx)->blocks.data[node];
+  return bitset_gen_kill(res, &b->use, input, &b->def);
+}
+
+void analyze_liveness(cfg *g) {
+  size_t n = g->blocks.size;
+  bitset *in = malloc(sizeof(bitset) * (n ? n : 1));
+  bitset *out = malloc(sizeof(bitset) * (n ? n : 1));
+  assert(in && out);
+  for (size_t i = 0; i < n; ++i) {
+    in[i] = g->blocks.data[i].live_in;
+    out[i] = g->blocks.data[i].live_out;
+  }
+
+  df_problem p;
+  p.backward = true;
+  p.nodes = n;
+  p.bits = g->live_vars;
+  p.succs = block_succs;
+  p.preds = block_preds;
+  p.meet = bitset_union;
+  p.transfer = liveness_transfer;
+  p.ctx = g;
+  p.in = in;
+  p.out = out;
+  df_solve(&p);
+
+  free(in);
+  free(out);
+}
+
+void find_cfg_loops(cfg *g, df_loop_vec *loops) {
+  df_find_loops(g->blocks.size, block_succs, block_preds, g, loops);
+}
+
+bool loop_has_single_entry(cfg *g, df_loop *l) {
+  bitset_foreach(&l->body, b) {
+    if (b == l->header)
+      continue;
+    vec_foreach(int, g->blocks.data[b].preds, it) {
+      if (!bitset_test(&l->body, *it))
+        return false;
+    }
+  }
+  return true;
+}
+
+static void retarget(taci *i, int from, int to) {
+  if (i->op == TAC_JMP || (i->op >= TAC_JZ && i->op <= TAC_JGE)) {
+    if (i->label_idx == from)
+      i->label_idx = to;
+  } else if (i->op == TAC_JTAB) {
+    for (size_t j = 0; j < i->v.jtab.labels_len; ++j)
+      if (i->v.jtab.labels[j] == from)
+        i->v.jtab.labels[j] = to;
+  }
+}
+
+void insert_preheader(cfg *g, df_loop *l, taci *first, taci *last,
+                      arena *a) {
+  cfg_block *header = &g->blocks.data[l->header];
+  assert(header->first->op == TAC_LABEL);
+  int label = header->first->label_idx;
+
+  taci **link = &g->f->firsti;
+  while (*link != header->first)
+    link = &(*link)->next;
+
+  // block before header in list may be part of loop which falls into header
+  int prev = l->header - 1;
+  if (prev >= 0 && bitset_test(&l->body, prev) &&
+      is_falling_through(g->blocks.data[prev].last)) {
+    taci *j = *link = new_taci(a, TAC_JMP);
+    j->label_idx = label;
+    link = &j->next;
+  }
+  taci *pre = *link = new_taci(a, TAC_LABEL);
+  pre->label_idx = ++label_idx_counter;
+  pre->next = first;
+  last->next = header->first;
+
+  vec_foreach(int, header->preds, it) {
+    if (!bitset_test(&l->body, *it))
+      retarget(g->blocks.data[*it].last, label, pre->label_idx);
+  }
+}
+
+static void print_idxs(FILE *f, int_vec *v) {
+  if (vec_empty(*v)) {
+    fprintf(f, "-");
+    return;
+  }
+  for (size_t i = 0; i < v->size; ++i)
+    fprintf(f, i == 0 ? "B%d" : ", B%d", v->data[i]);
+}
+
+static void print_set(FILE *f, cfg *g, bitset *set) {
+  fprintf(f, "{");
+  bool first = true;
+  bitset_foreach(set, i) {
+    fprintf(f, first ? "%s" : ", %s", g->vars.data[i]);
+    first = false;
+  }
+  fprintf(f, "}");
+}
+
+void print_cfg_block_header(FILE *f, cfg *g, cfg_block *b) {
+  fprintf(f, "\t# B%d (preds: ", b->idx);
+  print_idxs(f, &b->preds);
+  fprintf(f, "; succs: ");
+  print_idxs(f, &b->succs);
+  fprintf(f, ")\n\t# live-in: ");
+  print_set(f, g, &b->live_in);
+  fprintf(f, "\n");
+}
+
+void print_cfg_block_footer(FILE *f, cfg *g, cfg_block *b) {
+  fprintf(f, "\t# live-out: ");
+  print_set(f, g, &b->live_out);
+  fprintf(f, "\n");
+}
+
+void free_cfg(cfg *g) {
+  vec_foreach(cfg_block, g->blocks, b) {
+    vec_free(b->succs);
+    vec_free(b->preds);
+  }
+  vec_free(g->blocks);
+  vec_free(g->vars);
+  ht_destroy(g->var_idx);
+  free(g->sets);
+}
@@ -0,0 +1,82 @@
+#ifndef _ASCC_CFG_H
+#define _ASCC_CFG_H
+
+#include "bitset.h"
+#include "common.h"
+#include "dataflow.h"
+#include "tac.h"
+#include "table.h"
+#include "typecheck.h"
+#include "vec.h"
+
+typedef struct _cfg cfg;
+typedef struct _cfg_block cfg_block;
+
+struct _cfg_block {
+  int idx;
+  taci *first; // first instr of block
+  taci *last;  // last instr of block (inclusive)
+
+  int_vec succs; // idxs of successor blocks
+  int_vec preds; // idxs of predecessor blocks
+
+  // bitsets over cfg vars [0, live_vars)
+  bitset use;      // vars read before being written in block
+  bitset def;      // vars written in block
+  bitset live_in;  // vars live at block entry
+  bitset live_out; // vars live at block exit
+};
+
+struct _cfg {
+  tacf *f;
+  sym_table *st;
+
+  VEC(cfg_block) blocks; // blocks[0] is entry
+
+  // only non-static vars are tracked, static ones live in memory and are
+  // treated as always live
+  ht *var_idx;      // var name -> index + 1
+  VEC(string) vars; // index -> var name
+
+  // vars [0, live_vars) are read before written in some block, so they can be
+  // live across blocks and are the only ones kept in bitsets. rest (most of
+  // the temporaries) never leave their block
+  size_t live_vars;
+
+  uint64_t *sets; // storage for all bitsets of blocks
+};
+
+// returns pointer to val written by instr, NULL if instr doesn't write
+tacv *taci_dst(taci *i);
+
+// calls fn for each val read by instr (including consts)
+void taci_foreach_src(taci *i, void (*fn)(tacv *v, void *ctx), void *ctx);
+
+// splits instrs of function into basic blocks and links them
+void build_cfg(cfg *g, tacf *f, sym_table *st);
+
+// computes live_in/live_out for each block of built cfg
+void analyze_liveness(cfg *g);
+
+// finds loops of built cfg, see df_find_loops, free with df_free_loops
+void find_cfg_loops(cfg *g, df_loop_vec *loops);
+
+// true if blocks of loop other than header are entered only from the loop, so
+// header dominates them
+bool loop_has_single_entry(cfg *g, df_loop *l);
+
+// links instrs first..last into new block put before header of loop (which
+// starts with label), jumps into loop from outside are retargeted to it. Label
+// of the block and jump (if needed) are allocated from arena a
+void insert_preheader(cfg *g, df_loop *l, taci *first, taci *last,
+                      arena *a);
+
+// returns index of var in cfg, -1 if var is not tracked
+int cfg_var_idx(cfg *g, tacv *v);
+
+void print_cfg_block_header(FILE *f, cfg *g, cfg_block *b);
+void print_cfg_block_footer(FILE *f, cfg *g, cfg_block *b);
+
+void free_cfg(cfg *g);
+
+#endif
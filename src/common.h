@@ -31,18 +31,16 @@
 #define ASM_DONT_FIX_INSTRUCTIONS
 #undef ASM_DONT_FIX_INSTRUCTIONS
 
-// If "PRINT_TAC_ORIGIN_X86" if defined each x86 line will have it's tac origin
-// printed in final assembly
-#define PRINT_TAC_ORIGIN_X86
+// Tac origin of each x86 line and tables of var names to their regs and mem
+// layouts are emitted with -fverbose-asm
 
 // If "PRINT_TAC_ORIGIN_X86_ONE_TIME" is defined tac origin will be printend
-// before block of x86 not after each instr, requires "PRINT_TAC_ORIGIN_X86" to
-// be enabled
+// before block of x86 not after each instr
 #define PRINT_TAC_ORIGIN_X86_ONE_TIME
 
-// If "PRINT_VARS_LAYOUT_X86" is defined table of tac var names to mem layouts
-// will be emitted
-#define PRINT_VARS_LAYOUT_X86
+// If "BITSET_SIMD" is defined bitset operations will use SSE2/AVX2 kernels
+// when cpu supports them
+#define BITSET_SIMD
 
 #define UNREACHABLE()                                                          \
   do {                                                                         \
@@ -0,0 +1,179 @@
+#include "dataflow.h"
+#include "bitset.h"
+#include "common.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t df_solve(df_problem *p) {
+  if (p->nodes == 0)
+    return 0;
+
+  VEC(int) worklist;
+  vec_init(worklist);
+  vec_reserve(worklist, p->nodes);
+  bool *in_worklist = malloc(sizeof(bool) * p->nodes);
+  assert(in_worklist);
+
+  // worklist is popped from back, so for backward problems last node is
+  // processed first, for forward ones entry is
+  for (size_t i = 0; i < p->nodes; ++i) {
+    vec_push_back(worklist, p->backward ? i : p->nodes - 1 - i);
+    in_worklist[i] = true;
+  }
+
+  size_t steps = 0;
+  while (!vec_empty(worklist)) {
+    int node = vec_back(worklist);
+    vec_pop_back(worklist);
+    in_worklist[node] = false;
+
+    bitset *input = p->backward ? &p->out[node] : &p->in[node];
+    bitset *res = p->backward ? &p->in[node] : &p->out[node];
+    int_vec *from =
+        p->backward ? p->succs(node, p->ctx) : p->preds(node, p->ctx);
+    int_vec *to =
+        p->backward ? p->preds(node, p->ctx) : p->succs(node, p->ctx);
+
+    // sets flowing from neighbours
+    bitset *flow = p->backward ? p->in : p->out;
+
+    if (!vec_empty(*from)) {
+      bitset_copy(input, &flow[from->data[0]]);
+      for (size_t i = 1; i < from->size; ++i)
+        p->meet(input, &flow[from->data[i]]);
+    } else {
+      bitset_clear(input);
+    }
+
+    ++steps;
+    if (!p->transfer(node, res, input, p->ctx))
+      continue;
+
+    vec_foreach(int, *to, it) {
+      if (!in_worklist[*it]) {
+        vec_push_back(worklist, *it);
+        in_worklist[*it] = true;
+      }
+    }
+  }
+
+  vec_free(worklist);
+  free(in_worklist);
+  return steps;
+}
+
+typedef struct {
+  int header;
+  int tail;
+} back_edge;
+
+static int back_edge_cmp(const void *a, const void *b) {
+  return ((back_edge *)a)->header - ((back_edge *)b)->header;
+}
+
+static int loop_size_cmp(const void *a, const void *b) {
+  size_t sa = ((df_loop *)a)->size, sb = ((df_loop *)b)->size;
+  return sa < sb ? -1 : sa > sb;
+}
+
+void df_find_loops(size_t nodes, int_vec *(*succs)(int node, void *ctx),
+                   int_vec *(*preds)(int node, void *ctx), void *ctx,
+                   df_loop_vec *loops) {
+  vec_init(*loops);
+  if (nodes == 0)
+    return;
+
+  // 0 - not visited, 1 - on dfs stack, 2 - done
+  char *state = calloc(nodes, sizeof(char));
+  assert(state);
+
+  VEC(back_edge) edges;
+  vec_init(edges);
+
+  // iterative dfs, stack holds node and idx of next succ to visit
+  VEC(int) stack;
+  vec_init(stack);
+  vec_push_back(stack, 0);
+  vec_push_back(stack, 0);
+  state[0] = 1;
+  while (!vec_empty(stack)) {
+    int node = stack.data[stack.size - 2];
+    int *next = &stack.data[stack.size - 1];
+    int_vec *s = succs(node, ctx);
+    if (*next == s->size) {
+      state[node] = 2;
+      stack.size -= 2;
+      continue;
+    }
+
+    int succ = s->data[(*next)++];
+    if (state[succ] == 1) {
+      back_edge e = {succ, node};
+      vec_push_back(edges, e);
+    } else if (state[succ] == 0) {
+      state[succ] = 1;
+      vec_push_back(stack, succ);
+      vec_push_back(stack, 0);
+    }
+  }
+
+  if (!vec_empty(edges))
+    qsort(edges.data, edges.size, sizeof(back_edge), back_edge_cmp);
+
+  // walk preds from tails of each header, body is what is reached
+  VEC(int) worklist;
+  vec_init(worklist);
+  for (size_t i = 0; i < edges.size;) {
+    df_loop l;
+    l.header = edges.data[i].header;
+    l.size = 1;
+    bitset_init(&l.body, nodes);
+    bitset_set(&l.body, l.header);
+    for (; i < edges.size && edges.data[i].header == l.header; ++i)
+      vec_push_back(worklist, edges.data[i].tail);
+
+    while (!vec_empty(worklist)) {
+      int node = vec_back(worklist);
+      vec_pop_back(worklist);
+      if (bitset_test(&l.body, node))
+        continue;
+      bitset_set(&l.body, node);
+      ++l.size;
+      vec_foreach(int, *preds(node, ctx), it) {
+        if (!bitset_test(&l.body, *it))
+          vec_push_back(worklist, *it);
+      }
+    }
+    vec_push_back(*loops, l);
+  }
+
+  if (!vec_empty(*loops))
+    qsort(loops->data, loops->size, sizeof(df_loop), loop_size_cmp);
+
+  vec_free(worklist);
+  vec_free(stack);
+  vec_free(edges);
+  free(state);
+}
+
+void df_free_loops(df_loop_vec *loops) {
+  vec_foreach(df_loop, *loops, l) bitset_free(&l->body);
+  vec_free(*loops);
+}
+
+void df_loop_depths(size_t nodes, int_vec *(*succs)(int node, void *ctx),
+                    int_vec *(*preds)(int node, void *ctx), void *ctx,
+                    int *depth) {
+  if (nodes == 0)
+    return;
+  memset(depth, 0, sizeof(int) * nodes);
+
+  df_loop_vec loops;
+  df_find_loops(nodes, succs, preds, ctx, &loops);
+  vec_foreach(df_loop, loops, l) {
+    bitset_foreach(&l->body, node) { ++depth[node]; }
+  }
+  df_free_loops(&loops);
+}
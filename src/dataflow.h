@@ -0,0 +1,70 @@
+#ifndef _ASCC_DATAFLOW_H
+#define _ASCC_DATAFLOW_H
+
+#include "bitset.h"
+#include "common.h"
+#include "vec.h"
+
+VEC_T(int_vec, int);
+
+typedef struct _df_problem df_problem;
+
+// Generic iterative worklist solver for bitset dataflow problems over any
+// graph (TAC cfg, x86 cfg). Nodes are [0, nodes), node 0 is entry.
+//
+// For forward problems in = meet(out of preds), out = transfer(in).
+// For backward problems out = meet(in of succs), in = transfer(out).
+// Nodes without neighbours in direction of flow (entry/exits) get empty input.
+//
+// Sets in `in` and `out` are provided and initialized by caller, (e.g. full
+// sets for must problems, so meet by intersection can only shrink them)
+struct _df_problem {
+  bool backward; // direction of analysis
+  size_t nodes;  // amount of nodes
+  size_t bits;   // size of each set
+
+  // neighbours of node
+  int_vec *(*succs)(int node, void *ctx);
+  int_vec *(*preds)(int node, void *ctx);
+
+  // combines set of neighbour into acc, (bitset_union for may problems,
+  // bitset_intersect for must problems)
+  bool (*meet)(bitset *acc, const bitset *from);
+
+  // computes result set of node from it's input, returns true if result changed
+  bool (*transfer)(int node, bitset *res, const bitset *input, void *ctx);
+
+  void *ctx; // passed to callbacks
+
+  bitset *in;  // per node
+  bitset *out; // per node
+};
+
+// solves problem until fixed point, returns amount of transfer calls
+size_t df_solve(df_problem *p);
+
+typedef struct {
+  int header;
+  bitset body; // nodes of loop, header included
+  size_t size; // amount of nodes in body
+} df_loop;
+
+VEC_T(df_loop_vec, df_loop);
+
+// Finds loops by back edges of dfs from node 0 (edges to node which is still
+// on dfs stack). Body of loop are nodes which reach source of back edge
+// without passing through it's header, back edges to same header form one
+// loop. Loops are sorted by size, so inner loops come before outer ones.
+// Header dominates body only if cfg is reducible, callers which need it check
+void df_find_loops(size_t nodes, int_vec *(*succs)(int node, void *ctx),
+                   int_vec *(*preds)(int node, void *ctx), void *ctx,
+                   df_loop_vec *loops);
+void df_free_loops(df_loop_vec *loops);
+
+// Computes loop nesting depth of each node into `depth`, by loops of
+// df_find_loops
+void df_loop_depths(size_t nodes, int_vec *(*succs)(int node, void *ctx),
+                    int_vec *(*preds)(int node, void *ctx), void *ctx,
+                    int *depth);
+
+#endif
@@ -42,11 +42,14 @@ void parse_driver_options(driver_options *d, int argc, char *argv[]) {
   d->output = NULL;
   d->input = NULL;
   vec_init(d->l_args);
+  vec_init(d->f_args);
+  d->opt_level = OPT_O2;
   size_t len;
 
   // i=0 for program name :)
   for (int i = 1; i < argc; ++i) {
-    assert((len = strlen(argv[i])) > 1);
+    len = strlen(argv[i]);
+    assert(len > 1);
     if (argv[i][0] == '-') { // flag
       if (next_arg_is_out) {
         fprintf(stderr, "expected outfile file name, found flag %s\n", argv[i]);
@@ -99,6 +102,30 @@ void parse_driver_options(driver_options *d, int argc, char *argv[]) {
         case 'C':
           SET_COMPILER_DOF(d, DOF_C);
           break;
+        case 'O': // -O<level>
+          if (!strcmp(argv[i], "-O0")) {
+            d->opt_level = OPT_O0;
+            continue;
+          }
+          if (!strcmp(argv[i], "-O1")) {
+            d->opt_level = OPT_O1;
+            continue;
+          }
+          if (!strcmp(argv[i], "-O2")) {
+            d->opt_level = OPT_O2;
+            continue;
+          }
+          if (!strcmp(argv[i], "-Os")) {
+            d->opt_level = OPT_OS;
+            continue;
+          }
+          break;
+        case 'f': // -f<flag>, checked by pass manager
+          if (len > 2) {
+            vec_push_back(d->f_args, new_string(argv[i] + 2));
+            continue;
+          }
+          break;
         case 'l': // -l<lib>
         {
           int j = 2;
@@ -173,11 +200,31 @@ static const char *dof_to_string(int dof) {
   }
 }
 
+static const char *opt_level_to_string(int level) {
+  switch (level) {
+  case OPT_O0:
+    return "-O0";
+  case OPT_O1:
+    return "-O1";
+  case OPT_O2:
+    return "-O2";
+  case OPT_OS:
+    return "-Os";
+  default:
+    return "Unknown";
+  }
+}
+
 static void print_driver_options(const driver_options *d) {
   printf("--- Driver Options ---\n");
   printf("Input file : %s\n", d->input ? d->input : "(none)");
   printf("Output file: %s\n", d->output ? d->output : "(none)");
   printf("Stage      : %s\n", dof_to_string(d->dof));
+  printf("Opt level  : %s\n", opt_level_to_string(d->opt_level));
+  if (d->f_args.size != 0) {
+    printf("Flags: \n");
+    vec_foreach(string, d->f_args, it) { printf("\t- -f%s\n", *it); }
+  }
   if (d->l_args.size != 0) {
     printf("Linked libraries: \n");
     vec_foreach(string, d->l_args, it) { printf("\t- %s\n", *it); }
@@ -21,6 +21,13 @@ enum {          // (dof - Driver Option Flag)
   DOF_ALL,      // do full pipeline
 };
 
+enum {    // optimization level
+  OPT_O0, // no optimizations                      | -O0
+  OPT_O1, // cheap optimizations                   | -O1
+  OPT_O2, // all optimizations (default)           | -O2
+  OPT_OS, // all optimizations, prefer smaller code | -Os
+};
+
 struct _driver_options {
   int dof; // driver option flag (enum)
 
@@ -29,6 +36,10 @@ struct _driver_options {
   const char *input;  // input file path
 
   VEC(string) l_args; // list of all passed `-l<lib>` flags
+
+  VEC(string) f_args; // list of all passed `-f<flag>` flags, without `-f`
+
+  int opt_level; // optimization level (enum) | -O0, -O1, -O2, -Os
 };
 
 void parse_driver_options(driver_options *d, int argc, char *argv[]);
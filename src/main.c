@@ -2,6 +2,7 @@
 #include "common.h"
 #include "driver.h"
 #include "parser.h"
+#include "pass.h"
 #include "scan.h"
 #include "strings.h"
 #include "tac.h"
@@ -146,8 +147,14 @@ int main(int argc, char *argv[]) {
 
   tac_program tac_prog = gen_tac(&parsed_ast, &st);
 
+  pass_manager pm;
+  init_pass_manager(&pm, &opts);
+  vec_free(opts.f_args);
+  run_tac_passes(&pm, &tac_prog, &st);
+
   if (opts.dof == DOF_TAC) {
-    print_tac(&tac_prog);
+    free_pass_manager(&pm);
+    print_tac(&tac_prog, &st);
     printf("\n");
     print_sym_table(&st);
     free_sym_table(&st);
@@ -155,7 +162,10 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  x86_program x86_prog = gen_asm(&tac_prog, &st);
+  x86_program x86_prog = gen_asm(&tac_prog, &st, &pm);
+  print_pass_times(&pm);
+  print_pass_stats(&pm);
+  free_pass_manager(&pm);
   free_sym_table(&st);
   free_program(&parsed_ast); // sym table has pointers to AST, so it can't be
                              // freed while sym table is alive
@@ -0,0 +1,293 @@
+#include "pass.h"
+#include "cfg.h"
+#include "common.h"
+#include "driver.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// defined in main.c
+double now_seconds();
+
+static const pass passes[] = {
+    {"inline", PASS_TAC, OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2),
+     {.tac = inline_for_func}, NULL, begin_inline, end_inline},
+    {"inline-size", PASS_TAC, OPT_BIT(OPT_OS), {.tac = inline_size_for_func},
+     NULL, begin_inline, end_inline},
+    {"tailcall", PASS_TAC, OPT_ALL, {.tac = tail_call_for_func}, NULL, NULL,
+     NULL},
+    {"constprop", PASS_TAC, OPT_ALL, {.tac = const_prop_for_func}, NULL, NULL,
+     NULL},
+    {"simplifycfg", PASS_TAC, OPT_ALL, {.tac = simplify_cfg_for_func}, NULL,
+     NULL, NULL},
+    {"copyprop", PASS_TAC, OPT_ALL, {.tac = copy_prop_for_func}, NULL, NULL,
+     NULL},
+    {"licm", PASS_TAC, OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2),
+     {.tac = licm_for_func}, print_licm_stats, NULL, NULL},
+    {"dce", PASS_TAC, OPT_ALL, {.tac = dce_for_func}, NULL, NULL, NULL},
+    {"ivs", PASS_TAC, OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2),
+     {.tac = reduce_ivs_for_func}, print_ivs_stats, NULL, NULL},
+    {"rotate", PASS_TAC, OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2),
+     {.tac = rotate_loops_for_func}, print_rotate_stats, NULL, NULL},
+    {"x86-simplifycfg", PASS_X86, OPT_ALL,
+     {.x86 = simplify_x86_cfg_for_func}, NULL, NULL, NULL},
+    {"cmov", PASS_X86, OPT_ALL, {.x86 = cmov_for_func}, print_cmov_stats, NULL,
+     NULL},
+    {"linear-scan", PASS_X86, OPT_BIT(OPT_O1), {.x86 = linear_scan_for_func},
+     NULL, NULL, NULL},
+    {"regalloc", PASS_X86, OPT_BIT(OPT_O2) | OPT_BIT(OPT_OS),
+     {.x86 = alloc_regs_for_func}, NULL, NULL, NULL},
+    {"stack-slots", PASS_X86, OPT_ALL, {.x86 = share_stack_slots_for_func},
+     print_stack_slot_stats, NULL, NULL},
+    {"peephole", PASS_X86_LATE, OPT_ALL, {.x86 = peephole_for_func},
+     print_peephole_stats, NULL, NULL},
+    {"block-placement", PASS_X86_LATE, OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2),
+     {.x86 = place_blocks_for_func}, print_block_placement_stats, NULL, NULL},
+};
+
+#define PASSES_LEN (sizeof(passes) / sizeof(passes[0]))
+
+static int find_pass(const char *name) {
+  for (size_t i = 0; i < PASSES_LEN; ++i)
+    if (!strcmp(passes[i].name, name))
+      return i;
+  return -1;
+}
+
+void init_pass_manager(pass_manager *pm, driver_options *d) {
+  pm->opt_level = d->opt_level;
+  pm->enabled = malloc(sizeof(bool) * PASSES_LEN);
+  pm->seconds = calloc(PASSES_LEN, sizeof(double));
+  assert(pm->enabled && pm->seconds);
+  pm->time = false;
+  pm->verify = false;
+  pm->stats = false;
+  pm->verbose_asm = false;
+  pm->omit_frame_pointer = false;
+
+  for (size_t i = 0; i < PASSES_LEN; ++i)
+    pm->enabled[i] = passes[i].levels & OPT_BIT(pm->opt_level);
+
+  vec_foreach(string, d->f_args, it) {
+    const char *flag = *it;
+    if (!strcmp(flag, "time-passes")) {
+      pm->time = true;
+      continue;
+    }
+    if (!strcmp(flag, "verify-passes")) {
+      pm->verify = true;
+      continue;
+    }
+    if (!strcmp(flag, "pass-stats")) {
+      pm->stats = true;
+      continue;
+    }
+    if (!strcmp(flag, "verbose-asm")) {
+      pm->verbose_asm = true;
+      continue;
+    }
+    if (!strcmp(flag, "omit-frame-pointer") ||
+        !strcmp(flag, "no-omit-frame-pointer")) {
+      pm->omit_frame_pointer = flag[0] != 'n';
+      continue;
+    }
+
+    bool on = strncmp(flag, "no-", 3) != 0;
+    int p = find_pass(on ? flag : flag + 3);
+    if (p < 0) {
+      fprintf(stderr, "invalid flag -f%s\n", flag);
+      exit(1);
+    }
+    pm->enabled[p] = on;
+  }
+}
+
+void free_pass_manager(pass_manager *pm) {
+  free(pm->enabled);
+  free(pm->seconds);
+}
+
+static void verify_fail(const char *fn, const char *after, const char *msg) {
+  fprintf(stderr, "verifier: %s in function %s after %s\n", msg, fn, after);
+  exit(1);
+}
+
+typedef struct {
+  sym_table *st;
+  tacf *f;
+  const char *after;
+} tac_verify_ctx;
+
+static void verify_tac_val(tacv *v, void *ctx) {
+  tac_verify_ctx *c = ctx;
+  if (v->t == TACV_VAR && ht_get(c->st->t, v->v.var) == NULL)
+    verify_fail(c->f->name, c->after,
+                string_sprintf("unknown var %s", v->v.var));
+}
+
+static bool is_tac_jump(taci *i) {
+  return i->op == TAC_JMP || (i->op >= TAC_JZ && i->op <= TAC_JGE);
+}
+
+// checks that jumps have targets and that all vars are in sym table
+static void verify_tac(tacf *f, sym_table *st, const char *after) {
+  tac_verify_ctx c = {st, f, after};
+  ht *labels = ht_create_int();
+
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (i->op != TAC_LABEL)
+      continue;
+    if (ht_get_int(labels, i->label_idx) != NULL)
+      verify_fail(f->name, after,
+                  string_sprintf("duplicate label L%d", i->label_idx));
+    ht_set_int(labels, i->label_idx, (void *)1);
+  }
+
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (is_tac_jump(i) && ht_get_int(labels, i->label_idx) == NULL)
+      verify_fail(f->name, after,
+                  string_sprintf("jump to missing label L%d", i->label_idx));
+    for (size_t j = 0; i->op == TAC_JTAB && j < i->v.jtab.labels_len; ++j)
+      if (ht_get_int(labels, i->v.jtab.labels[j]) == NULL)
+        verify_fail(f->name, after,
+                    string_sprintf("jump table to missing label L%d",
+                                   i->v.jtab.labels[j]));
+
+    tacv *dst = taci_dst(i);
+    if (dst != NULL && dst->t != TACV_VAR)
+      verify_fail(f->name, after,
+                  string_sprintf("%s writes to const", tacop_str(i->op)));
+    if (dst != NULL)
+      verify_tac_val(dst, &c);
+    taci_foreach_src(i, verify_tac_val, &c);
+  }
+
+  ht_destroy(labels);
+}
+
+// checks links of list, jump targets and operands. Late passes see code after
+// fix_instructions_for_func, without pseudos and with scratch regs
+static void verify_x86(x86_func *f, ht *bst, const char *after, bool late) {
+  ht *labels = ht_create_int();
+
+  x86_instr *prev = NULL;
+  for (x86_instr *i = f->first; i != NULL; prev = i, i = i->next) {
+    if (i->prev != prev)
+      verify_fail(f->name, after, "broken prev link");
+    if (i->op != X86_LABEL)
+      continue;
+    if (ht_get_int(labels, i->v.label) != NULL)
+      verify_fail(f->name, after,
+                  string_sprintf("duplicate label L%d", i->v.label));
+    ht_set_int(labels, i->v.label, (void *)1);
+  }
+
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    int target = i->op == X86_JMP     ? i->v.label
+                 : i->op == X86_JMPCC ? i->v.jmpcc.label_idx
+                                      : -1;
+    if (target >= 0 && ht_get_int(labels, target) == NULL)
+      verify_fail(f->name, after,
+                  string_sprintf("jump to missing label L%d", target));
+    for (size_t j = 0; i->op == X86_JMP_TABLE && j < i->v.jtab.labels_len; ++j)
+      if (ht_get_int(labels, i->v.jtab.labels[j]) == NULL)
+        verify_fail(f->name, after,
+                    string_sprintf("jump table to missing label L%d",
+                                   i->v.jtab.labels[j]));
+
+    x86_op_ref refs[X86_INSTR_MAX_OPS];
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j) {
+      x86_op *op = refs[j].op;
+      if (refs[j].def && op->t == X86_OP_IMM)
+        verify_fail(f->name, after, "write to immediate");
+      if (op->t == X86_OP_PSEUDO && late)
+        verify_fail(f->name, after, "pseudo after fix up");
+      if (op->t == X86_OP_PSEUDO && ht_get(bst, op->v.pseudo) == NULL)
+        verify_fail(f->name, after,
+                    string_sprintf("unknown pseudo %s", op->v.pseudo));
+      // scratch regs belong to fix_instructions_for_func
+      if (!late && op->t == X86_OP_REG &&
+          (op->v.reg == X86_R10 || op->v.reg == X86_R11))
+        verify_fail(f->name, after, "scratch reg used before fix up");
+    }
+  }
+
+  ht_destroy(labels);
+}
+
+void run_tac_passes(pass_manager *pm, tac_program *prog, sym_table *st) {
+  for (size_t p = 0; p < PASSES_LEN; ++p)
+    if (passes[p].t == PASS_TAC && pm->enabled[p] && passes[p].begin != NULL)
+      passes[p].begin(prog);
+
+  for (tac_top_level *tl = prog->first; tl != NULL; tl = tl->next) {
+    if (!tl->is_func)
+      continue;
+    tacf *f = &tl->v.f;
+
+    if (pm->verify)
+      verify_tac(f, st, "gen_tac");
+    for (size_t p = 0; p < PASSES_LEN; ++p) {
+      if (passes[p].t != PASS_TAC || !pm->enabled[p])
+        continue;
+
+      double start = pm->time ? now_seconds() : 0;
+      passes[p].run.tac(prog, f, st);
+      if (pm->time)
+        pm->seconds[p] += now_seconds() - start;
+
+      if (pm->verify)
+        verify_tac(f, st, passes[p].name);
+    }
+  }
+
+  for (size_t p = 0; p < PASSES_LEN; ++p)
+    if (passes[p].t == PASS_TAC && pm->enabled[p] && passes[p].end != NULL)
+      passes[p].end();
+}
+
+void run_x86_passes(pass_manager *pm, pass_t t, x86_asm_gen *ag, x86_func *f,
+                    ht *bst) {
+  bool late = t == PASS_X86_LATE;
+  if (pm->verify)
+    verify_x86(f, bst, late ? "fix_instructions" : "gen_asm", late);
+  for (size_t p = 0; p < PASSES_LEN; ++p) {
+    if (passes[p].t != t || !pm->enabled[p])
+      continue;
+
+    double start = pm->time ? now_seconds() : 0;
+    passes[p].run.x86(ag, f, bst);
+    if (pm->time)
+      pm->seconds[p] += now_seconds() - start;
+
+    if (pm->verify)
+      verify_x86(f, bst, passes[p].name, late);
+  }
+}
+
+void print_pass_times(pass_manager *pm) {
+  if (!pm->time)
+    return;
+  fprintf(stderr, "--- Pass Times ---\n");
+  for (size_t p = 0; p < PASSES_LEN; ++p)
+    if (pm->enabled[p])
+      fprintf(stderr, "%-16s %.6f s\n", passes[p].name, pm->seconds[p]);
+  fprintf(stderr, "------------------\n");
+}
+
+void print_pass_stats(pass_manager *pm) {
+  if (!pm->stats)
+    return;
+  fprintf(stderr, "--- Pass Stats ---\n");
+  for (size_t p = 0; p < PASSES_LEN; ++p)
+    if (pm->enabled[p] && passes[p].print_stats != NULL)
+      passes[p].print_stats();
+  fprintf(stderr, "------------------\n");
+}
@@ -0,0 +1,78 @@
+#ifndef _ASCC_PASS_H
+#define _ASCC_PASS_H
+
+#include "common.h"
+#include "driver.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "x86.h"
+
+// Pass manager. Every optimization is registered as named pass (see table in
+// pass.c) and runs per function. Which passes run is decided by -O level and
+// can be changed by -f<name> / -fno-<name>. Between passes it can time them
+// (-ftime-passes) and verify the IR (-fverify-passes), so broken pass is
+// reported by name.
+
+typedef struct _pass pass;
+typedef struct _pass_manager pass_manager;
+
+typedef enum {
+  PASS_TAC, // runs on tac of function, after gen_tac
+  PASS_X86, // runs on x86 of function before fix_pseudo (pseudos are present)
+  PASS_X86_LATE, // runs on final x86 of function, after fix_instructions
+} pass_t;
+
+// mask of opt levels, pass is enabled at level l if (levels & OPT_BIT(l))
+#define OPT_BIT(level) (1 << (level))
+#define OPT_ALL (OPT_BIT(OPT_O1) | OPT_BIT(OPT_O2) | OPT_BIT(OPT_OS))
+
+struct _pass {
+  const char *name; // used in -f<name> and -fno-<name>
+  pass_t t;
+  int levels; // opt levels at which pass is enabled by default
+  union {
+    void (*tac)(tac_program *prog, tacf *f, sym_table *st);
+    void (*x86)(x86_asm_gen *ag, x86_func *f, ht *bst);
+  } run;
+  void (*print_stats)(void); // optional, prints counters of pass to stderr
+
+  // optional, tac passes only: set up state shared by functions of program
+  // before pass runs on first one, and free it after last one
+  void (*begin)(tac_program *prog);
+  void (*end)(void);
+};
+
+struct _pass_manager {
+  int opt_level;
+
+  bool *enabled;   // per registered pass
+  double *seconds; // per registered pass, total time spent in it
+
+  bool time;   // print time of each pass | -ftime-passes
+  bool verify; // verify IR after each pass | -fverify-passes
+  bool stats;  // print counters of passes | -fpass-stats
+
+  bool verbose_asm;        // passed to gen_asm | -fverbose-asm
+  bool omit_frame_pointer; // passed to gen_asm | -fomit-frame-pointer
+};
+
+// sets up passes by opt level and -f flags of driver, exits on unknown flag
+void init_pass_manager(pass_manager *pm, driver_options *d);
+void free_pass_manager(pass_manager *pm);
+
+// runs enabled tac passes on each function of program
+void run_tac_passes(pass_manager *pm, tac_program *prog, sym_table *st);
+
+// runs enabled x86 passes of kind t (PASS_X86 or PASS_X86_LATE) on function,
+// is called by gen_asm
+void run_x86_passes(pass_manager *pm, pass_t t, x86_asm_gen *ag, x86_func *f,
+                    ht *bst);
+
+// prints time spent in each pass to stderr, if -ftime-passes was given
+void print_pass_times(pass_manager *pm);
+
+// prints counters of passes to stderr, if -fpass-stats was given
+void print_pass_stats(pass_manager *pm);
+
+#endif
@@ -226,6 +226,38 @@ bool ht_set_int(ht *t, int key, void *v) {
   return ht_set_entry_int(t->entries, t->cap, key, v, &t->size);
 }
 
+bool ht_remove(ht *t, const char *key) {
+  assert(t->is_keys_strings);
+  size_t mask = t->cap - 1;
+  size_t idx = (size_t)(hash_key(key) & (uint64_t)mask);
+
+  while (t->entries[idx].v.key != NULL &&
+         strcmp(key, t->entries[idx].v.key) != 0)
+    idx = (idx + 1) & mask;
+
+  if (t->entries[idx].v.key == NULL)
+    return false;
+
+  free((void *)t->entries[idx].v.key);
+  --t->size;
+
+  // backward shift, so lookups of keys probed past removed one don't stop at
+  // the hole
+  size_t hole = idx;
+  for (size_t j = (hole + 1) & mask; t->entries[j].v.key != NULL;
+       j = (j + 1) & mask) {
+    size_t home = (size_t)(hash_key(t->entries[j].v.key) & (uint64_t)mask);
+    // entry can be moved into hole if hole is between it's home and j
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      t->entries[hole] = t->entries[j];
+      hole = j;
+    }
+  }
+  t->entries[hole].v.key = NULL;
+  t->entries[hole].val = NULL;
+  return true;
+}
+
 size_t ht_size(ht *table) { return table->size; }
 
 hti ht_iterator(ht *t) {
@@ -38,6 +38,10 @@ const char *ht_set(ht *table, const char *key, void *value);
 // Returns true on succ, false of failue
 bool ht_set_int(ht *table, int key, void *value);
 
+// Remove item with given NULL-terminated key from hash table.
+// Returns false if key wasn't found
+bool ht_remove(ht *table, const char *key);
+
 size_t ht_size(ht *table);
 
 struct _hti {
@@ -10,6 +10,7 @@
 #include "vec.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static int tmp_var_counter = 0;
@@ -22,6 +23,7 @@ static void init_tacgen(tacgen *tg, sym_table *st) {
   NEW_ARENA(tg->taci_arena, taci);
   NEW_ARENA(tg->tac_top_level_arena, tac_top_level);
   NEW_ARENA(tg->tacv_arena, tacv);
+  NEW_ARENA(tg->label_arena, int);
 
   tg->st = st;
 }
@@ -88,12 +90,13 @@ extern int var_name_idx_counter; // defined in resolve.c
 
 static tacv new_tmp(tacgen *tg, type *t) {
   static char buf[256];
-  int e;
-  // not rly elegant, FIXME
+  bool taken;
+  // not rly elegant, FIXME. resolved locals are named `<name>_<idx>` too, so
+  // sym table is checked as well
   do {
     sprintf(buf, "t_%d", ++tmp_var_counter);
-    e = (int)(intptr_t)ht_get(var_map, buf);
-  } while (e);
+    taken = ht_get(var_map, buf) != NULL || ht_get(tg->st->t, buf) != NULL;
+  } while (taken);
 
   tacv v;
   v.t = TACV_VAR;
@@ -112,6 +115,33 @@ static tacv new_tmp(tacgen *tg, type *t) {
   return v;
 }
 
+taci *new_taci(arena *a, tacop op) {
+  taci *res = ARENA_ALLOC_OBJ(a, taci);
+  res->op = op;
+  res->next = NULL;
+  return res;
+}
+
+tacv new_local_like(sym_table *st, string like) {
+  syme *e = ht_get(st->t, like);
+  assert(e);
+  string name;
+  do
+    name = string_sprintf("%s_%d", e->original_name, ++var_name_idx_counter);
+  while (ht_get(st->t, name) != NULL);
+
+  syme *copy = ARENA_ALLOC_OBJ(st->entry_arena, syme);
+  *copy = *e;
+  copy->name = name;
+  copy->ref = NULL;
+  ht_set(st->t, name, copy);
+
+  tacv v;
+  v.t = TACV_VAR;
+  v.v.var = name;
+  return v;
+}
+
 static tacv new_var(string name) {
   tacv v;
   v.t = TACV_VAR;
@@ -175,56 +205,96 @@ static tacv gen_tac_from_unary_expr(tacgen *tg, expr *e) {
   return i->dst;
 }
 
-static tacv gen_tac_from_OR_binary(tacgen *tg, expr *e) {
-  tacv res = new_tmp(tg, e->tp);
+// jump comparing operands of relational binary, jump is taken when result of
+// compare is `when`. -1 if binary isn't relational
+static int cond_jump_op(binaryt t, bool when) {
+  switch (t) {
+  case BINARY_EQ:
+    return when ? TAC_JE : TAC_JNE;
+  case BINARY_NE:
+    return when ? TAC_JNE : TAC_JE;
+  case BINARY_LT:
+    return when ? TAC_JLT : TAC_JGE;
+  case BINARY_LE:
+    return when ? TAC_JLE : TAC_JGT;
+  case BINARY_GT:
+    return when ? TAC_JGT : TAC_JLE;
+  case BINARY_GE:
+    return when ? TAC_JGE : TAC_JLT;
+  default:
+    return -1;
+  }
+}
 
-  tacv v1 = gen_tac_from_expr(tg, e->v.b.l);
-  taci *jnz1 = insert_taci(tg, TAC_JNZ);
-  jnz1->v.s.src1 = v1;
-  int true_label = jnz1->label_idx = new_label();
-  tacv v2 = gen_tac_from_expr(tg, e->v.b.r);
-  taci *jnz2 = insert_taci(tg, TAC_JNZ);
-  jnz2->v.s.src1 = v2;
-  jnz2->label_idx = true_label;
-  taci *cpy1 = insert_taci(tg, TAC_CPY);
-  cpy1->dst = res;
-  cpy1->v.s.src1 = new_const(new_int_const(0));
-  taci *jmp = insert_taci(tg, TAC_JMP);
-  int end_label = jmp->label_idx = new_label();
-  taci *true_label_i = insert_taci(tg, TAC_LABEL);
-  true_label_i->label_idx = true_label;
-  taci *cpy2 = insert_taci(tg, TAC_CPY);
-  cpy2->dst = res;
-  cpy2->v.s.src1 = new_const(new_int_const(1));
-  taci *end_label_i = insert_taci(tg, TAC_LABEL);
-  end_label_i->label_idx = end_label;
+// Lowers e in condition context: jumps to label if e is nonzero and `when` is
+// set (or if e is zero and `when` isn't), falls through otherwise. Compares
+// become single compare-and-branch and &&, || and ! branch straight to their
+// targets, so no 0/1 is materialized on the way.
+static void gen_tac_cond_jump(tacgen *tg, expr *e, int label, bool when) {
+  switch (e->t) {
+  case EXPR_INT_CONST:
+    if ((e->v.intc.v != 0) == when)
+      insert_taci(tg, TAC_JMP)->label_idx = label;
+    return;
+  case EXPR_UNARY:
+    if (e->v.u.t != UNARY_NOT)
+      break;
+    gen_tac_cond_jump(tg, e->v.u.e, label, !when);
+    return;
+  case EXPR_BINARY: {
+    binaryt t = e->v.b.t;
+    if (t == BINARY_AND || t == BINARY_OR) {
+      // false && and true || are decided by either side
+      if ((t == BINARY_OR) == when) {
+        gen_tac_cond_jump(tg, e->v.b.l, label, when);
+        gen_tac_cond_jump(tg, e->v.b.r, label, when);
+      } else {
+        int skip = new_label();
+        gen_tac_cond_jump(tg, e->v.b.l, skip, !when);
+        gen_tac_cond_jump(tg, e->v.b.r, label, when);
+        insert_taci(tg, TAC_LABEL)->label_idx = skip;
+      }
+      return;
+    }
+    int op = cond_jump_op(t, when);
+    if (op < 0)
+      break;
+    tacv v1 = gen_tac_from_expr(tg, e->v.b.l);
+    tacv v2 = gen_tac_from_expr(tg, e->v.b.r);
+    taci *j = insert_taci(tg, op);
+    j->v.s.src1 = v1;
+    j->v.s.src2 = v2;
+    j->label_idx = label;
+    return;
+  }
+  default:
+    break;
+  }
 
-  return res;
+  tacv v = gen_tac_from_expr(tg, e);
+  taci *j = insert_taci(tg, when ? TAC_JNZ : TAC_JZ);
+  j->v.s.src1 = v;
+  j->label_idx = label;
 }
 
-static tacv gen_tac_from_AND_binary(tacgen *tg, expr *e) {
+// && jumps to set 0 when it's known to be false, || to set 1 when it's known
+// to be true
+static tacv gen_tac_from_logical_binary(tacgen *tg, expr *e) {
+  bool when = e->v.b.t == BINARY_OR;
   tacv res = new_tmp(tg, e->tp);
 
-  tacv v1 = gen_tac_from_expr(tg, e->v.b.l);
-  taci *jz1 = insert_taci(tg, TAC_JZ);
-  jz1->v.s.src1 = v1;
-  int false_label = jz1->label_idx = new_label();
-  tacv v2 = gen_tac_from_expr(tg, e->v.b.r);
-  taci *jz2 = insert_taci(tg, TAC_JZ);
-  jz2->v.s.src1 = v2;
-  jz2->label_idx = false_label;
+  int decided_label = new_label();
+  gen_tac_cond_jump(tg, e, decided_label, when);
   taci *cpy1 = insert_taci(tg, TAC_CPY);
   cpy1->dst = res;
-  cpy1->v.s.src1 = new_const(new_int_const(1));
+  cpy1->v.s.src1 = new_const(new_int_const(!when));
   taci *jmp = insert_taci(tg, TAC_JMP);
   int end_label = jmp->label_idx = new_label();
-  taci *false_label_i = insert_taci(tg, TAC_LABEL);
-  false_label_i->label_idx = false_label;
+  insert_taci(tg, TAC_LABEL)->label_idx = decided_label;
   taci *cpy2 = insert_taci(tg, TAC_CPY);
   cpy2->dst = res;
-  cpy2->v.s.src1 = new_const(new_int_const(0));
-  taci *end_label_i = insert_taci(tg, TAC_LABEL);
-  end_label_i->label_idx = end_label;
+  cpy2->v.s.src1 = new_const(new_int_const(when));
+  insert_taci(tg, TAC_LABEL)->label_idx = end_label;
 
   return res;
 }
@@ -256,9 +326,8 @@ static tacv gen_tac_from_binary_expr(tacgen *tg, expr *e) {
     b(BINARY_GE, TAC_GE);
     break;
   case BINARY_OR:
-    return gen_tac_from_OR_binary(tg, e);
   case BINARY_AND:
-    return gen_tac_from_AND_binary(tg, e);
+    return gen_tac_from_logical_binary(tg, e);
   }
 
   tacv v1 = gen_tac_from_expr(tg, e->v.b.l);
@@ -323,11 +392,8 @@ static tacv gen_tac_from_assignment_expr(tacgen *tg, assignment a) {
 
 static tacv gen_tac_from_ternary_expr(tacgen *tg, expr *e) {
   tacv dst = new_tmp(tg, e->tp);
-  tacv condv = gen_tac_from_expr(tg, e->v.ternary.cond);
-
-  taci *jz = insert_taci(tg, TAC_JZ);
-  int else_label = jz->label_idx = new_label();
-  jz->v.s.src1 = condv;
+  int else_label = new_label();
+  gen_tac_cond_jump(tg, e->v.ternary.cond, else_label, false);
 
   tacv thenv = gen_tac_from_expr(tg, e->v.ternary.then);
   taci *cpy_then = insert_taci(tg, TAC_CPY);
@@ -360,6 +426,7 @@ static tacv gen_tac_from_func_call_expr(tacgen *tg, expr *e) {
   taci *i = insert_taci(tg, TAC_CALL);
   i->dst = new_tmp(tg, e->tp);
   i->v.call.name = fe.name;
+  i->v.call.tail = false;
 
   syme *entry = ht_get(tg->st->t, fe.name);
   assert(entry);
@@ -448,10 +515,8 @@ static void gen_tac_from_block_stmt(tacgen *tg, block_stmt bs) {
 }
 
 static void gen_tac_from_if_stmt(tacgen *tg, if_stmt is) {
-  tacv condv = gen_tac_from_expr(tg, is.cond);
-  taci *jz = insert_taci(tg, TAC_JZ);
-  int else_label = jz->label_idx = new_label();
-  jz->v.s.src1 = condv;
+  int else_label = new_label();
+  gen_tac_cond_jump(tg, is.cond, else_label, false);
   gen_tac_from_stmt(tg, is.then);
   taci *j = insert_taci(tg, TAC_JMP);
   int end_label = j->label_idx = new_label();
@@ -492,11 +557,7 @@ static void gen_tac_from_case_stmt(tacgen *tg, case_stmt c) {
 static void gen_tac_from_while_stmt(tacgen *tg, while_stmt w) {
   insert_taci(tg, TAC_LABEL)->label_idx = w.continue_label_idx;
 
-  tacv v = gen_tac_from_expr(tg, w.cond);
-
-  taci *jz = insert_taci(tg, TAC_JZ);
-  jz->v.s.src1 = v;
-  jz->label_idx = w.break_label_idx;
+  gen_tac_cond_jump(tg, w.cond, w.break_label_idx, false);
 
   gen_tac_from_stmt(tg, w.s);
 
@@ -512,11 +573,7 @@ static void gen_tac_from_dowhile_stmt(tacgen *tg, dowhile_stmt w) {
   gen_tac_from_stmt(tg, w.s);
 
   insert_taci(tg, TAC_LABEL)->label_idx = w.continue_label_idx;
-  tacv v = gen_tac_from_expr(tg, w.cond);
-
-  taci *jnz = insert_taci(tg, TAC_JNZ);
-  jnz->v.s.src1 = v;
-  jnz->label_idx = start;
+  gen_tac_cond_jump(tg, w.cond, start, true);
 
   insert_taci(tg, TAC_LABEL)->label_idx = w.break_label_idx;
 }
@@ -529,15 +586,8 @@ static void gen_tac_from_for_stmt(tacgen *tg, for_stmt f) {
 
   int start_label = insert_taci(tg, TAC_LABEL)->label_idx = new_label();
 
-  tacv condv;
   if (f.cond != NULL)
-    condv = gen_tac_from_expr(tg, f.cond);
-  else
-    condv = new_const(new_int_const(1));
-
-  taci *jz = insert_taci(tg, TAC_JZ);
-  jz->v.s.src1 = condv;
-  jz->label_idx = f.break_label_idx;
+    gen_tac_cond_jump(tg, f.cond, f.break_label_idx, false);
 
   gen_tac_from_stmt(tg, f.s);
 
@@ -551,24 +601,178 @@ static void gen_tac_from_for_stmt(tacgen *tg, for_stmt f) {
   insert_taci(tg, TAC_LABEL)->label_idx = f.break_label_idx;
 }
 
-static void gen_tac_from_switch_stmt(tacgen *tg, switch_stmt s) {
-  tacv condv = gen_tac_from_expr(tg, s.e);
-
-  for (int i = 0; i < s.cases_len; ++i) {
-    taci *je = insert_taci(tg, TAC_JE);
-    je->label_idx = s.cases[i]->v.case_stmt.label_idx;
-    assert(s.cases[i]->v.case_stmt.e->t == EXPR_INT_CONST);
-    je->v.s.src1 = condv;
-    je->v.s.src2 = new_const(s.cases[i]->v.case_stmt.e->v.intc);
+// Switch dispatch. Sorted cases are split into clusters: dense runs (at least
+// SWITCH_TABLE_MIN_CASES cases, filling at least 1 / SWITCH_TABLE_DENSITY of
+// their range) go through bounds checked jump table, the rest are single
+// cases. Right cluster is found by balanced compare tree, few single cases
+// at its leaves are compared in a row.
+#define SWITCH_TABLE_MIN_CASES 4
+#define SWITCH_TABLE_DENSITY 3
+#define SWITCH_TABLE_MAX_LEN (1 << 16)
+#define SWITCH_LINEAR_CASES 3
+
+typedef struct {
+  uint64_t v; // normalized to type of switch
+  int label;
+} switch_case;
+
+typedef struct {
+  size_t first; // idx of first case
+  size_t len;   // amount of cases
+  bool table;
+} switch_cluster;
+
+typedef struct {
+  tacv cond;
+  type *t;
+  int default_label;
+  switch_case *cases;
+  VEC(switch_cluster) clusters;
+} switch_ctx;
+
+static bool switch_signed; // for switch_case_cmp
+
+static int switch_case_cmp(const void *a, const void *b) {
+  uint64_t x = ((switch_case *)a)->v, y = ((switch_case *)b)->v;
+  if (switch_signed)
+    return (int64_t)x < (int64_t)y ? -1 : (int64_t)x > (int64_t)y;
+  return x < y ? -1 : x > y;
+}
+
+static tacv new_switch_const(uint64_t v, type *t) {
+  int_const c;
+  c.t = CONST_ULONG;
+  c.v = v;
+  return new_const(convert_const_to_int(&c, NULL, t));
+}
+
+static void find_switch_clusters(switch_ctx *sc, size_t n) {
+  for (size_t i = 0; i < n;) {
+    // extend run while it stays dense enough
+    size_t j = i + 1;
+    while (j < n) {
+      uint64_t range = sc->cases[j].v - sc->cases[i].v;
+      if (range >= SWITCH_TABLE_MAX_LEN ||
+          range >= (j - i + 1) * SWITCH_TABLE_DENSITY)
+        break;
+      ++j;
+    }
+
+    if (j - i >= SWITCH_TABLE_MIN_CASES) {
+      switch_cluster cl = {i, j - i, true};
+      vec_push_back(sc->clusters, cl);
+      i = j;
+    } else {
+      switch_cluster cl = {i, 1, false};
+      vec_push_back(sc->clusters, cl);
+      ++i;
+    }
   }
+}
 
-  if (s.default_stmt != NULL) {
-    insert_taci(tg, TAC_JMP)->label_idx =
-        s.default_stmt->v.default_stmt.label_idx;
-  } else {
-    insert_taci(tg, TAC_JMP)->label_idx = s.break_label_idx;
+static void gen_tac_switch_table(tacgen *tg, switch_ctx *sc,
+                                 switch_cluster *cl) {
+  type *ut = new_type(sc->t->t == TYPE_INT || sc->t->t == TYPE_UINT
+                          ? TYPE_UINT
+                          : TYPE_ULONG);
+  uint64_t min = sc->cases[cl->first].v;
+  uint64_t range = sc->cases[cl->first + cl->len - 1].v - min;
+
+  // idx = (unsigned)cond - min, one unsigned compare checks both bounds
+  taci *cpy = insert_taci(tg, TAC_CPY);
+  cpy->dst = new_tmp(tg, ut);
+  cpy->v.s.src1 = sc->cond;
+  tacv idx = cpy->dst;
+
+  if (min != 0) {
+    taci *sub = insert_taci(tg, TAC_SUB);
+    sub->dst = idx;
+    sub->v.s.src1 = idx;
+    sub->v.s.src2 = new_switch_const(min, ut);
+  }
+
+  taci *jgt = insert_taci(tg, TAC_JGT);
+  jgt->v.s.src1 = idx;
+  jgt->v.s.src2 = new_switch_const(range, ut);
+  jgt->label_idx = sc->default_label;
+
+  taci *jtab = insert_taci(tg, TAC_JTAB);
+  jtab->v.jtab.idx = idx;
+  jtab->v.jtab.labels_len = range + 1;
+  jtab->v.jtab.labels = ARENA_ALLOC_ARRAY(tg->label_arena, int, range + 1);
+  jtab->v.jtab.table_label = new_label();
+  for (uint64_t j = 0; j <= range; ++j)
+    jtab->v.jtab.labels[j] = sc->default_label;
+  for (size_t j = cl->first; j < cl->first + cl->len; ++j)
+    jtab->v.jtab.labels[sc->cases[j].v - min] = sc->cases[j].label;
+}
+
+// dispatches to clusters [lo, hi)
+static void gen_tac_switch_tree(tacgen *tg, switch_ctx *sc, size_t lo,
+                                size_t hi) {
+  switch_cluster *cl = sc->clusters.data;
+
+  bool linear = hi - lo <= SWITCH_LINEAR_CASES;
+  for (size_t i = lo; linear && i < hi; ++i)
+    linear = !cl[i].table;
+
+  if (linear) {
+    for (size_t i = lo; i < hi; ++i) {
+      switch_case *c = &sc->cases[cl[i].first];
+      taci *je = insert_taci(tg, TAC_JE);
+      je->label_idx = c->label;
+      je->v.s.src1 = sc->cond;
+      je->v.s.src2 = new_switch_const(c->v, sc->t);
+    }
+    insert_taci(tg, TAC_JMP)->label_idx = sc->default_label;
+    return;
   }
 
+  if (hi - lo == 1) {
+    gen_tac_switch_table(tg, sc, &cl[lo]);
+    return;
+  }
+
+  size_t mid = (lo + hi) / 2;
+  int right = new_label();
+
+  taci *jge = insert_taci(tg, TAC_JGE);
+  jge->v.s.src1 = sc->cond;
+  jge->v.s.src2 = new_switch_const(sc->cases[cl[mid].first].v, sc->t);
+  jge->label_idx = right;
+
+  gen_tac_switch_tree(tg, sc, lo, mid);
+  insert_taci(tg, TAC_LABEL)->label_idx = right;
+  gen_tac_switch_tree(tg, sc, mid, hi);
+}
+
+static void gen_tac_from_switch_stmt(tacgen *tg, switch_stmt s) {
+  switch_ctx sc;
+  sc.cond = gen_tac_from_expr(tg, s.e);
+  sc.t = s.e->tp;
+  sc.default_label = s.default_stmt != NULL
+                         ? s.default_stmt->v.default_stmt.label_idx
+                         : s.break_label_idx;
+
+  size_t n = s.cases_len;
+  sc.cases = malloc(sizeof(switch_case) * (n ? n : 1));
+  assert(sc.cases);
+  for (size_t i = 0; i < n; ++i) {
+    case_stmt *c = &s.cases[i]->v.case_stmt;
+    assert(c->e->t == EXPR_INT_CONST);
+    sc.cases[i].v = convert_const_to_int(&c->e->v.intc, NULL, sc.t).v;
+    sc.cases[i].label = c->label_idx;
+  }
+
+  switch_signed = type_signed(sc.t);
+  qsort(sc.cases, n, sizeof(switch_case), switch_case_cmp);
+
+  vec_init(sc.clusters);
+  find_switch_clusters(&sc, n);
+  gen_tac_switch_tree(tg, &sc, 0, sc.clusters.size);
+  vec_free(sc.clusters);
+  free(sc.cases);
+
   gen_tac_from_stmt(tg, s.s);
 
   insert_taci(tg, TAC_LABEL)->label_idx = s.break_label_idx;
@@ -684,6 +888,7 @@ tac_program gen_tac(program *p, sym_table *st) {
   res.tac_top_level_arena = tg.tac_top_level_arena;
   res.taci_arena = tg.taci_arena;
   res.tacv_arena = tg.tacv_arena;
+  res.label_arena = tg.label_arena;
 
   // write all var names into map
   for (decl *d = p->first_decl; d != NULL; d = d->next) {
@@ -745,4 +950,5 @@ void free_tac(tac_program *prog) {
   destroy_arena(prog->tac_top_level_arena);
   destroy_arena(prog->taci_arena);
   destroy_arena(prog->tacv_arena);
+  destroy_arena(prog->label_arena);
 }
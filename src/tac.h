@@ -60,8 +60,14 @@ typedef enum {
   TAC_JZ,    // jmp if not zero (src1)
   TAC_JNZ,   // jmp if zero (src1)
   TAC_JE,    // jmp if equal (src1, src2)
+  TAC_JNE,   // jmp if not equal (src1, src2)
+  TAC_JLT,   // jmp if src1 < src2, signedness is taken from src1
+  TAC_JLE,   // jmp if src1 <= src2
+  TAC_JGT,   // jmp if src1 > src2
+  TAC_JGE,   // jmp if src1 >= src2
   TAC_LABEL, // label: (no vals)
   TAC_CALL,  // call
+  TAC_JTAB,  // jmp to jtab.labels[jtab.idx], idx is checked to be in bounds
 } tacop;
 
 typedef enum {
@@ -94,7 +100,15 @@ struct _tac_instr {
       size_t args_len;
       string name;
       bool plt;
+      bool tail; // callee reuses frame of caller, result is returned
     } call;
+
+    struct {
+      tacv idx;
+      int *labels;
+      size_t labels_len;
+      int table_label; // label of table itself, used in asm
+    } jtab;
   } v;
 
   int label_idx; // for jumps, labels
@@ -132,6 +146,7 @@ struct _tacgen {
   arena *taci_arena;          // should be freed after asm is created
   arena *tac_top_level_arena; // should be freed after asm is created
   arena *tacv_arena;          // should be freed after asm is created
+  arena *label_arena;         // should be freed after asm is created
 
   sym_table *st;
 
@@ -144,14 +159,67 @@ struct _tac_program {
   arena *taci_arena;          // will be freed by free_tac_program
   arena *tac_top_level_arena; // will be freed by free_tac_program
   arena *tacv_arena;          // will be freed by free_tac_program
+  arena *label_arena;         // will be freed by free_tac_program
 
   tac_top_level *first;
 };
 
 tac_program gen_tac(program *p, sym_table *st);
 void free_tac(tac_program *prog);
-void print_tac(tac_program *prog);
+void print_tac(tac_program *prog, sym_table *st); // with cfg and liveness
 void fprint_taci(FILE *f, taci *i);
 const char *tacop_str(tacop op);
 
+// instr allocated in arena `a`, not linked yet
+taci *new_taci(arena *a, tacop op);
+// new local `<original name>_<n>` with type and attrs of var `like`, added to
+// sym table. It has no decl, so later passes treat it as temporary
+tacv new_local_like(sym_table *st, string like);
+
+// tac passes, are run by pass manager (see pass.c)
+
+// replaces calls of small functions and of static functions called once by
+// copies of their bodies, drops static functions left without calls.
+// inline_size_for_func inlines only when code doesn't grow (for -Os)
+void inline_for_func(tac_program *prog, tacf *f, sym_table *st);
+void inline_size_for_func(tac_program *prog, tacf *f, sym_table *st);
+// collect functions and call counts of program before both, free them after
+void begin_inline(tac_program *prog);
+void end_inline(void);
+
+// turns self calls in tail position into jumps to function start, marks
+// other calls in tail position which pass all args in regs as tail calls
+void tail_call_for_func(tac_program *prog, tacf *f, sym_table *st);
+
+// folds constant expressions and propagates constants across blocks, drops
+// branches on constants
+void const_prop_for_func(tac_program *prog, tacf *f, sym_table *st);
+
+// threads jump chains, removes unreachable code, unused labels and jumps to
+// next label
+void simplify_cfg_for_func(tac_program *prog, tacf *f, sym_table *st);
+
+// replaces reads of copied vars by their sources and merges temporaries into
+// assignments they are copied to
+void copy_prop_for_func(tac_program *prog, tacf *f, sym_table *st);
+
+// moves instrs which compute same value on each iteration of loop to new
+// block before it
+void licm_for_func(tac_program *prog, tacf *f, sym_table *st);
+void print_licm_stats(void);
+
+// replaces multiplications by induction vars of loops by additions, and ivs
+// used only by exit test by counters going down to zero
+void reduce_ivs_for_func(tac_program *prog, tacf *f, sym_table *st);
+void print_ivs_stats(void);
+
+// turns loops with exit test at the top into guard and test at the bottom, so
+// each iteration takes one branch
+void rotate_loops_for_func(tac_program *prog, tacf *f, sym_table *st);
+void print_rotate_stats(void);
+
+// removes instrs whose result is never read, drops removed temporaries from
+// sym table
+void dce_for_func(tac_program *prog, tacf *f, sym_table *st);
+
 #endif
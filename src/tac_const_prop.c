@@ -0,0 +1,649 @@
+#include "cfg.h"
+#include "common.h"
+#include "parser.h"
+#include "table.h"
+#include "tac.h"
+#include "type.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Constant propagation and folding (Wegman & Zadeck style, but over blocks
+// instead of SSA). Each var is UNDEF (no value seen yet), CONST or NAC (not a
+// constant). Values of vars which can live across blocks are propagated only
+// along edges which can be taken, so branch on constant doesn't spoil values
+// behind its dead side. Then each block is walked again: reads of constant
+// vars are replaced by constants, instrs with constant result become copies
+// and branches on constants become jmp or are dropped.
+//
+// Arithmetic wraps around like in readme.md, division by zero and INT_MIN / -1
+// are left for runtime.
+
+// functions with more blocks * vars than this only get block local
+// propagation, so memory stays bounded
+#define CONST_PROP_MAX_CELLS (1 << 20)
+
+#define JUMP_TO_ANY -2
+
+typedef enum {
+  LAT_UNDEF,
+  LAT_CONST,
+  LAT_NAC,
+} lat_t;
+
+typedef struct {
+  lat_t t;
+  int_const c; // if t is LAT_CONST
+} lat;
+
+typedef struct {
+  cfg g;
+  sym_table *st;
+
+  bool global; // false if function is too big, then blocks start with NAC
+  lat *out;    // [block * live_vars + var], state at exit of block
+  lat *cur;    // var -> state during walk over block
+  int block;   // idx of block being walked
+  int *written; // var -> idx of last block which has written it, used when
+                // not global
+
+  bool *reached;
+  int *jump_to;  // per block, block jumped to by last instr, -1 if none or
+                 // JUMP_TO_ANY for jump table (all successors)
+  bool *jump_ok; // per block, jump of last instr can be taken
+  bool *fall_ok; // per block, falling through to next block can happen
+} cp_ctx;
+
+static lat lat_nac(void) {
+  lat res;
+  res.t = LAT_NAC;
+  return res;
+}
+
+static lat lat_const(int_const c) {
+  lat res;
+  res.t = LAT_CONST;
+  res.c = c;
+  return res;
+}
+
+static bool lat_eq(lat a, lat b) {
+  return a.t == b.t && (a.t != LAT_CONST || a.c.v == b.c.v);
+}
+
+static lat lat_meet(lat a, lat b) {
+  if (a.t == LAT_UNDEF)
+    return b;
+  if (b.t == LAT_UNDEF)
+    return a;
+  if (a.t == LAT_NAC || b.t == LAT_NAC || a.c.v != b.c.v)
+    return lat_nac();
+  return a;
+}
+
+static bool is_int_type(type *t) {
+  return t->t == TYPE_INT || t->t == TYPE_LONG || t->t == TYPE_UINT ||
+         t->t == TYPE_ULONG;
+}
+
+static int const_width(constt t) {
+  return t == CONST_INT || t == CONST_UINT ? 32 : 64;
+}
+
+static bool const_signed(constt t) { return t == CONST_INT || t == CONST_LONG; }
+
+static uint64_t low_bits(uint64_t v, int width) {
+  return width == 32 ? v & 0xFFFFFFFF : v;
+}
+
+// reduces v modulo 2^N of type t, constants are kept sign extended for signed
+// types and zero extended for unsigned ones
+static int_const make_const(uint64_t v, type *t) {
+  int_const c;
+  c.t = CONST_ULONG;
+  c.v = v;
+  return convert_const_to_int(&c, NULL, t);
+}
+
+static type *var_type(cp_ctx *c, tacv *v) {
+  syme *e = ht_get(c->st->t, v->v.var);
+  assert(e);
+  return e->t;
+}
+
+static lat val_of(cp_ctx *c, tacv *v) {
+  if (v->t == TACV_CONST)
+    return lat_const(v->v.iconst);
+  int idx = cfg_var_idx(&c->g, v);
+  if (idx < 0)
+    return lat_nac();
+  // vars which aren't live across blocks are always written before read, so
+  // their state is never stale
+  if (!c->global && idx < c->g.live_vars && c->written[idx] != c->block)
+    return lat_nac();
+  return c->cur[idx];
+}
+
+static bool fold_div(tacop op, int_const a, int_const b, uint64_t *res) {
+  bool mod = op == TAC_MOD || op == TAC_ASMOD;
+  bool is_signed = const_signed(a.t);
+
+  if (const_width(a.t) == 32) {
+    if (is_signed) {
+      int32_t x = (int32_t)a.v, y = (int32_t)b.v;
+      if (y == 0 || (x == INT32_MIN && y == -1))
+        return false;
+      *res = (uint64_t)(int64_t)(mod ? x % y : x / y);
+    } else {
+      uint32_t x = (uint32_t)a.v, y = (uint32_t)b.v;
+      if (y == 0)
+        return false;
+      *res = mod ? x % y : x / y;
+    }
+  } else {
+    if (is_signed) {
+      int64_t x = (int64_t)a.v, y = (int64_t)b.v;
+      if (y == 0 || (x == INT64_MIN && y == -1))
+        return false;
+      *res = (uint64_t)(mod ? x % y : x / y);
+    } else {
+      if (b.v == 0)
+        return false;
+      *res = mod ? a.v % b.v : a.v / b.v;
+    }
+  }
+  return true;
+}
+
+// folds op on constants, result has type t. Signedness of division, right
+// shift and compares is taken from a
+static bool fold(tacop op, int_const a, int_const b, type *t, int_const *res) {
+  int width = const_width(make_const(0, t).t);
+  bool is_signed = const_signed(a.t);
+  uint64_t v;
+
+  switch (op) {
+  case TAC_NEGATE:
+    v = -a.v;
+    break;
+  case TAC_COMPLEMENT:
+    v = ~a.v;
+    break;
+  case TAC_NOT:
+    v = a.v == 0;
+    break;
+  case TAC_CPY:
+  case TAC_SIGN_EXTEND:
+  case TAC_TRUNCATE:
+    v = a.v;
+    break;
+  case TAC_ZERO_EXTEND:
+    v = low_bits(a.v, const_width(a.t));
+    break;
+  case TAC_INC:
+  case TAC_ADD:
+  case TAC_ASADD:
+    v = a.v + b.v;
+    break;
+  case TAC_DEC:
+  case TAC_SUB:
+  case TAC_ASSUB:
+    v = a.v - b.v;
+    break;
+  case TAC_MUL:
+  case TAC_ASMUL:
+    v = a.v * b.v;
+    break;
+  case TAC_AND:
+  case TAC_ASAND:
+    v = a.v & b.v;
+    break;
+  case TAC_OR:
+  case TAC_ASOR:
+    v = a.v | b.v;
+    break;
+  case TAC_XOR:
+  case TAC_ASXOR:
+    v = a.v ^ b.v;
+    break;
+  case TAC_DIV:
+  case TAC_MOD:
+  case TAC_ASDIV:
+  case TAC_ASMOD:
+    if (!fold_div(op, a, b, &v))
+      return false;
+    break;
+  // count is masked same way as x86 does it
+  case TAC_LSHIFT:
+  case TAC_ASLSHIFT:
+    v = a.v << (b.v & (width - 1));
+    break;
+  case TAC_RSHIFT:
+  case TAC_ASRSHIFT:
+    if (is_signed)
+      v = (uint64_t)((int64_t)a.v >> (b.v & (width - 1)));
+    else
+      v = low_bits(a.v, const_width(a.t)) >> (b.v & (width - 1));
+    break;
+  case TAC_EQ:
+    v = a.v == b.v;
+    break;
+  case TAC_NE:
+    v = a.v != b.v;
+    break;
+  case TAC_LT:
+    v = is_signed ? (int64_t)a.v < (int64_t)b.v : a.v < b.v;
+    break;
+  case TAC_LE:
+    v = is_signed ? (int64_t)a.v <= (int64_t)b.v : a.v <= b.v;
+    break;
+  case TAC_GT:
+    v = is_signed ? (int64_t)a.v > (int64_t)b.v : a.v > b.v;
+    break;
+  case TAC_GE:
+    v = is_signed ? (int64_t)a.v >= (int64_t)b.v : a.v >= b.v;
+    break;
+  default:
+    return false;
+  }
+
+  *res = make_const(v, t);
+  return true;
+}
+
+// value written by instr into dst
+static lat eval(cp_ctx *c, taci *i, tacv *dst) {
+  lat a;
+  int_const one = {CONST_INT, 1};
+  lat b = lat_const(one);
+
+  switch (i->op) {
+  case TAC_INC:
+  case TAC_DEC:
+  case TAC_NEGATE:
+  case TAC_COMPLEMENT:
+  case TAC_NOT:
+  case TAC_CPY:
+  case TAC_SIGN_EXTEND:
+  case TAC_ZERO_EXTEND:
+  case TAC_TRUNCATE:
+    a = val_of(c, &i->v.s.src1);
+    break;
+  case TAC_ASADD:
+  case TAC_ASSUB:
+  case TAC_ASMUL:
+  case TAC_ASDIV:
+  case TAC_ASMOD:
+  case TAC_ASAND:
+  case TAC_ASOR:
+  case TAC_ASXOR:
+  case TAC_ASLSHIFT:
+  case TAC_ASRSHIFT:
+    a = val_of(c, &i->dst);
+    b = val_of(c, &i->v.s.src1);
+    break;
+  case TAC_CALL:
+    return lat_nac();
+  default:
+    a = val_of(c, &i->v.s.src1);
+    b = val_of(c, &i->v.s.src2);
+    break;
+  }
+
+  if (a.t == LAT_NAC || b.t == LAT_NAC)
+    return lat_nac();
+  if (a.t == LAT_UNDEF || b.t == LAT_UNDEF)
+    return a.t == LAT_UNDEF ? a : b;
+
+  type *t = var_type(c, dst);
+  lat res;
+  if (!is_int_type(t) || !fold(i->op, a.c, b.c, t, &res.c))
+    return lat_nac();
+  res.t = LAT_CONST;
+  return res;
+}
+
+static bool edge_ok(cp_ctx *c, int from, int to) {
+  bool target = c->jump_to[from] == to || c->jump_to[from] == JUMP_TO_ANY;
+  return (target && c->jump_ok[from]) ||
+         (from + 1 == to && c->fall_ok[from]);
+}
+
+static void load_block_in(cp_ctx *c, cfg_block *b) {
+  c->block = b->idx;
+  if (!c->global)
+    return;
+
+  size_t lv = c->g.live_vars;
+  if (b->idx == 0) {
+    for (size_t v = 0; v < lv; ++v)
+      c->cur[v] = lat_nac();
+    return;
+  }
+
+  for (size_t v = 0; v < lv; ++v)
+    c->cur[v].t = LAT_UNDEF;
+  vec_foreach(int, b->preds, p) {
+    if (!c->reached[*p] || !edge_ok(c, *p, b->idx))
+      continue;
+    lat *out = &c->out[*p * lv];
+    for (size_t v = 0; v < lv; ++v)
+      c->cur[v] = lat_meet(c->cur[v], out[v]);
+  }
+}
+
+// whether conditional jump on constants is taken, constants are kept extended
+// to 64 bits, so they compare right for both widths
+static bool jump_taken(tacop op, int_const a, int_const b) {
+  bool is_signed = const_signed(a.t);
+  int64_t x = (int64_t)a.v, y = (int64_t)b.v;
+
+  switch (op) {
+  case TAC_JZ:
+  case TAC_JE:
+    return a.v == b.v;
+  case TAC_JNZ:
+  case TAC_JNE:
+    return a.v != b.v;
+  case TAC_JLT:
+    return is_signed ? x < y : a.v < b.v;
+  case TAC_JLE:
+    return is_signed ? x <= y : a.v <= b.v;
+  case TAC_JGT:
+    return is_signed ? x > y : a.v > b.v;
+  case TAC_JGE:
+    return is_signed ? x >= y : a.v >= b.v;
+  default:
+    UNREACHABLE();
+  }
+}
+
+// decides which edges out of block can be taken, true if that changed
+static bool eval_branch(cp_ctx *c, cfg_block *b, taci *i) {
+  bool jump_ok = false, fall_ok = false;
+
+  switch (i->op) {
+  case TAC_RET:
+    break;
+  case TAC_JMP:
+  case TAC_JTAB:
+    jump_ok = true;
+    break;
+  case TAC_JZ:
+  case TAC_JNZ:
+  case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE: {
+    int_const zero = {CONST_INT, 0};
+    bool zero_cmp = i->op == TAC_JZ || i->op == TAC_JNZ;
+    lat a = val_of(c, &i->v.s.src1);
+    lat cmp = zero_cmp ? lat_const(zero) : val_of(c, &i->v.s.src2);
+
+    if (a.t == LAT_NAC || cmp.t == LAT_NAC) {
+      jump_ok = fall_ok = true;
+    } else if (a.t == LAT_CONST && cmp.t == LAT_CONST) {
+      jump_ok = jump_taken(i->op, a.c, cmp.c);
+      fall_ok = !jump_ok;
+    }
+    break;
+  }
+  default:
+    fall_ok = true;
+    break;
+  }
+
+  bool changed = c->jump_ok[b->idx] != jump_ok || c->fall_ok[b->idx] != fall_ok;
+  c->jump_ok[b->idx] = jump_ok;
+  c->fall_ok[b->idx] = fall_ok;
+  return changed;
+}
+
+static void set_var(cp_ctx *c, tacv *dst, lat l) {
+  int idx = cfg_var_idx(&c->g, dst);
+  if (idx < 0)
+    return;
+  if (l.t == LAT_CONST)
+    l.c = make_const(l.c.v, var_type(c, dst));
+  c->cur[idx] = l;
+  c->written[idx] = c->block;
+}
+
+static void subst(cp_ctx *c, tacv *v) {
+  if (v->t != TACV_VAR)
+    return;
+  lat l = val_of(c, v);
+  if (l.t != LAT_CONST)
+    return;
+  v->t = TACV_CONST;
+  v->v.iconst = l.c;
+}
+
+// replaces reads of constant vars by constants, dst of compound assignments
+// and inc/dec is both read and written so it stays
+static void subst_srcs(cp_ctx *c, taci *i) {
+  switch (i->op) {
+  case TAC_INC:
+  case TAC_DEC:
+  case TAC_LABEL:
+  case TAC_JMP:
+    break;
+  case TAC_CALL:
+    for (size_t j = 0; j < i->v.call.args_len; ++j)
+      subst(c, &i->v.call.args[j]);
+    break;
+  case TAC_JTAB:
+    subst(c, &i->v.jtab.idx);
+    break;
+  case TAC_ADD:
+  case TAC_SUB:
+  case TAC_MUL:
+  case TAC_DIV:
+  case TAC_MOD:
+  case TAC_AND:
+  case TAC_OR:
+  case TAC_XOR:
+  case TAC_LSHIFT:
+  case TAC_RSHIFT:
+  case TAC_EQ:
+  case TAC_NE:
+  case TAC_LT:
+  case TAC_LE:
+  case TAC_GT:
+  case TAC_GE:
+  case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
+    subst(c, &i->v.s.src1);
+    subst(c, &i->v.s.src2);
+    break;
+  default:
+    subst(c, &i->v.s.src1);
+    break;
+  }
+}
+
+// walks block from its in state, when `rewrite` is set also changes instrs.
+// `prev` is instr before block (NULL for first one), it's needed to drop
+// instrs, it's left pointing to last instr of block. Returns true if out state
+// or taken edges changed
+static bool walk_block(cp_ctx *c, cfg_block *b, bool rewrite, taci **prev) {
+  load_block_in(c, b);
+
+  bool changed = false;
+  taci *next;
+  for (taci *i = b->first;; i = next) {
+    next = i->next;
+    bool last = i == b->last;
+    bool dropped = false;
+
+    if (rewrite)
+      subst_srcs(c, i);
+
+    if (last) {
+      changed |= eval_branch(c, b, i);
+      bool cond = i->op >= TAC_JZ && i->op <= TAC_JGE;
+      if (rewrite && cond && c->jump_ok[b->idx] != c->fall_ok[b->idx]) {
+        if (c->jump_ok[b->idx]) {
+          i->op = TAC_JMP;
+        } else {
+          dropped = true;
+          if (*prev != NULL)
+            (*prev)->next = next;
+          else
+            c->g.f->firsti = next;
+        }
+      }
+    }
+    if (!dropped)
+      *prev = i;
+
+    tacv *dst = taci_dst(i);
+    if (dst != NULL) {
+      tacv var = *dst;
+      lat l = eval(c, i, dst);
+      if (rewrite && l.t == LAT_CONST) {
+        i->op = TAC_CPY;
+        i->dst = var;
+        i->v.s.src1.t = TACV_CONST;
+        i->v.s.src1.v.iconst = make_const(l.c.v, var_type(c, &var));
+      }
+      set_var(c, &var, l);
+    }
+
+    if (last)
+      break;
+  }
+
+  if (!c->global || rewrite)
+    return changed;
+
+  lat *out = &c->out[b->idx * c->g.live_vars];
+  for (size_t v = 0; v < c->g.live_vars; ++v) {
+    if (!lat_eq(out[v], c->cur[v])) {
+      out[v] = c->cur[v];
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void find_jump_targets(cp_ctx *c) {
+  ht *label_block = ht_create_int();
+  vec_foreach(cfg_block, c->g.blocks, b) {
+    if (b->first->op == TAC_LABEL)
+      ht_set_int(label_block, b->first->label_idx,
+                 (void *)(intptr_t)(b->idx + 1));
+  }
+
+  vec_foreach(cfg_block, c->g.blocks, b) {
+    taci *last = b->last;
+    bool jumps =
+        last->op == TAC_JMP || (last->op >= TAC_JZ && last->op <= TAC_JGE);
+    c->jump_to[b->idx] =
+        jumps ? (int)(intptr_t)ht_get_int(label_block, last->label_idx) - 1
+              : -1;
+    if (last->op == TAC_JTAB)
+      c->jump_to[b->idx] = JUMP_TO_ANY;
+  }
+
+  ht_destroy(label_block);
+}
+
+static void solve(cp_ctx *c) {
+  size_t n = c->g.blocks.size;
+  bool *in_worklist = calloc(n, sizeof(bool));
+  bool *visited = calloc(n, sizeof(bool));
+  assert(in_worklist && visited);
+
+  int_vec worklist;
+  vec_init(worklist);
+  vec_push_back(worklist, 0);
+  in_worklist[0] = c->reached[0] = true;
+
+  while (!vec_empty(worklist)) {
+    int b = vec_back(worklist);
+    vec_pop_back(worklist);
+    in_worklist[b] = false;
+
+    taci *prev = NULL;
+    bool changed = walk_block(c, &c->g.blocks.data[b], false, &prev);
+    if (!changed && visited[b])
+      continue;
+    visited[b] = true;
+
+    vec_foreach(int, c->g.blocks.data[b].succs, s) {
+      if (!edge_ok(c, b, *s))
+        continue;
+      c->reached[*s] = true;
+      if (!in_worklist[*s]) {
+        vec_push_back(worklist, *s);
+        in_worklist[*s] = true;
+      }
+    }
+  }
+
+  vec_free(worklist);
+  free(in_worklist);
+  free(visited);
+}
+
+void const_prop_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  (void)prog;
+  if (f->firsti == NULL)
+    return;
+
+  cp_ctx c;
+  c.st = st;
+  build_cfg(&c.g, f, st);
+
+  size_t n = c.g.blocks.size;
+  size_t lv = c.g.live_vars;
+  c.global = n * lv <= CONST_PROP_MAX_CELLS;
+  c.out = NULL;
+  if (c.global) {
+    c.out = malloc(sizeof(lat) * (n * lv + 1));
+    assert(c.out);
+    for (size_t i = 0; i < n * lv; ++i)
+      c.out[i].t = LAT_UNDEF;
+  }
+  c.cur = malloc(sizeof(lat) * (c.g.vars.size + 1));
+  c.written = malloc(sizeof(int) * (c.g.vars.size + 1));
+  assert(c.cur && c.written);
+  memset(c.written, -1, sizeof(int) * c.g.vars.size);
+  c.reached = calloc(n, sizeof(bool));
+  c.jump_to = malloc(sizeof(int) * n);
+  c.jump_ok = calloc(n, sizeof(bool));
+  c.fall_ok = calloc(n, sizeof(bool));
+  assert(c.cur && c.reached && c.jump_to && c.jump_ok && c.fall_ok);
+
+  find_jump_targets(&c);
+  solve(&c);
+
+  // blocks are in order of instrs, so instr before block is last one left in
+  // previous block
+  taci *prev = NULL;
+  vec_foreach(cfg_block, c.g.blocks, b) {
+    if (c.reached[b->idx])
+      walk_block(&c, b, true, &prev);
+    else
+      prev = b->last;
+  }
+
+  free(c.out);
+  free(c.cur);
+  free(c.written);
+  free(c.reached);
+  free(c.jump_to);
+  free(c.jump_ok);
+  free(c.fall_ok);
+  free_cfg(&c.g);
+}
@@ -0,0 +1,219 @@
+#include "cfg.h"
+#include "common.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Copy propagation, in two steps:
+//  1. `t = a op b; x = t`, where temporary t is written and read only there,
+//     becomes `x = a op b`. gen_tac emits such pair for nearly every
+//     assignment, removed temporaries are dropped from sym table.
+//  2. inside of block, after `x = y` reads of x are replaced by y until x or y
+//     is written again, so copy itself is often left dead for dce.
+//
+// Only copies between locals of the same type are touched, conversions between
+// int and unsigned of same size are plain copies too.
+//
+// x86 for `d = a op b` is `mov a, d; op b, d`, so neither step may make d the
+// same var as b.
+
+typedef struct {
+  int reads;
+  int writes;
+} var_uses;
+
+typedef struct {
+  cfg g;
+  sym_table *st;
+
+  var_uses *uses; // step 1, per var
+
+  // step 2, per var. copy is valid only if it was made in current block and
+  // its source wasn't written since then
+  int *src;     // source of copy into var
+  int *src_ver; // version of source when copy was made
+  int *blk;     // block where copy was made, -1 if none
+  int *ver;     // incremented on each write
+  int block;
+} copy_ctx;
+
+static type *var_type(copy_ctx *c, tacv *v) {
+  syme *e = ht_get(c->st->t, v->v.var);
+  assert(e);
+  return e->t;
+}
+
+static bool is_binary(taci *i) { return i->op >= TAC_ADD && i->op <= TAC_GE; }
+
+// true if instr only writes dst, without reading it
+static bool is_plain_def(taci *i) {
+  switch (i->op) {
+  case TAC_NEGATE:
+  case TAC_COMPLEMENT:
+  case TAC_NOT:
+  case TAC_CPY:
+  case TAC_SIGN_EXTEND:
+  case TAC_ZERO_EXTEND:
+  case TAC_TRUNCATE:
+  case TAC_CALL:
+    return true;
+  default:
+    return is_binary(i);
+  }
+}
+
+static bool same_var(tacv *a, tacv *b) {
+  return a->t == TACV_VAR && b->t == TACV_VAR && !strcmp(a->v.var, b->v.var);
+}
+
+static void count_read(tacv *v, void *ctx) {
+  copy_ctx *c = ctx;
+  int idx = cfg_var_idx(&c->g, v);
+  if (idx >= 0)
+    ++c->uses[idx].reads;
+}
+
+static void count_uses(copy_ctx *c, tacf *f) {
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    taci_foreach_src(i, count_read, c);
+    tacv *dst = taci_dst(i);
+    int idx = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+    if (idx >= 0)
+      ++c->uses[idx].writes;
+  }
+}
+
+// step 1
+static void coalesce_temps(copy_ctx *c, tacf *f) {
+  taci *prev = NULL;
+  for (taci *i = f->firsti; i != NULL; prev = i, i = i->next) {
+    if (prev == NULL || i->op != TAC_CPY || !is_plain_def(prev) ||
+        !same_var(&prev->dst, &i->v.s.src1))
+      continue;
+
+    int t = cfg_var_idx(&c->g, &i->v.s.src1);
+    syme *e = ht_get(c->st->t, i->v.s.src1.v.var);
+    if (t < 0 || e->ref != NULL || c->uses[t].reads != 1 ||
+        c->uses[t].writes != 1)
+      continue;
+    if (!types_eq(e->t, var_type(c, &i->dst)))
+      continue;
+    if (is_binary(prev) && same_var(&prev->v.s.src2, &i->dst))
+      continue;
+
+    prev->dst = i->dst;
+    prev->next = i->next;
+    ht_remove(c->st->t, e->name);
+    i = prev;
+  }
+}
+
+static int copy_of(copy_ctx *c, int var) {
+  if (c->blk[var] != c->block || c->ver[c->src[var]] != c->src_ver[var])
+    return -1;
+  return c->src[var];
+}
+
+static void replace(copy_ctx *c, tacv *v) {
+  int idx = cfg_var_idx(&c->g, v);
+  int src = idx >= 0 ? copy_of(c, idx) : -1;
+  if (src >= 0)
+    v->v.var = c->g.vars.data[src];
+}
+
+static void replace_src(tacv *v, void *ctx) { replace(ctx, v); }
+
+// step 2, for one instr
+static void propagate(copy_ctx *c, taci *i) {
+  switch (i->op) {
+  case TAC_INC:
+  case TAC_DEC:
+    break;
+  case TAC_ASADD:
+  case TAC_ASSUB:
+  case TAC_ASMUL:
+  case TAC_ASDIV:
+  case TAC_ASMOD:
+  case TAC_ASAND:
+  case TAC_ASOR:
+  case TAC_ASXOR:
+  case TAC_ASLSHIFT:
+  case TAC_ASRSHIFT:
+    replace(c, &i->v.s.src1);
+    break;
+  default:
+    if (is_binary(i)) {
+      replace(c, &i->v.s.src1);
+      tacv src2 = i->v.s.src2;
+      replace(c, &src2);
+      if (!same_var(&src2, &i->dst))
+        i->v.s.src2 = src2;
+      break;
+    }
+    taci_foreach_src(i, replace_src, c);
+  }
+
+  tacv *dst = taci_dst(i);
+  int d = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+  if (d < 0)
+    return;
+  ++c->ver[d];
+  c->blk[d] = -1;
+
+  if (i->op != TAC_CPY)
+    return;
+  int s = cfg_var_idx(&c->g, &i->v.s.src1);
+  if (s < 0 || s == d || !types_eq(var_type(c, dst), var_type(c, &i->v.s.src1)))
+    return;
+  c->src[d] = s;
+  c->src_ver[d] = c->ver[s];
+  c->blk[d] = c->block;
+}
+
+static void propagate_copies(copy_ctx *c) {
+  size_t n = c->g.vars.size ? c->g.vars.size : 1;
+  c->src = malloc(sizeof(int) * n);
+  c->src_ver = malloc(sizeof(int) * n);
+  c->blk = malloc(sizeof(int) * n);
+  c->ver = calloc(n, sizeof(int));
+  assert(c->src && c->src_ver && c->blk && c->ver);
+  memset(c->blk, -1, sizeof(int) * n);
+
+  vec_foreach(cfg_block, c->g.blocks, b) {
+    c->block = b->idx;
+    for (taci *i = b->first;; i = i->next) {
+      propagate(c, i);
+      if (i == b->last)
+        break;
+    }
+  }
+
+  free(c->src);
+  free(c->src_ver);
+  free(c->blk);
+  free(c->ver);
+}
+
+void copy_prop_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  (void)prog;
+  copy_ctx c;
+  c.st = st;
+
+  build_cfg(&c.g, f, st);
+  c.uses = calloc(c.g.vars.size ? c.g.vars.size : 1, sizeof(var_uses));
+  assert(c.uses);
+  count_uses(&c, f);
+  coalesce_temps(&c, f);
+  free(c.uses);
+  free_cfg(&c.g);
+
+  // step 1 has removed instrs, so blocks are built again
+  build_cfg(&c.g, f, st);
+  propagate_copies(&c);
+  free_cfg(&c.g);
+}
@@ -0,0 +1,128 @@
+#include "bitset.h"
+#include "cfg.h"
+#include "common.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Dead code elimination driven by liveness. Each block is walked backward from
+// its live-out set and instrs writing local var which isn't live after them
+// are removed (calls stay, only their result is unused). Removing instr can
+// make its operands dead in other blocks, so it's repeated until nothing
+// changes. Temporaries which are no longer referenced are dropped from sym
+// table.
+
+// bound for rounds, each one rebuilds cfg
+#define DCE_MAX_ROUNDS 8
+
+typedef struct {
+  cfg g;
+  bool *live; // var -> live at current point of backward walk
+  bool *dead; // instr position -> instr is removed
+  VEC(taci *) instrs;
+} dce_ctx;
+
+static void mark_live(tacv *v, void *ctx) {
+  dce_ctx *c = ctx;
+  int idx = cfg_var_idx(&c->g, v);
+  if (idx >= 0)
+    c->live[idx] = true;
+}
+
+// returns number of removed instrs
+static int sweep_block(dce_ctx *c, cfg_block *b, size_t first, size_t last) {
+  int removed = 0;
+  bitset_foreach(&b->live_out, idx) c->live[idx] = true;
+
+  for (size_t p = last + 1; p-- > first;) {
+    taci *i = c->instrs.data[p];
+    tacv *dst = taci_dst(i);
+    int d = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+    if (d >= 0 && !c->live[d] && i->op != TAC_CALL) {
+      c->dead[p] = true;
+      ++removed;
+      continue;
+    }
+    if (d >= 0)
+      c->live[d] = false;
+    taci_foreach_src(i, mark_live, c);
+  }
+
+  // what is left live at block entry is part of live-in (vars which don't
+  // leave block are written before read)
+  bitset_foreach(&b->live_in, idx) c->live[idx] = false;
+  return removed;
+}
+
+static int sweep(dce_ctx *c, tacf *f) {
+  vec_clear(c->instrs);
+  for (taci *i = f->firsti; i != NULL; i = i->next)
+    vec_push_back(c->instrs, i);
+
+  size_t n = c->instrs.size;
+  c->dead = calloc(n ? n : 1, sizeof(bool));
+  c->live = calloc(c->g.vars.size ? c->g.vars.size : 1, sizeof(bool));
+  assert(c->dead && c->live);
+
+  int removed = 0;
+  size_t p = 0;
+  vec_foreach(cfg_block, c->g.blocks, b) {
+    size_t first = p;
+    while (c->instrs.data[p] != b->last)
+      ++p;
+    removed += sweep_block(c, b, first, p++);
+  }
+
+  // relink
+  taci **link = &f->firsti;
+  for (size_t j = 0; j < n; ++j) {
+    if (c->dead[j])
+      continue;
+    *link = c->instrs.data[j];
+    link = &c->instrs.data[j]->next;
+  }
+  *link = NULL;
+
+  free(c->dead);
+  free(c->live);
+  return removed;
+}
+
+void dce_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  (void)prog;
+  dce_ctx c;
+  vec_init(c.instrs);
+
+  VEC(string) before;
+  vec_init(before);
+
+  for (int round = 0;; ++round) {
+    build_cfg(&c.g, f, st);
+    if (round == 0)
+      vec_foreach(string, c.g.vars, it) vec_push_back(before, *it);
+    analyze_liveness(&c.g);
+    if (sweep(&c, f) == 0 || round + 1 == DCE_MAX_ROUNDS)
+      break;
+    free_cfg(&c.g);
+  }
+
+  // drop temporaries which are gone from function. if last round has removed
+  // something, vars of cfg are a superset and some are just kept
+  vec_foreach(string, before, it) {
+    tacv v;
+    v.t = TACV_VAR;
+    v.v.var = *it;
+    syme *e = ht_get(st->t, *it);
+    if (cfg_var_idx(&c.g, &v) < 0 && e->ref == NULL)
+      ht_remove(st->t, *it);
+  }
+  free_cfg(&c.g);
+
+  vec_free(before);
+  vec_free(c.instrs);
+}
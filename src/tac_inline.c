@@ -0,0 +1,268 @@
+#include "arena.h"
+#include "cfg.h"
+#include "common.h"
+#include "strings.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Inlining of calls to functions defined in program. Call is replaced by copy
+// of callee's instrs where:
+//  - locals and temporaries of callee get fresh names (static ones are shared
+//    and keep theirs), params are assigned from args first
+//  - labels get fresh numbers
+//  - each `ret v` is `dst = v; jmp end`, end label follows the copy
+// Copies are cleaned up by later passes (constprop folds constant args,
+// copyprop merges param copies).
+//
+// Callee is inlined when its size grows caller by at most INLINE_MAX_GROWTH
+// instrs (size of call itself is subtracted), for -Os the copy mustn't be
+// bigger than call. Static function with single call site is always inlined
+// (up to INLINE_MAX_SINGLE_CALL instrs), it's dropped from program then, same
+// as any static function which is left without calls. Recursive calls aren't
+// inlined, copies aren't scanned for calls again.
+//
+// Functions and call counts are collected once per program, before pass runs
+// on first function, and kept up to date by inlining. Other passes can only
+// remove calls, so counts may be too high, which just keeps function from
+// being treated as called once.
+
+#define INLINE_CALL_COST 3 // call, mov of result, stack alignment
+#define INLINE_MAX_GROWTH 16
+#define INLINE_MAX_SINGLE_CALL 512
+#define INLINE_MAX_CALLER 4096 // caller isn't grown further
+
+extern int var_name_idx_counter; // defined in resolve.c
+extern int label_idx_counter;    // defined in resolve.c
+
+typedef struct {
+  tac_program *prog;
+  sym_table *st;
+  tacf *f;
+  bool for_size;
+
+  // shared by all functions of prog, see tables
+  ht *funcs; // name -> tac_top_level of function defined in program
+  ht *calls; // name -> amount of call sites in program
+
+  // per inlined call
+  ht *vars;   // var of callee -> its copy
+  ht *labels; // label of callee -> its copy
+} inline_ctx;
+
+// funcs and calls of program, live from begin_inline to end_inline. Shared by
+// inline and inline-size, when both run
+static struct {
+  ht *funcs;
+  ht *calls;
+} tables;
+
+static size_t func_size(tacf *f) {
+  size_t n = 0;
+  for (taci *i = f->firsti; i != NULL; i = i->next)
+    n += i->op != TAC_LABEL;
+  return n;
+}
+
+static intptr_t calls_of(inline_ctx *c, string name) {
+  return (intptr_t)ht_get(c->calls, name);
+}
+
+static void add_calls(inline_ctx *c, string name, intptr_t n) {
+  intptr_t calls = calls_of(c, name) + n;
+  if (calls == 0)
+    ht_remove(c->calls, name);
+  else
+    ht_set(c->calls, name, (void *)calls);
+}
+
+void begin_inline(tac_program *prog) {
+  if (tables.funcs != NULL)
+    return;
+  inline_ctx c = {0};
+  c.funcs = tables.funcs = ht_create();
+  c.calls = tables.calls = ht_create();
+
+  for (tac_top_level *tl = prog->first; tl != NULL; tl = tl->next) {
+    if (!tl->is_func)
+      continue;
+    ht_set(c.funcs, tl->v.f.name, tl);
+    for (taci *i = tl->v.f.firsti; i != NULL; i = i->next)
+      if (i->op == TAC_CALL)
+        add_calls(&c, i->v.call.name, 1);
+  }
+}
+
+void end_inline(void) {
+  if (tables.funcs == NULL)
+    return;
+  ht_destroy(tables.funcs);
+  ht_destroy(tables.calls);
+  tables.funcs = tables.calls = NULL;
+}
+
+static bool worth_inlining(inline_ctx *c, taci *call, tacf *callee,
+                           size_t caller_size) {
+  if (!strcmp(callee->name, c->f->name) ||
+      callee->params_len != call->v.call.args_len)
+    return false;
+
+  size_t size = func_size(callee);
+  if (!callee->global && calls_of(c, callee->name) == 1)
+    return size <= INLINE_MAX_SINGLE_CALL;
+  if (caller_size > INLINE_MAX_CALLER)
+    return false;
+
+  long growth = (long)size - INLINE_CALL_COST - (long)call->v.call.args_len;
+  return growth <= (c->for_size ? 0 : INLINE_MAX_GROWTH);
+}
+
+static void rename_var(tacv *v, void *ctx) {
+  inline_ctx *c = ctx;
+  if (v->t != TACV_VAR)
+    return;
+  string copy = ht_get(c->vars, v->v.var);
+  if (copy == NULL) {
+    syme *e = ht_get(c->st->t, v->v.var);
+    assert(e);
+    if (e->a.t != ATTR_LOCAL)
+      return;
+    copy = new_local_like(c->st, v->v.var).v.var;
+    ht_set(c->vars, v->v.var, copy);
+  }
+  v->v.var = copy;
+}
+
+static int rename_label(inline_ctx *c, int label) {
+  intptr_t copy = (intptr_t)ht_get_int(c->labels, label);
+  if (copy == 0) {
+    copy = ++label_idx_counter;
+    ht_set_int(c->labels, label, (void *)copy);
+  }
+  return copy;
+}
+
+static taci *clone_instr(inline_ctx *c, taci *o) {
+  taci *i = new_taci(c->prog->taci_arena, o->op);
+  *i = *o;
+  i->next = NULL;
+
+  if (o->op == TAC_CALL && o->v.call.args_len > 0) {
+    i->v.call.args =
+        ARENA_ALLOC_ARRAY(c->prog->tacv_arena, tacv, o->v.call.args_len);
+    memcpy(i->v.call.args, o->v.call.args, sizeof(tacv) * o->v.call.args_len);
+  }
+  if (o->op == TAC_CALL) {
+    // callee may have been processed by tail call pass already
+    i->v.call.tail = false;
+    add_calls(c, o->v.call.name, 1);
+  }
+
+  if (o->op == TAC_JTAB) {
+    i->v.jtab.labels =
+        ARENA_ALLOC_ARRAY(c->prog->label_arena, int, o->v.jtab.labels_len);
+    for (size_t j = 0; j < o->v.jtab.labels_len; ++j)
+      i->v.jtab.labels[j] = rename_label(c, o->v.jtab.labels[j]);
+    i->v.jtab.table_label = ++label_idx_counter;
+  }
+  if (o->op == TAC_LABEL || o->op == TAC_JMP ||
+      (o->op >= TAC_JZ && o->op <= TAC_JGE))
+    i->label_idx = rename_label(c, o->label_idx);
+
+  // dst of some instrs is read too and was renamed as src
+  taci_foreach_src(i, rename_var, c);
+  tacv *dst = taci_dst(i), *odst = taci_dst(o);
+  if (dst != NULL && dst->v.var == odst->v.var)
+    rename_var(dst, c);
+  return i;
+}
+
+// replaces call by copy of callee, returns last instr of copy
+static taci *inline_call(inline_ctx *c, taci *call, tacf *callee) {
+  ht_destroy(c->vars);
+  ht_destroy(c->labels);
+  c->vars = ht_create();
+  c->labels = ht_create_int();
+
+  arena *a = c->prog->taci_arena;
+  taci head = {0};
+  taci *tail = &head;
+  for (size_t p = 0; p < callee->params_len; ++p) {
+    taci *cpy = tail = tail->next = new_taci(a, TAC_CPY);
+    cpy->v.s.src1 = call->v.call.args[p];
+    cpy->dst.t = TACV_VAR;
+    cpy->dst.v.var = callee->params[p];
+    rename_var(&cpy->dst, c);
+  }
+
+  int end = ++label_idx_counter;
+  for (taci *o = callee->firsti; o != NULL; o = o->next) {
+    if (o->op != TAC_RET) {
+      tail = tail->next = clone_instr(c, o);
+      continue;
+    }
+    taci *ret = clone_instr(c, o);
+    taci *cpy = tail = tail->next = new_taci(a, TAC_CPY);
+    cpy->dst = call->dst;
+    cpy->v.s.src1 = ret->v.s.src1;
+    if (o->next != NULL)
+      (tail = tail->next = new_taci(a, TAC_JMP))->label_idx = end;
+  }
+  (tail = tail->next = new_taci(a, TAC_LABEL))->label_idx = end;
+
+  // call instr is reused as first instr of copy, so link to it stays valid
+  tail->next = call->next;
+  if (tail == head.next)
+    tail = call;
+  *call = *head.next;
+  return tail;
+}
+
+static void drop_func(inline_ctx *c, string name) {
+  for (tac_top_level **link = &c->prog->first; *link != NULL;
+       link = &(*link)->next) {
+    if ((*link)->is_func && !strcmp((*link)->v.f.name, name)) {
+      *link = (*link)->next;
+      break;
+    }
+  }
+  ht_remove(c->funcs, name);
+}
+
+static void inline_calls(tac_program *prog, tacf *f, sym_table *st,
+                         bool for_size) {
+  assert(tables.funcs != NULL);
+  inline_ctx c = {prog, st, f, for_size, tables.funcs, tables.calls,
+                  ht_create(), ht_create_int()};
+
+  size_t size = func_size(f);
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (i->op != TAC_CALL)
+      continue;
+    tac_top_level *tl = ht_get(c.funcs, i->v.call.name);
+    if (tl == NULL || !worth_inlining(&c, i, &tl->v.f, size))
+      continue;
+
+    tacf *callee = &tl->v.f;
+    size += func_size(callee);
+    add_calls(&c, callee->name, -1);
+    i = inline_call(&c, i, callee);
+    if (!callee->global && calls_of(&c, callee->name) == 0)
+      drop_func(&c, callee->name);
+  }
+
+  ht_destroy(c.vars);
+  ht_destroy(c.labels);
+}
+
+void inline_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  inline_calls(prog, f, st, false);
+}
+
+void inline_size_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  inline_calls(prog, f, st, true);
+}
@@ -0,0 +1,508 @@
+#include "bitset.h"
+#include "cfg.h"
+#include "common.h"
+#include "dataflow.h"
+#include "strings.h"
+#include "table.h"
+#include "tac.h"
+#include "type.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Induction variables of loops. Basic iv is local written in loop only by
+// `i += c` (or inc, dec, `i = i + c`) with const c. Then:
+//  - derived iv `t = i * k`, with k invariant, becomes `t = r`, where r gets
+//    i * k before the loop and is stepped by c * k right after each step of i.
+//    Reads of t later in the block read r, so the copy is usually left dead
+//  - basic iv which is then read only by its step and by exit test in header,
+//    `jge i, n -> out` or `jlt i, n -> in` with invariant n, is replaced by
+//    counter `c = n - i` which is decremented and tested against zero. That
+//    needs i dead after the loop, step of 1, signed type, n - i not to
+//    overflow on entry (i starts as const 0 or n is const), and step outside
+//    of header, so i <= n holds at each test after the first one
+//
+// Arithmetic is done modulo 2^N, same as x86 does it, so r and c are exact
+// even when i * k or n - i wrap. New instrs for entry of loop are put into
+// preheader (see insert_preheader), cfg is rebuilt after each changed loop.
+
+// blocks followed back from preheader when looking for initial value of iv
+#define IVS_MAX_SCAN 8
+
+extern int var_name_idx_counter; // defined in resolve.c
+
+typedef struct {
+  int iv;  // basic iv
+  tacv k;  // invariant factor
+  tacv r;  // reduced var
+} reduced;
+
+typedef struct {
+  tac_program *prog;
+  tacf *f;
+  sym_table *st;
+  cfg g;
+  df_loop *loop;
+
+  // per var, counted in current loop
+  int *writes;
+  int *reads;
+  taci **step;    // step of basic iv, NULL if var isn't one
+  int64_t *delta; // amount added by step
+  int *derived;   // reads of basic iv by derived ivs which are reduced
+
+  VEC(reduced) done;
+  taci pre;    // head of instrs for preheader
+  taci *tail;  // last of them
+} ivs_ctx;
+
+static struct {
+  int derived;
+  int counters;
+} stats;
+
+static type *var_type(ivs_ctx *c, tacv *v) {
+  syme *e = ht_get(c->st->t, v->v.var);
+  assert(e);
+  return e->t;
+}
+
+static bool is_int_type(type *t) {
+  return t->t == TYPE_INT || t->t == TYPE_LONG || t->t == TYPE_UINT ||
+         t->t == TYPE_ULONG;
+}
+
+static bool same_var(tacv *a, tacv *b) {
+  return a->t == TACV_VAR && b->t == TACV_VAR && !strcmp(a->v.var, b->v.var);
+}
+
+// reduces v modulo 2^N of type t
+static tacv make_const(uint64_t v, type *t) {
+  int_const c;
+  c.t = CONST_ULONG;
+  c.v = v;
+  tacv res;
+  res.t = TACV_CONST;
+  res.v.iconst = convert_const_to_int(&c, NULL, t);
+  return res;
+}
+
+// appends instr to ones for preheader
+static taci *emit_pre(ivs_ctx *c, tacop op, tacv dst, tacv src1, tacv src2) {
+  taci *i = c->tail = c->tail->next = new_taci(c->prog->taci_arena, op);
+  i->dst = dst;
+  i->v.s.src1 = src1;
+  i->v.s.src2 = src2;
+  return i;
+}
+
+static bool is_invariant(ivs_ctx *c, tacv *v) {
+  if (v->t == TACV_CONST)
+    return true;
+  int idx = cfg_var_idx(&c->g, v);
+  return idx >= 0 && c->writes[idx] == 0;
+}
+
+static void count_read(tacv *v, void *ctx) {
+  ivs_ctx *c = ctx;
+  int idx = cfg_var_idx(&c->g, v);
+  if (idx >= 0)
+    ++c->reads[idx];
+}
+
+// amount added to var by instr, false if instr isn't step of basic iv
+static bool step_of(taci *i, tacv *var, int64_t *delta) {
+  switch (i->op) {
+  case TAC_INC:
+  case TAC_DEC:
+    *delta = i->op == TAC_INC ? 1 : -1;
+    return true;
+  case TAC_ASADD:
+  case TAC_ASSUB:
+    if (i->v.s.src1.t != TACV_CONST)
+      return false;
+    *delta = (int64_t)i->v.s.src1.v.iconst.v;
+    if (i->op == TAC_ASSUB)
+      *delta = -*delta;
+    return true;
+  case TAC_ADD:
+    if (same_var(&i->v.s.src1, var) && i->v.s.src2.t == TACV_CONST) {
+      *delta = (int64_t)i->v.s.src2.v.iconst.v;
+      return true;
+    }
+    if (same_var(&i->v.s.src2, var) && i->v.s.src1.t == TACV_CONST) {
+      *delta = (int64_t)i->v.s.src1.v.iconst.v;
+      return true;
+    }
+    return false;
+  case TAC_SUB:
+    if (!same_var(&i->v.s.src1, var) || i->v.s.src2.t != TACV_CONST)
+      return false;
+    *delta = -(int64_t)i->v.s.src2.v.iconst.v;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void find_basic_ivs(ivs_ctx *c) {
+  size_t n = c->g.vars.size;
+  memset(c->writes, 0, sizeof(int) * n);
+  memset(c->reads, 0, sizeof(int) * n);
+  memset(c->step, 0, sizeof(taci *) * n);
+  memset(c->derived, 0, sizeof(int) * n);
+
+  bitset_foreach(&c->loop->body, b) {
+    cfg_block *blk = &c->g.blocks.data[b];
+    for (taci *i = blk->first;; i = i->next) {
+      taci_foreach_src(i, count_read, c);
+      tacv *dst = taci_dst(i);
+      int idx = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+      if (idx >= 0) {
+        ++c->writes[idx];
+        c->step[idx] = i;
+      }
+      if (i == blk->last)
+        break;
+    }
+  }
+
+  for (size_t idx = 0; idx < n; ++idx) {
+    taci *i = c->step[idx];
+    if (i == NULL)
+      continue;
+    tacv *var = taci_dst(i);
+    if (c->writes[idx] != 1 || !is_int_type(var_type(c, var)) ||
+        !step_of(i, var, &c->delta[idx]))
+      c->step[idx] = NULL;
+  }
+}
+
+// basic iv which is operand of `t = i * k` with invariant k, -1 if none
+static int derived_from(ivs_ctx *c, taci *i, tacv **k) {
+  if (i->op != TAC_MUL)
+    return -1;
+  int d = cfg_var_idx(&c->g, &i->dst);
+  if (d < 0 || c->writes[d] != 1 || c->step[d] != NULL)
+    return -1;
+
+  tacv *ops[2] = {&i->v.s.src1, &i->v.s.src2};
+  for (int j = 0; j < 2; ++j) {
+    int iv = cfg_var_idx(&c->g, ops[j]);
+    if (iv >= 0 && c->step[iv] != NULL && is_invariant(c, ops[1 - j])) {
+      *k = ops[1 - j];
+      return iv;
+    }
+  }
+  return -1;
+}
+
+static bool same_val(tacv *a, tacv *b) {
+  if (a->t == TACV_CONST)
+    return b->t == TACV_CONST && a->v.iconst.v == b->v.iconst.v;
+  return same_var(a, b);
+}
+
+// reduced var for i * k, made on first use
+static tacv reduce(ivs_ctx *c, taci *def, int iv, tacv *k) {
+  vec_foreach(reduced, c->done, it) {
+    if (it->iv == iv && same_val(&it->k, k))
+      return it->r;
+  }
+
+  type *t = var_type(c, &def->dst);
+  reduced red = {iv, *k, new_local_like(c->st, def->dst.v.var)};
+  emit_pre(c, TAC_MUL, red.r, def->v.s.src1, def->v.s.src2);
+
+  // r += c * k, after step of iv
+  int64_t delta = c->delta[iv];
+  taci *step = new_taci(c->prog->taci_arena, TAC_ASADD);
+  step->dst = red.r;
+  if (k->t == TACV_CONST) {
+    step->v.s.src1 = make_const((uint64_t)delta * k->v.iconst.v, t);
+  } else if (delta == 1 || delta == -1) {
+    step->op = delta == 1 ? TAC_ASADD : TAC_ASSUB;
+    step->v.s.src1 = *k;
+  } else {
+    tacv s = new_local_like(c->st, def->dst.v.var);
+    emit_pre(c, TAC_MUL, s, *k, make_const(delta, t));
+    step->v.s.src1 = s;
+  }
+  taci *after = c->step[iv];
+  step->next = after->next;
+  after->next = step;
+
+  vec_push_back(c->done, red);
+  ++stats.derived;
+  return red.r;
+}
+
+typedef struct {
+  tacv *from;
+  tacv *to;  // NULL if reads are only looked for
+  bool read;
+} rename_ctx;
+
+static void rename_src(tacv *v, void *ctx) {
+  rename_ctx *r = ctx;
+  if (!same_var(v, r->from))
+    return;
+  r->read = true;
+  if (r->to != NULL)
+    *v = *r->to;
+}
+
+// replaces reads of t by r after def, until r is stepped. Returns true if
+// value of def may still be read later in the block or after it
+static bool forward_copy(ivs_ctx *c, cfg_block *b, taci *def, taci *end) {
+  tacv t = def->dst, r = def->v.s.src1;
+  rename_ctx rc = {&t, &r, false};
+  for (taci *i = def->next; i != end; i = i->next) {
+    tacv *dst = taci_dst(i);
+    if (dst != NULL && same_var(dst, &t))
+      return true;
+    taci_foreach_src(i, rename_src, &rc);
+    if (rc.to == NULL && rc.read)
+      return true;
+    if (dst != NULL && same_var(dst, &r)) {
+      rc.to = NULL;
+      rc.read = false;
+    }
+  }
+  int idx = cfg_var_idx(&c->g, &t);
+  return idx < c->g.live_vars && bitset_test(&b->live_out, idx);
+}
+
+static void remove_instr(ivs_ctx *c, taci *x) {
+  taci **link = &c->f->firsti;
+  while (*link != x)
+    link = &(*link)->next;
+  *link = x->next;
+}
+
+static void reduce_derived(ivs_ctx *c) {
+  bitset_foreach(&c->loop->body, b) {
+    cfg_block *blk = &c->g.blocks.data[b];
+    taci *end = blk->last->next;
+    for (taci *i = blk->first; i != end; i = i->next) {
+      tacv *k;
+      int iv = derived_from(c, i, &k);
+      if (iv < 0)
+        continue;
+      tacv r = reduce(c, i, iv, k);
+      i->op = TAC_CPY;
+      i->v.s.src1 = r;
+
+      // dce has already run, copy which isn't read is dropped here
+      if (!forward_copy(c, blk, i, end))
+        remove_instr(c, i);
+    }
+  }
+}
+
+static bool in_block(cfg_block *b, taci *x) {
+  for (taci *i = b->first;; i = i->next) {
+    if (i == x)
+      return true;
+    if (i == b->last)
+      return false;
+  }
+}
+
+// const which var has when loop is entered, false if it's not known
+static bool entry_const(ivs_ctx *c, tacv *var, int_const *res) {
+  if (c->loop->header == 0)
+    return false;
+  int from = -1;
+  vec_foreach(int, c->g.blocks.data[c->loop->header].preds, it) {
+    if (bitset_test(&c->loop->body, *it))
+      continue;
+    if (from >= 0)
+      return false;
+    from = *it;
+  }
+
+  for (int n = 0; from >= 0 && n < IVS_MAX_SCAN; ++n) {
+    cfg_block *b = &c->g.blocks.data[from];
+    taci *last = NULL;
+    for (taci *i = b->first;; i = i->next) {
+      tacv *dst = taci_dst(i);
+      if (dst != NULL && same_var(dst, var))
+        last = i;
+      if (i == b->last)
+        break;
+    }
+    if (last != NULL) {
+      if (last->op != TAC_CPY || last->v.s.src1.t != TACV_CONST)
+        return false;
+      *res = last->v.s.src1.v.iconst;
+      return true;
+    }
+    if (from == 0 || b->preds.size != 1)
+      return false;
+    from = b->preds.data[0];
+  }
+  return false;
+}
+
+static bool dead_after_loop(ivs_ctx *c, int idx) {
+  if (idx >= c->g.live_vars)
+    return true;
+  bitset_foreach(&c->loop->body, b) {
+    vec_foreach(int, c->g.blocks.data[b].succs, it) {
+      if (!bitset_test(&c->loop->body, *it) &&
+          bitset_test(&c->g.blocks.data[*it].live_in, idx))
+        return false;
+    }
+  }
+  return true;
+}
+
+// exit test in header which stays in loop while i < n, NULL if there is none
+static taci *exit_test(ivs_ctx *c, int iv) {
+  cfg_block *h = &c->g.blocks.data[c->loop->header];
+  taci *test = h->last;
+  if ((test->op != TAC_JGE && test->op != TAC_JLT) || h->succs.size != 2 ||
+      cfg_var_idx(&c->g, &test->v.s.src1) != iv ||
+      !is_invariant(c, &test->v.s.src2))
+    return NULL;
+
+  // jge leaves loop, jlt enters it and falls out
+  int next = c->loop->header + 1;
+  bool falls_in =
+      next < c->g.blocks.size && bitset_test(&c->loop->body, next);
+  int target = h->succs.data[0] == next ? h->succs.data[1] : h->succs.data[0];
+  if (target == next || falls_in != (test->op == TAC_JGE) ||
+      bitset_test(&c->loop->body, target) == falls_in)
+    return NULL;
+  return test;
+}
+
+// initial value of counter, n - i on entry of loop
+static bool counter_start(ivs_ctx *c, tacv *i, tacv *n, tacv *res) {
+  int_const start;
+  if (!entry_const(c, i, &start))
+    return false;
+  if (n->t == TACV_VAR) {
+    *res = *n;
+    return start.v == 0;
+  }
+
+  type *t = var_type(c, i);
+  int64_t v;
+  if (__builtin_sub_overflow((int64_t)n->v.iconst.v, (int64_t)start.v, &v) ||
+      (t->t == TYPE_INT && (v < INT32_MIN || v > INT32_MAX)))
+    return false;
+  *res = make_const(v, t);
+  return true;
+}
+
+// replaces basic iv used only by exit test by counter going down to zero
+static void count_down(ivs_ctx *c, int iv) {
+  taci *step = c->step[iv];
+  tacv i = *taci_dst(step);
+  type *t = var_type(c, &i);
+  if (c->delta[iv] != 1 || (t->t != TYPE_INT && t->t != TYPE_LONG) ||
+      c->reads[iv] - c->derived[iv] != 2 || !dead_after_loop(c, iv) ||
+      in_block(&c->g.blocks.data[c->loop->header], step))
+    return;
+
+  taci *test = exit_test(c, iv);
+  tacv start;
+  if (test == NULL || !counter_start(c, &i, &test->v.s.src2, &start))
+    return;
+
+  tacv cnt = new_local_like(c->st, i.v.var);
+  emit_pre(c, TAC_CPY, cnt, start, start);
+  step->op = TAC_DEC;
+  step->v.s.src1 = cnt;
+  test->op = test->op == TAC_JGE ? TAC_JLE : TAC_JGT;
+  test->v.s.src1 = cnt;
+  test->v.s.src2 = make_const(0, t);
+  ++stats.counters;
+}
+
+// returns true if loop was changed
+static bool optimize_loop(ivs_ctx *c) {
+  if (c->g.blocks.data[c->loop->header].first->op != TAC_LABEL ||
+      !loop_has_single_entry(&c->g, c->loop))
+    return false;
+
+  find_basic_ivs(c);
+  vec_clear(c->done);
+  c->pre.next = NULL;
+  c->tail = &c->pre;
+
+  // counters are found before instrs are added after steps, while blocks of
+  // cfg are still accurate. Reads of ivs by derived ones go away then
+  bitset_foreach(&c->loop->body, b) {
+    cfg_block *blk = &c->g.blocks.data[b];
+    for (taci *i = blk->first;; i = i->next) {
+      tacv *k;
+      int iv = derived_from(c, i, &k);
+      if (iv >= 0)
+        ++c->derived[iv];
+      if (i == blk->last)
+        break;
+    }
+  }
+  for (size_t idx = 0; idx < c->g.vars.size; ++idx)
+    if (c->step[idx] != NULL)
+      count_down(c, idx);
+  reduce_derived(c);
+
+  if (c->pre.next == NULL)
+    return false;
+  insert_preheader(&c->g, c->loop, c->pre.next, c->tail,
+                   c->prog->taci_arena);
+  return true;
+}
+
+void reduce_ivs_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  ivs_ctx c = {0};
+  c.prog = prog;
+  c.f = f;
+  c.st = st;
+  vec_init(c.done);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    build_cfg(&c.g, f, st);
+    analyze_liveness(&c.g);
+
+    size_t vars = c.g.vars.size ? c.g.vars.size : 1;
+    c.writes = malloc(sizeof(int) * vars);
+    c.reads = malloc(sizeof(int) * vars);
+    c.step = malloc(sizeof(taci *) * vars);
+    c.delta = malloc(sizeof(int64_t) * vars);
+    c.derived = malloc(sizeof(int) * vars);
+    assert(c.writes && c.reads && c.step && c.delta && c.derived);
+
+    df_loop_vec loops;
+    find_cfg_loops(&c.g, &loops);
+    vec_foreach(df_loop, loops, l) {
+      c.loop = l;
+      if ((changed = optimize_loop(&c)))
+        break;
+    }
+
+    df_free_loops(&loops);
+    free(c.writes);
+    free(c.reads);
+    free(c.step);
+    free(c.delta);
+    free(c.derived);
+    free_cfg(&c.g);
+  }
+
+  vec_free(c.done);
+}
+
+void print_ivs_stats(void) {
+  fprintf(stderr, "ivs              reduced mults %d\n", stats.derived);
+  fprintf(stderr, "ivs              counters %d\n", stats.counters);
+}
@@ -0,0 +1,307 @@
+#include "bitset.h"
+#include "cfg.h"
+#include "common.h"
+#include "dataflow.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loop invariant code motion. Loops are found by back edges of cfg, inner ones
+// first. Instr of loop is invariant if it can't fault, isn't a call and reads
+// only consts, vars not written in loop and vars written in loop only by
+// invariant instrs. There are no pointers, so static var is written only by
+// instrs which name it and by calls of functions which aren't pure.
+//
+// Invariant instr is moved to preheader of loop if its dst is local, written
+// only by it in the loop and not live at entry of header. Then every read of
+// dst reachable from header is preceded by the instr, so it may run once before
+// the loop, even on paths which wouldn't have run it.
+//
+// Preheader is new label put before header, jumps into loop from outside are
+// retargeted to it. Cfg is rebuilt after each changed loop, so instrs moved out
+// of inner loop can be moved further out of outer one.
+
+typedef enum {
+  PURITY_UNKNOWN,
+  PURITY_VISITING, // on stack of is_pure, recursion is taken as impure
+  PURITY_PURE,
+  PURITY_IMPURE,
+} purity;
+
+typedef struct {
+  tac_program *prog;
+  tacf *f;
+  sym_table *st;
+  cfg g;
+
+  ht *funcs;  // name -> tacf, built on first call in loop
+  ht *purity; // name -> purity
+
+  // current loop
+  df_loop *loop;
+  VEC(taci *) body; // instrs of loop in list order
+  bool *moved;      // per instr of body
+  int *writes;      // per var, writes in loop
+  bool *hoisted;    // per var, true if its write in loop was moved
+  ht *statics;      // statics written by instrs of loop
+  bool calls;       // loop calls function which isn't pure
+} licm_ctx;
+
+static struct {
+  int loops; // loops which got preheader
+  int instrs;
+} stats;
+
+static tacf *find_func(licm_ctx *c, string name) {
+  if (c->funcs == NULL) {
+    c->funcs = ht_create();
+    for (tac_top_level *tl = c->prog->first; tl != NULL; tl = tl->next)
+      if (tl->is_func && tl->v.f.firsti != NULL)
+        ht_set(c->funcs, tl->v.f.name, &tl->v.f);
+  }
+  return ht_get(c->funcs, name);
+}
+
+static bool writes_static(licm_ctx *c, taci *i) {
+  tacv *dst = taci_dst(i);
+  if (dst == NULL || dst->t != TACV_VAR)
+    return false;
+  syme *e = ht_get(c->st->t, dst->v.var);
+  assert(e);
+  return e->a.t != ATTR_LOCAL;
+}
+
+// true if function writes no statics, itself or by calls. Functions defined in
+// other units are not pure
+static bool is_pure(licm_ctx *c, string name) {
+  purity p = (intptr_t)ht_get(c->purity, name);
+  if (p != PURITY_UNKNOWN)
+    return p == PURITY_PURE;
+
+  tacf *f = find_func(c, name);
+  if (f == NULL) {
+    ht_set(c->purity, name, (void *)PURITY_IMPURE);
+    return false;
+  }
+
+  ht_set(c->purity, name, (void *)PURITY_VISITING);
+  p = PURITY_PURE;
+  for (taci *i = f->firsti; i != NULL && p == PURITY_PURE; i = i->next)
+    if (writes_static(c, i) ||
+        (i->op == TAC_CALL && !is_pure(c, i->v.call.name)))
+      p = PURITY_IMPURE;
+  ht_set(c->purity, name, (void *)p);
+  return p == PURITY_PURE;
+}
+
+static bool is_const(tacv *v) { return v->t == TACV_CONST; }
+
+// false for instrs which may fault or have effects besides write of dst
+static bool can_move(taci *i) {
+  switch (i->op) {
+  case TAC_NEGATE:
+  case TAC_COMPLEMENT:
+  case TAC_NOT:
+  case TAC_CPY:
+  case TAC_SIGN_EXTEND:
+  case TAC_ZERO_EXTEND:
+  case TAC_TRUNCATE:
+  case TAC_ADD:
+  case TAC_SUB:
+  case TAC_MUL:
+  case TAC_AND:
+  case TAC_OR:
+  case TAC_XOR:
+  case TAC_LSHIFT:
+  case TAC_RSHIFT:
+  case TAC_EQ:
+  case TAC_NE:
+  case TAC_LT:
+  case TAC_LE:
+  case TAC_GT:
+  case TAC_GE:
+    return true;
+  case TAC_DIV:
+  case TAC_MOD: {
+    // only by const which is neither 0 nor -1 (INT_MIN / -1 faults too)
+    tacv *d = &i->v.s.src2;
+    uint64_t v = d->v.iconst.v;
+    return is_const(d) && v != 0 && v != UINT32_MAX && v != UINT64_MAX;
+  }
+  default:
+    return false;
+  }
+}
+
+typedef struct {
+  licm_ctx *c;
+  bool invariant;
+} src_ctx;
+
+static void check_src(tacv *v, void *ctx) {
+  src_ctx *s = ctx;
+  licm_ctx *c = s->c;
+  if (is_const(v))
+    return;
+  int idx = cfg_var_idx(&c->g, v);
+  if (idx < 0) {
+    if (c->calls || ht_get(c->statics, v->v.var) != NULL)
+      s->invariant = false;
+    return;
+  }
+  if (c->writes[idx] != 0 && !c->hoisted[idx])
+    s->invariant = false;
+}
+
+static bool is_invariant(licm_ctx *c, taci *i) {
+  if (!can_move(i))
+    return false;
+
+  int d = cfg_var_idx(&c->g, &i->dst);
+  if (d < 0 || c->writes[d] != 1)
+    return false;
+  cfg_block *header = &c->g.blocks.data[c->loop->header];
+  if (d < c->g.live_vars && bitset_test(&header->live_in, d))
+    return false;
+
+  src_ctx s = {c, true};
+  taci_foreach_src(i, check_src, &s);
+  return s.invariant;
+}
+
+static void collect_body(licm_ctx *c) {
+  vec_clear(c->body);
+  memset(c->writes, 0, sizeof(int) * c->g.vars.size);
+  memset(c->hoisted, 0, sizeof(bool) * c->g.vars.size);
+  if (c->statics != NULL)
+    ht_destroy(c->statics);
+  c->statics = ht_create();
+  c->calls = false;
+
+  bitset_foreach(&c->loop->body, b) {
+    cfg_block *blk = &c->g.blocks.data[b];
+    for (taci *i = blk->first;; i = i->next) {
+      vec_push_back(c->body, i);
+      tacv *dst = taci_dst(i);
+      int idx = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+      if (idx >= 0)
+        ++c->writes[idx];
+      else if (writes_static(c, i))
+        ht_set(c->statics, dst->v.var, (void *)1);
+      if (i->op == TAC_CALL && !c->calls && !is_pure(c, i->v.call.name))
+        c->calls = true;
+      if (i == blk->last)
+        break;
+    }
+  }
+}
+
+// marks invariant instrs, sweeps again while new ones are found, so instrs
+// reading moved ones are moved after them
+static int find_invariants(licm_ctx *c, taci ***order) {
+  c->moved = realloc(c->moved, sizeof(bool) * (c->body.size + 1));
+  *order = malloc(sizeof(taci *) * (c->body.size + 1));
+  assert(c->moved && *order);
+  memset(c->moved, 0, sizeof(bool) * c->body.size);
+
+  int n = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t k = 0; k < c->body.size; ++k) {
+      taci *i = c->body.data[k];
+      if (c->moved[k] || !is_invariant(c, i))
+        continue;
+      c->moved[k] = changed = true;
+      c->hoisted[cfg_var_idx(&c->g, &i->dst)] = true;
+      (*order)[n++] = i;
+    }
+  }
+  return n;
+}
+
+// unlinks moved instrs and puts them into preheader
+static void move_to_preheader(licm_ctx *c, taci **order, int n) {
+  size_t k = 0;
+  for (taci **link = &c->f->firsti; *link != NULL;) {
+    taci *i = *link;
+    if (k < c->body.size && i == c->body.data[k] && c->moved[k++])
+      *link = i->next;
+    else
+      link = &i->next;
+  }
+
+  for (int k = 0; k + 1 < n; ++k)
+    order[k]->next = order[k + 1];
+  insert_preheader(&c->g, c->loop, order[0], order[n - 1],
+                   c->prog->taci_arena);
+}
+
+// returns true if instrs were moved out of current loop
+static bool hoist_loop(licm_ctx *c) {
+  if (c->g.blocks.data[c->loop->header].first->op != TAC_LABEL ||
+      !loop_has_single_entry(&c->g, c->loop))
+    return false;
+
+  collect_body(c);
+  taci **order;
+  int n = find_invariants(c, &order);
+  if (n > 0) {
+    move_to_preheader(c, order, n);
+    ++stats.loops;
+    stats.instrs += n;
+  }
+  free(order);
+  return n > 0;
+}
+
+void licm_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  licm_ctx c = {0};
+  c.prog = prog;
+  c.f = f;
+  c.st = st;
+  c.purity = ht_create();
+  vec_init(c.body);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    build_cfg(&c.g, f, st);
+    analyze_liveness(&c.g);
+
+    size_t vars = c.g.vars.size ? c.g.vars.size : 1;
+    c.writes = malloc(sizeof(int) * vars);
+    c.hoisted = malloc(sizeof(bool) * vars);
+    assert(c.writes && c.hoisted);
+
+    df_loop_vec loops;
+    find_cfg_loops(&c.g, &loops);
+    vec_foreach(df_loop, loops, l) {
+      c.loop = l;
+      if ((changed = hoist_loop(&c)))
+        break;
+    }
+
+    df_free_loops(&loops);
+    free(c.writes);
+    free(c.hoisted);
+    free_cfg(&c.g);
+  }
+
+  vec_free(c.body);
+  free(c.moved);
+  if (c.statics != NULL)
+    ht_destroy(c.statics);
+  if (c.funcs != NULL)
+    ht_destroy(c.funcs);
+  ht_destroy(c.purity);
+}
+
+void print_licm_stats(void) {
+  fprintf(stderr, "licm             loops %d\n", stats.loops);
+  fprintf(stderr, "licm             hoisted instrs %d\n", stats.instrs);
+}
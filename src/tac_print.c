@@ -1,3 +1,4 @@
+#include "cfg.h"
 #include "common.h"
 #include "tac.h"
 #include <stdint.h>
@@ -45,6 +46,18 @@ const char *tacop_str(tacop op) {
     return "gt";
   case TAC_GE:
     return "ge";
+  case TAC_JE:
+    return "je";
+  case TAC_JNE:
+    return "jne";
+  case TAC_JLT:
+    return "jlt";
+  case TAC_JLE:
+    return "jle";
+  case TAC_JGT:
+    return "jgt";
+  case TAC_JGE:
+    return "jge";
   case TAC_INC:
     return "inc";
   case TAC_DEC:
@@ -81,8 +94,8 @@ const char *tacop_str(tacop op) {
   case TAC_JZ:
   case TAC_JNZ:
   case TAC_LABEL:
-  case TAC_JE:
   case TAC_CALL:
+  case TAC_JTAB:
     break;
   }
 
@@ -94,13 +107,16 @@ static void fprint_val(FILE *f, tacv *v) {
   case TACV_CONST:
     switch (v->v.iconst.t) {
     case CONST_INT:
-      fprintf(f, "int(%llu)", (unsigned long long)v->v.iconst.v);
+      fprintf(f, "int(%lld)", (long long)v->v.iconst.v);
       break;
     case CONST_LONG:
-      fprintf(f, "long(%llu)", (unsigned long long)v->v.iconst.v);
+      fprintf(f, "long(%lld)", (long long)v->v.iconst.v);
       break;
     case CONST_UINT:
+      fprintf(f, "uint(%llu)", (unsigned long long)v->v.iconst.v);
+      break;
     case CONST_ULONG:
+      fprintf(f, "ulong(%llu)", (unsigned long long)v->v.iconst.v);
       break;
     }
     break;
@@ -205,15 +221,21 @@ void fprint_taci(FILE *f, taci *i) {
     fprintf(f, "L%d:", i->label_idx);
     break;
   case TAC_JE:
-    fprintf(f, "je ");
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
+    fprintf(f, "%s ", tacop_str(i->op));
     fprint_val(f, &i->v.s.src1);
-    fprintf(f, " == ");
+    fprintf(f, ", ");
     fprint_val(f, &i->v.s.src2);
     fprintf(f, " -> L%d", i->label_idx);
     break;
   case TAC_CALL:
     fprint_val(f, &i->dst);
-    fprintf(f, " = call%s %s(", i->v.call.plt ? "@plt" : "", i->v.call.name);
+    fprintf(f, " = %scall%s %s(", i->v.call.tail ? "tail " : "",
+            i->v.call.plt ? "@plt" : "", i->v.call.name);
     if (i->v.call.args != NULL)
       fprint_val(f, &i->v.call.args[0]);
     for (int j = 1; j < i->v.call.args_len; ++j) {
@@ -222,10 +244,18 @@ void fprint_taci(FILE *f, taci *i) {
     }
     fprintf(f, ")\n");
     break;
+  case TAC_JTAB:
+    fprintf(f, "jtab ");
+    fprint_val(f, &i->v.jtab.idx);
+    fprintf(f, " -> [");
+    for (size_t j = 0; j < i->v.jtab.labels_len; ++j)
+      fprintf(f, j == 0 ? "L%d" : ", L%d", i->v.jtab.labels[j]);
+    fprintf(f, "]");
+    break;
   }
 }
 
-static void print_tac_func(tacf *f) {
+static void print_tac_func(tacf *f, sym_table *st) {
   if (f->global)
     printf("global func %s(", f->name);
   else
@@ -237,11 +267,23 @@ static void print_tac_func(tacf *f) {
   }
   printf("):\n");
 
-  for (taci *i = f->firsti; i != NULL; i = i->next) {
-    printf("\t");
-    fprint_taci(stdout, i);
-    printf("\n");
+  cfg g;
+  build_cfg(&g, f, st);
+  analyze_liveness(&g);
+
+  vec_foreach(cfg_block, g.blocks, b) {
+    print_cfg_block_header(stdout, &g, b);
+    for (taci *i = b->first;; i = i->next) {
+      printf("\t");
+      fprint_taci(stdout, i);
+      printf("\n");
+      if (i == b->last)
+        break;
+    }
+    print_cfg_block_footer(stdout, &g, b);
   }
+
+  free_cfg(&g);
 }
 
 static void print_tac_static_var(tac_static_var *sv) {
@@ -251,10 +293,10 @@ static void print_tac_static_var(tac_static_var *sv) {
     printf("static %s = %llu", sv->name, (long long unsigned)sv->init.v);
 }
 
-void print_tac(tac_program *prog) {
+void print_tac(tac_program *prog, sym_table *st) {
   for (tac_top_level *tl = prog->first; tl != NULL; tl = tl->next) {
     if (tl->is_func) {
-      print_tac_func(&tl->v.f);
+      print_tac_func(&tl->v.f, st);
     } else {
       print_tac_static_var(&tl->v.v);
     }
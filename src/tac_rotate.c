@@ -0,0 +1,247 @@
+#include "bitset.h"
+#include "cfg.h"
+#include "common.h"
+#include "dataflow.h"
+#include "strings.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loop rotation. While and for loops are lowered with exit test at the top,
+//
+//   Lh: test; jcc Lexit; body; jmp Lh; Lexit:
+//
+// so each iteration runs jcc and jmp. Jump back of loop with single latch is
+// replaced by copy of the test with inverted condition, which jumps to start of
+// body directly, and header is left as guard run once on entry:
+//
+//   Lh: test; jcc Lexit; Lb: body; test; j!cc Lb; jmp Lexit; Lexit:
+//
+// (jump to next label is dropped later). Header which jumps into the loop and
+// falls out of it keeps its condition and gets jump to its fallthrough. Only
+// headers of at most ROTATE_MAX_INSTRS instrs besides label and jump, without
+// calls, are copied. Temporaries which don't leave header get new names in the
+// copy, so both copies keep single read.
+//
+// All loops are rotated in one walk over cfg: labels are only put after
+// headers and latches keep their jump instr, so blocks of other loops stay
+// valid. Runs after ivs, which looks for exit test in header.
+
+#define ROTATE_MAX_INSTRS 4
+
+extern int label_idx_counter;    // defined in resolve.c
+extern int var_name_idx_counter; // defined in resolve.c
+
+typedef struct {
+  string from;
+  tacv to;
+} renamed;
+
+typedef struct {
+  tac_program *prog;
+  sym_table *st;
+  cfg g;
+  int *label; // block -> label it starts with, -1 if none
+
+  renamed names[ROTATE_MAX_INSTRS];
+  int names_len;
+} rotate_ctx;
+
+static struct {
+  int loops;
+} stats;
+
+static bool is_cond_jump(taci *i) {
+  return i->op >= TAC_JZ && i->op <= TAC_JGE;
+}
+
+static tacop invert_jump(tacop op) {
+  switch (op) {
+  case TAC_JZ:
+    return TAC_JNZ;
+  case TAC_JNZ:
+    return TAC_JZ;
+  case TAC_JE:
+    return TAC_JNE;
+  case TAC_JNE:
+    return TAC_JE;
+  case TAC_JLT:
+    return TAC_JGE;
+  case TAC_JLE:
+    return TAC_JGT;
+  case TAC_JGT:
+    return TAC_JLE;
+  case TAC_JGE:
+    return TAC_JLT;
+  default:
+    UNREACHABLE();
+  }
+}
+
+// label of block, which gets new one if it has none. Block mustn't be entry
+static int block_label(rotate_ctx *c, int b) {
+  if (c->label[b] >= 0)
+    return c->label[b];
+  assert(b > 0);
+  taci *prev = c->g.blocks.data[b - 1].last;
+  taci *l = new_taci(c->prog->taci_arena, TAC_LABEL);
+  l->label_idx = c->label[b] = ++label_idx_counter;
+  l->next = prev->next;
+  prev->next = l;
+  return l->label_idx;
+}
+
+static void rename_src(tacv *v, void *ctx) {
+  rotate_ctx *c = ctx;
+  if (v->t != TACV_VAR)
+    return;
+  for (int k = c->names_len - 1; k >= 0; --k) {
+    if (!strcmp(c->names[k].from, v->v.var)) {
+      *v = c->names[k].to;
+      return;
+    }
+  }
+}
+
+// copies instrs of header after label, temporaries which are dead at exit of
+// header are renamed. Returns last copy, which is the jump
+static taci *copy_header(rotate_ctx *c, cfg_block *h, taci **first) {
+  c->names_len = 0;
+  taci *tail = NULL;
+  for (taci *i = h->first->next;; i = i->next) {
+    taci *copy = new_taci(c->prog->taci_arena, i->op);
+    *copy = *i;
+    copy->next = NULL;
+    taci_foreach_src(copy, rename_src, c);
+
+    tacv *dst = taci_dst(copy);
+    int idx = dst != NULL ? cfg_var_idx(&c->g, dst) : -1;
+    if (idx >= 0 &&
+        (idx >= c->g.live_vars || !bitset_test(&h->live_out, idx))) {
+      renamed *r = &c->names[c->names_len++];
+      r->from = dst->v.var;
+      r->to = new_local_like(c->st, dst->v.var);
+      *dst = r->to;
+    }
+
+    if (tail == NULL)
+      *first = copy;
+    else
+      tail->next = copy;
+    tail = copy;
+    if (i == h->last)
+      return tail;
+  }
+}
+
+// header ending with cond jump, which has one successor in the loop and at
+// most ROTATE_MAX_INSTRS instrs without calls between label and jump
+static bool can_copy_header(rotate_ctx *c, df_loop *l) {
+  cfg_block *h = &c->g.blocks.data[l->header];
+  if (c->label[l->header] < 0 || h->first == h->last || !is_cond_jump(h->last))
+    return false;
+
+  int n = 0;
+  for (taci *i = h->first->next; i != h->last; i = i->next)
+    if (i->op == TAC_CALL || ++n > ROTATE_MAX_INSTRS)
+      return false;
+  return true;
+}
+
+// the only block of loop jumping to header, -1 if there are more or it falls
+// into header
+static int find_latch(rotate_ctx *c, df_loop *l) {
+  cfg_block *h = &c->g.blocks.data[l->header];
+  int latch = -1;
+  vec_foreach(int, h->preds, it) {
+    if (!bitset_test(&l->body, *it))
+      continue;
+    if (latch >= 0)
+      return -1;
+    latch = *it;
+  }
+  if (latch < 0 || latch == l->header)
+    return -1;
+
+  taci *last = c->g.blocks.data[latch].last;
+  if (last->op != TAC_JMP)
+    return -1;
+  return latch;
+}
+
+static bool rotate_loop(rotate_ctx *c, df_loop *l) {
+  if (!can_copy_header(c, l))
+    return false;
+  int latch = find_latch(c, l);
+  if (latch < 0 || (size_t)l->header + 1 >= c->g.blocks.size)
+    return false;
+
+  cfg_block *h = &c->g.blocks.data[l->header];
+  int fall = l->header + 1;
+  bool falls_in = bitset_test(&l->body, fall);
+  int target = -1;
+  vec_foreach(int, h->succs, it) {
+    if (*it != fall)
+      target = *it;
+  }
+  if (target < 0 || bitset_test(&l->body, target) == falls_in)
+    return false;
+
+  taci *first;
+  taci *jump = copy_header(c, h, &first);
+
+  // jmp of latch becomes first instr of the copy, so block stays linked, and
+  // moves behind the copy as jump out of the loop
+  taci *j = c->g.blocks.data[latch].last;
+  taci *back = new_taci(c->prog->taci_arena, TAC_JMP);
+  *back = *j;
+  *j = *first;
+  if (first == jump)
+    jump = j;
+
+  if (falls_in) {
+    jump->op = invert_jump(jump->op);
+    jump->label_idx = block_label(c, fall);
+    back->label_idx = h->last->label_idx;
+  } else {
+    back->label_idx = block_label(c, fall);
+  }
+  jump->next = back;
+
+  ++stats.loops;
+  return true;
+}
+
+void rotate_loops_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  rotate_ctx c = {0};
+  c.prog = prog;
+  c.st = st;
+  build_cfg(&c.g, f, st);
+  analyze_liveness(&c.g);
+
+  size_t n = c.g.blocks.size;
+  c.label = malloc(sizeof(int) * (n ? n : 1));
+  assert(c.label);
+  vec_foreach(cfg_block, c.g.blocks, b) {
+    c.label[b->idx] = b->first->op == TAC_LABEL ? b->first->label_idx : -1;
+  }
+
+  df_loop_vec loops;
+  find_cfg_loops(&c.g, &loops);
+  vec_foreach(df_loop, loops, l) {
+    rotate_loop(&c, l);
+  }
+
+  df_free_loops(&loops);
+  free(c.label);
+  free_cfg(&c.g);
+}
+
+void print_rotate_stats(void) {
+  fprintf(stderr, "rotate           loops %d\n", stats.loops);
+}
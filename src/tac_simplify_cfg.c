@@ -0,0 +1,187 @@
+#include "common.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include "vec.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cleans up control flow left by lowering of ifs, loops, &&, || and ternaries:
+//  - jumps to label followed by `jmp L` go to L directly (chains are followed)
+//  - code which can't be reached from entry is removed
+//  - labels nothing jumps to are removed, so straight-line blocks merge
+//  - jumps to label right after them are removed
+// Each step can enable others, so they are repeated until nothing changes.
+
+// bound for rounds and for length of followed jump chains
+#define SIMPLIFY_CFG_MAX_ROUNDS 8
+#define SIMPLIFY_CFG_MAX_CHAIN 32
+
+typedef struct {
+  VEC(taci *) instrs;
+  int *label_pos; // label -> position of label instr, -1 if none
+  int *refs;      // label -> number of reachable jumps to it
+  bool *keep;     // position -> instr stays
+  int max_label;
+} simplify_ctx;
+
+static bool is_jump(taci *i) {
+  return i->op == TAC_JMP || (i->op >= TAC_JZ && i->op <= TAC_JGE);
+}
+
+// points res to labels jumped to by instr, returns amount of them
+static size_t jump_targets(taci *i, int **res) {
+  if (i->op == TAC_JTAB) {
+    *res = i->v.jtab.labels;
+    return i->v.jtab.labels_len;
+  }
+  *res = &i->label_idx;
+  return is_jump(i) ? 1 : 0;
+}
+
+// first instr at or after position which isn't label, NULL if none
+static taci *skip_labels(simplify_ctx *c, int pos) {
+  for (size_t p = pos; p < c->instrs.size; ++p)
+    if (c->instrs.data[p]->op != TAC_LABEL)
+      return c->instrs.data[p];
+  return NULL;
+}
+
+// returns label at the end of jump chain starting at target
+static int thread(simplify_ctx *c, int target) {
+  for (int n = 0; n < SIMPLIFY_CFG_MAX_CHAIN; ++n) {
+    taci *next = skip_labels(c, c->label_pos[target]);
+    if (next == NULL || next->op != TAC_JMP || next->label_idx == target)
+      break;
+    target = next->label_idx;
+  }
+  return target;
+}
+
+static bool thread_jumps(simplify_ctx *c) {
+  bool changed = false;
+  vec_foreach(taci *, c->instrs, it) {
+    int *targets;
+    size_t n = jump_targets(*it, &targets);
+    for (size_t j = 0; j < n; ++j) {
+      int to = thread(c, targets[j]);
+      changed |= to != targets[j];
+      targets[j] = to;
+    }
+  }
+  return changed;
+}
+
+// marks reachable instrs in keep and counts jumps to labels from them
+static void find_reachable(simplify_ctx *c) {
+  size_t n = c->instrs.size;
+  memset(c->refs, 0, sizeof(int) * (c->max_label + 1));
+  memset(c->keep, 0, sizeof(bool) * n);
+
+  // sweep until no new label is reached, backward jumps to labels not seen
+  // as reached yet need another sweep
+  bool again = true;
+  while (again) {
+    again = false;
+    bool reach = true;
+    for (size_t p = 0; p < n; ++p) {
+      taci *i = c->instrs.data[p];
+      if (i->op == TAC_LABEL && c->refs[i->label_idx] > 0)
+        reach = true;
+      if (reach && !c->keep[p]) {
+        c->keep[p] = true;
+        int *targets;
+        size_t nt = jump_targets(i, &targets);
+        for (size_t j = 0; j < nt; ++j)
+          if (c->refs[targets[j]]++ == 0 && c->label_pos[targets[j]] < (int)p)
+            again = true;
+      }
+      if (i->op == TAC_JMP || i->op == TAC_RET || i->op == TAC_JTAB)
+        reach = false;
+    }
+  }
+}
+
+// true if there are only labels between position and label
+static bool jumps_to_next(simplify_ctx *c, size_t pos) {
+  int target = c->label_pos[c->instrs.data[pos]->label_idx];
+  if (target < (int)pos)
+    return false;
+  for (size_t p = pos + 1; p < (size_t)target; ++p)
+    if (c->keep[p] && c->instrs.data[p]->op != TAC_LABEL)
+      return false;
+  return true;
+}
+
+static bool remove_dead(simplify_ctx *c, tacf *f) {
+  bool changed = false;
+  for (size_t p = 0; p < c->instrs.size; ++p) {
+    taci *i = c->instrs.data[p];
+    if (!c->keep[p])
+      continue;
+    // conditional jumps only read vars, so they go too
+    if ((i->op == TAC_LABEL && c->refs[i->label_idx] == 0) ||
+        (is_jump(i) && jumps_to_next(c, p))) {
+      if (is_jump(i))
+        --c->refs[i->label_idx];
+      c->keep[p] = false;
+    }
+  }
+
+  taci **link = &f->firsti;
+  for (size_t p = 0; p < c->instrs.size; ++p) {
+    if (!c->keep[p]) {
+      changed = true;
+      continue;
+    }
+    *link = c->instrs.data[p];
+    link = &c->instrs.data[p]->next;
+  }
+  *link = NULL;
+  return changed;
+}
+
+static void collect(simplify_ctx *c, tacf *f) {
+  vec_clear(c->instrs);
+  for (int l = 0; l <= c->max_label; ++l)
+    c->label_pos[l] = -1;
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (i->op == TAC_LABEL)
+      c->label_pos[i->label_idx] = c->instrs.size;
+    vec_push_back(c->instrs, i);
+  }
+}
+
+void simplify_cfg_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  (void)prog;
+  (void)st;
+  simplify_ctx c;
+  vec_init(c.instrs);
+
+  c.max_label = 0;
+  size_t n = 0;
+  for (taci *i = f->firsti; i != NULL; i = i->next, ++n)
+    if (i->op == TAC_LABEL && i->label_idx > c.max_label)
+      c.max_label = i->label_idx;
+
+  c.label_pos = malloc(sizeof(int) * (c.max_label + 1));
+  c.refs = malloc(sizeof(int) * (c.max_label + 1));
+  c.keep = malloc(sizeof(bool) * (n ? n : 1));
+  assert(c.label_pos && c.refs && c.keep);
+
+  for (int round = 0; round < SIMPLIFY_CFG_MAX_ROUNDS; ++round) {
+    collect(&c, f);
+    bool changed = thread_jumps(&c);
+    find_reachable(&c);
+    changed |= remove_dead(&c, f);
+    if (!changed)
+      break;
+  }
+
+  free(c.label_pos);
+  free(c.refs);
+  free(c.keep);
+  vec_free(c.instrs);
+}
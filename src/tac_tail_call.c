@@ -0,0 +1,128 @@
+#include "arena.h"
+#include "common.h"
+#include "strings.h"
+#include "table.h"
+#include "tac.h"
+#include "typecheck.h"
+#include <assert.h>
+#include <string.h>
+
+// Calls in tail position, i.e. `t = call f(args)` followed only by labels,
+// jumps, copies of t and return of it:
+//  - self call becomes assignment of args to params and jump to label at start
+//    of function, so recursion runs as loop in single frame. Args which read
+//    param assigned before them are copied to fresh vars first
+//  - call of other function which gets all args in regs is marked as tail, asm
+//    for it tears down frame of caller and jumps to callee, which returns
+//    straight to caller of caller
+// Calls with args on stack aren't marked, they would have to be written over
+// incoming args of caller, which can be fewer than needed.
+
+// only args in regs, see arg_regs in x86.c
+#define TAIL_CALL_MAX_ARGS 6
+// bound for instrs looked at between call and return
+#define TAIL_CALL_MAX_SCAN 16
+
+extern int var_name_idx_counter; // defined in resolve.c
+extern int label_idx_counter;    // defined in resolve.c
+
+typedef struct {
+  tac_program *prog;
+  tacf *f;
+  sym_table *st;
+  ht *labels; // label -> label instr
+  int start;  // label at start of function, 0 until needed
+} tail_call_ctx;
+
+static bool is_var(tacv *v, string name) {
+  return v->t == TACV_VAR && !strcmp(v->v.var, name);
+}
+
+// true if result of call is returned with nothing else done on the way. Copies
+// of result and jumps are followed, inlining leaves them in place of returns
+static bool in_tail_position(tail_call_ctx *c, taci *call) {
+  string res = call->dst.v.var;
+  taci *i = call->next;
+  for (int n = 0; i != NULL && n < TAIL_CALL_MAX_SCAN; ++n) {
+    if (i->op == TAC_LABEL) {
+      i = i->next;
+    } else if (i->op == TAC_JMP) {
+      i = ht_get_int(c->labels, i->label_idx);
+    } else if (i->op == TAC_CPY && is_var(&i->v.s.src1, res)) {
+      res = i->dst.v.var;
+      i = i->next;
+    } else {
+      break;
+    }
+  }
+  return i != NULL && i->op == TAC_RET && is_var(&i->v.s.src1, res);
+}
+
+static taci *append_cpy(tail_call_ctx *c, taci *tail, tacv dst, tacv src) {
+  taci *cpy = tail->next = new_taci(c->prog->taci_arena, TAC_CPY);
+  cpy->dst = dst;
+  cpy->v.s.src1 = src;
+  return cpy;
+}
+
+// replaces self call by parallel assignment of params and jump to start
+static void loop_self_call(tail_call_ctx *c, taci *call) {
+  if (c->start == 0) {
+    taci *label = new_taci(c->prog->taci_arena, TAC_LABEL);
+    label->label_idx = c->start = ++label_idx_counter;
+    label->next = c->f->firsti;
+    c->f->firsti = label;
+  }
+
+  size_t n = call->v.call.args_len;
+  tacv *args = call->v.call.args;
+  string *params = c->f->params;
+  taci head = {0};
+  taci *tail = &head;
+
+  // param which gets its own value isn't assigned at all
+  for (size_t k = 0; k < n; ++k) {
+    if (args[k].t != TACV_VAR || is_var(&args[k], params[k]))
+      continue;
+    for (size_t j = 0; j < k; ++j) {
+      if (is_var(&args[k], params[j]) && !is_var(&args[j], params[j])) {
+        tacv tmp = new_local_like(c->st, params[k]);
+        tail = append_cpy(c, tail, tmp, args[k]);
+        args[k] = tmp;
+        break;
+      }
+    }
+  }
+  for (size_t k = 0; k < n; ++k) {
+    if (is_var(&args[k], params[k]))
+      continue;
+    tacv param;
+    param.t = TACV_VAR;
+    param.v.var = params[k];
+    tail = append_cpy(c, tail, param, args[k]);
+  }
+  taci *jmp = tail = tail->next = new_taci(c->prog->taci_arena, TAC_JMP);
+  jmp->label_idx = c->start;
+
+  // call instr is reused as first instr, so link to it stays valid
+  tail->next = call->next;
+  *call = *head.next;
+}
+
+void tail_call_for_func(tac_program *prog, tacf *f, sym_table *st) {
+  tail_call_ctx c = {prog, f, st, ht_create_int(), 0};
+  for (taci *i = f->firsti; i != NULL; i = i->next)
+    if (i->op == TAC_LABEL)
+      ht_set_int(c.labels, i->label_idx, i);
+
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (i->op != TAC_CALL || !in_tail_position(&c, i))
+      continue;
+    if (!strcmp(i->v.call.name, f->name) &&
+        i->v.call.args_len == f->params_len)
+      loop_self_call(&c, i);
+    else if (i->v.call.args_len <= TAIL_CALL_MAX_ARGS)
+      i->v.call.tail = true;
+  }
+  ht_destroy(c.labels);
+}
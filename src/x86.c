@@ -1,12 +1,15 @@
 
 #include "x86.h"
 #include "arena.h"
+#include "cfg.h"
 #include "common.h"
 #include "parser.h"
+#include "pass.h"
 #include "table.h"
 #include "tac.h"
 #include "type.h"
 #include "typecheck.h"
+#include "x86_cfg.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,6 +18,10 @@ void init_x86_asm_gen(x86_asm_gen *ag, sym_table *st) {
   NEW_ARENA(ag->instr_arena, x86_instr);
   NEW_ARENA(ag->top_level_arena, x86_top_level);
   ag->st = st;
+  ag->verbose_asm = false;
+  ag->omit_frame_pointer = false;
+  ag->out_args = 0;
+  ag->be_syme_arena = NULL;
 }
 
 x86_instr *alloc_x86_instr(x86_asm_gen *ag, int op) {
@@ -47,6 +54,9 @@ static x86_top_level *alloc_x86_func(x86_asm_gen *ag, string name) {
   res->is_func = true;
   res->v.f.name = name;
   res->v.f.first = NULL;
+  res->v.f.frame_size = 0;
+  res->v.f.stack_alloc = 0;
+  res->v.f.omit_frame_pointer = false;
   return res;
 }
 
@@ -190,37 +200,561 @@ static void gen_asm_from_unary_instr(x86_asm_gen *ag, taci *i) {
   u->v.unary.type = get_x86_asm_type(ag, i->dst);
 }
 
-static void gen_asm_from_binary_instr(x86_asm_gen *ag, taci *i) {
-  if (i->op == TAC_DIV || i->op == TAC_MOD) {
-    bool is_signed = type_signed(get_type(ag, i->v.s.src1));
+// variable shift count has to be in cl, moving it there explicitly lets
+// register allocator see that cx is written
+static x86_op shift_count(x86_asm_gen *ag, taci *i, int op, tacv count,
+                          x86_asm_type type) {
+  x86_op res = operand_from_tac_val(count);
+  if ((op != X86_SHL && op != X86_SHR && op != X86_SAR) ||
+      res.t == X86_OP_IMM)
+    return res;
+
+  x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
+  mov->v.binary.src = res;
+  mov->v.binary.dst = new_x86_reg(X86_CX);
+  mov->v.binary.type = type;
+  return mov->v.binary.dst;
+}
+
+static x86_instr *insert_x86_binary(x86_asm_gen *ag, taci *i, int op,
+                                    x86_op src, x86_op dst,
+                                    x86_asm_type type) {
+  x86_instr *res = insert_x86_instr(ag, op, i);
+  res->v.binary.src = src;
+  res->v.binary.dst = dst;
+  res->v.binary.type = type;
+  return res;
+}
+
+static x86_instr *insert_x86_unary(x86_asm_gen *ag, taci *i, int op,
+                                   x86_op src, x86_asm_type type) {
+  x86_instr *res = insert_x86_instr(ag, op, i);
+  res->v.unary.src = src;
+  res->v.unary.type = type;
+  return res;
+}
+
+// Division by constant, see Granlund, Montgomery: "Division by invariant
+// integers using multiplication" and Hacker's Delight, chapter 10. x / d is
+// high half of x * m shifted right by s, with fix-ups for sign and for
+// multipliers which need one more bit than type has. Powers of two are
+// shifts, remainder is x - x / d * d. Only ax and dx are used, same as by
+// idiv.
+
+typedef struct {
+  uint64_t m; // multiplier, `width` bits
+  int s;      // shift of high half
+  bool add;   // unsigned only, multiplier is really m + 2^width
+} div_magic;
+
+static uint64_t width_mask(int width) {
+  return width == 32 ? 0xFFFFFFFFull : ~0ull;
+}
+
+// for |d| >= 2 which isn't power of two
+static div_magic signed_magic(uint64_t d, bool neg, int width) {
+  uint64_t mask = width_mask(width);
+  uint64_t two = 1ull << (width - 1);
+  uint64_t ad = (neg ? -d : d) & mask;
+  uint64_t t = two + neg;
+  uint64_t anc = t - 1 - t % ad; // |nc|
+  int p = width - 1;
+  uint64_t q1 = two / anc, r1 = two - q1 * anc;
+  uint64_t q2 = two / ad, r2 = two - q2 * ad;
+  uint64_t delta;
+  do {
+    ++p;
+    q1 = (q1 << 1) & mask;
+    r1 = (r1 << 1) & mask;
+    if (r1 >= anc) {
+      ++q1;
+      r1 -= anc;
+    }
+    q2 = (q2 << 1) & mask;
+    r2 = (r2 << 1) & mask;
+    if (r2 >= ad) {
+      ++q2;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  div_magic res = {(q2 + 1) & mask, p - width, false};
+  if (neg)
+    res.m = -res.m & mask;
+  return res;
+}
+
+// for d >= 2 which isn't power of two
+static div_magic unsigned_magic(uint64_t d, int width) {
+  uint64_t mask = width_mask(width);
+  uint64_t two = 1ull << (width - 1);
+  uint64_t nc = mask - (-d & mask) % d;
+  int p = width - 1;
+  bool add = false;
+  uint64_t q1 = two / nc, r1 = two - q1 * nc;
+  uint64_t q2 = (two - 1) / d, r2 = (two - 1) - q2 * d;
+  uint64_t delta;
+  do {
+    ++p;
+    if (r1 >= nc - r1) {
+      q1 = (2 * q1 + 1) & mask;
+      r1 = (2 * r1 - nc) & mask;
+    } else {
+      q1 = (2 * q1) & mask;
+      r1 = (2 * r1) & mask;
+    }
+    if (r2 + 1 >= d - r2) {
+      add |= q2 >= two - 1;
+      q2 = (2 * q2 + 1) & mask;
+      r2 = (2 * r2 + 1 - d) & mask;
+    } else {
+      add |= q2 >= two;
+      q2 = (2 * q2) & mask;
+      r2 = (2 * r2 + 1) & mask;
+    }
+    delta = d - 1 - r2;
+  } while (p < 2 * width && (q1 < delta || (q1 == delta && r1 == 0)));
+
+  return (div_magic){(q2 + 1) & mask, p - width, add};
+}
+
+static int log2_exact(uint64_t v) {
+  if (v == 0 || (v & (v - 1)) != 0)
+    return -1;
+  int k = 0;
+  while (v >>= 1)
+    ++k;
+  return k;
+}
+
+static uint64_t sign_extend(uint64_t v, int width) {
+  return width == 32 ? (uint64_t)(int64_t)(int32_t)v : v;
+}
+
+// remainder from quotient in q, x - q * d
+static void gen_rem_from_quot(x86_asm_gen *ag, taci *i, x86_op x, x86_reg q,
+                              uint64_t d, x86_op res, x86_asm_type t) {
+  insert_x86_binary(ag, i, X86_MULT, new_x86_imm(d), new_x86_reg(q), t);
+  insert_x86_binary(ag, i, X86_MOV, x, res, t);
+  insert_x86_binary(ag, i, X86_SUB, new_x86_reg(q), res, t);
+}
+
+// `x / 2^k` rounded toward zero is `(x + (x < 0 ? 2^k - 1 : 0)) >> k`, the
+// bias is made from sign mask by cdq
+static void gen_signed_pow2_div(x86_asm_gen *ag, taci *i, x86_op x, int k,
+                                bool neg, bool mod, x86_op res, int width) {
+  x86_asm_type t = width == 32 ? X86_LONGWORD : X86_QUADWORD;
+  x86_op ax = new_x86_reg(X86_AX), dx = new_x86_reg(X86_DX);
+
+  insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+  insert_x86_instr(ag, X86_CDQ, i)->v.cdq.type = t;
+  insert_x86_binary(ag, i, X86_SHR, new_x86_imm(width - k), dx, t);
+  insert_x86_binary(ag, i, X86_ADD, dx, ax, t);
+  if (mod) {
+    insert_x86_binary(ag, i, X86_AND, new_x86_imm((1ull << k) - 1), ax, t);
+    insert_x86_binary(ag, i, X86_SUB, dx, ax, t);
+  } else {
+    insert_x86_binary(ag, i, X86_SAR, new_x86_imm(k), ax, t);
+    if (neg)
+      insert_x86_unary(ag, i, X86_NEG, ax, t);
+  }
+  insert_x86_binary(ag, i, X86_MOV, ax, res, t);
+}
+
+// d is sign extended to 64 bits, |d| >= 2
+static void gen_signed_div_by_const(x86_asm_gen *ag, taci *i, x86_op x,
+                                    uint64_t d, bool mod, x86_op res,
+                                    int width) {
+  x86_asm_type t = width == 32 ? X86_LONGWORD : X86_QUADWORD;
+  x86_op ax = new_x86_reg(X86_AX), dx = new_x86_reg(X86_DX);
+  bool neg = (int64_t)d < 0;
+  int k = log2_exact((neg ? -d : d) & width_mask(width));
+
+  if (k > 0) {
+    gen_signed_pow2_div(ag, i, x, k, neg, mod, res, width);
+    return;
+  }
 
-    x86_instr *mov1 = insert_x86_instr(ag, X86_MOV, i);
-    x86_instr *ext;
+  div_magic mg = signed_magic(d, neg, width);
+  bool m_neg = (mg.m >> (width - 1)) & 1;
+  x86_reg q;
+
+  if (width == 32) {
+    // product of 32 bit x and 33 bit m fits in 64 bits, so add or sub of x
+    // is folded into m
+    int64_t m = (int32_t)mg.m;
+    if (!neg && m_neg)
+      m += 1ll << 32;
+    if (neg && !m_neg)
+      m -= 1ll << 32;
+    insert_x86_binary(ag, i, X86_MOVSX, x, ax, X86_QUADWORD);
+    insert_x86_binary(ag, i, X86_MULT, new_x86_imm(m), ax, X86_QUADWORD);
+    insert_x86_binary(ag, i, X86_SAR, new_x86_imm(32 + mg.s), ax,
+                      X86_QUADWORD);
+    insert_x86_binary(ag, i, X86_MOV, ax, dx, X86_QUADWORD);
+    insert_x86_binary(ag, i, X86_SHR, new_x86_imm(63), dx, X86_QUADWORD);
+    insert_x86_binary(ag, i, X86_ADD, dx, ax, X86_QUADWORD);
+    q = X86_AX;
+  } else {
+    insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+    insert_x86_unary(ag, i, X86_IMUL_WIDE, new_x86_imm(mg.m), t);
+    if (!neg && m_neg)
+      insert_x86_binary(ag, i, X86_ADD, x, dx, t);
+    if (neg && !m_neg)
+      insert_x86_binary(ag, i, X86_SUB, x, dx, t);
+    if (mg.s > 0)
+      insert_x86_binary(ag, i, X86_SAR, new_x86_imm(mg.s), dx, t);
+    // +1 for negative quotient, so it's rounded toward zero
+    insert_x86_binary(ag, i, X86_MOV, dx, ax, t);
+    insert_x86_binary(ag, i, X86_SHR, new_x86_imm(63), ax, t);
+    insert_x86_binary(ag, i, X86_ADD, ax, dx, t);
+    q = X86_DX;
+  }
+
+  if (mod)
+    gen_rem_from_quot(ag, i, x, q, d, res, t);
+  else
+    insert_x86_binary(ag, i, X86_MOV, new_x86_reg(q), res, t);
+}
+
+// d >= 2
+static void gen_unsigned_div_by_const(x86_asm_gen *ag, taci *i, x86_op x,
+                                      uint64_t d, bool mod, x86_op res,
+                                      int width) {
+  x86_asm_type t = width == 32 ? X86_LONGWORD : X86_QUADWORD;
+  x86_op ax = new_x86_reg(X86_AX), dx = new_x86_reg(X86_DX);
+  int k = log2_exact(d);
+
+  if (k > 0) {
+    insert_x86_binary(ag, i, X86_MOV, x, res, t);
+    if (mod)
+      insert_x86_binary(ag, i, X86_AND, new_x86_imm(d - 1), res, t);
+    else
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(k), res, t);
+    return;
+  }
 
-    if (is_signed) {
-      ext = insert_x86_instr(ag, X86_CDQ, i);
-      ext->v.cdq.type = get_x86_asm_type(ag, i->v.s.src1);
+  div_magic mg = unsigned_magic(d, width);
+  x86_reg q;
+
+  if (width == 32) {
+    // mov to 32 bit reg zero extends, product with 32 bit m fits in 64 bits
+    insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+    insert_x86_binary(ag, i, X86_MULT, new_x86_imm(mg.m), ax, X86_QUADWORD);
+    if (mg.add) {
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(32), ax, X86_QUADWORD);
+      insert_x86_binary(ag, i, X86_MOV, x, dx, t);
+      insert_x86_binary(ag, i, X86_ADD, dx, ax, X86_QUADWORD);
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(mg.s), ax, X86_QUADWORD);
     } else {
-      ext = insert_x86_instr(ag, X86_MOV, i);
-      ext->v.binary.src = new_x86_imm(0);
-      ext->v.binary.dst = new_x86_reg(X86_DX);
-      ext->v.binary.type = get_x86_asm_type(ag, i->v.s.src1);
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(32 + mg.s), ax,
+                        X86_QUADWORD);
+    }
+    q = X86_AX;
+  } else if (mg.add) {
+    // hi + (x - hi) / 2 can't overflow
+    insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+    insert_x86_unary(ag, i, X86_MUL_WIDE, new_x86_imm(mg.m), t);
+    insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+    insert_x86_binary(ag, i, X86_SUB, dx, ax, t);
+    insert_x86_binary(ag, i, X86_SHR, new_x86_imm(1), ax, t);
+    insert_x86_binary(ag, i, X86_ADD, dx, ax, t);
+    if (mg.s > 1)
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(mg.s - 1), ax, t);
+    q = X86_AX;
+  } else {
+    insert_x86_binary(ag, i, X86_MOV, x, ax, t);
+    insert_x86_unary(ag, i, X86_MUL_WIDE, new_x86_imm(mg.m), t);
+    if (mg.s > 0)
+      insert_x86_binary(ag, i, X86_SHR, new_x86_imm(mg.s), dx, t);
+    q = X86_DX;
+  }
+
+  if (mod)
+    gen_rem_from_quot(ag, i, x, q, d, res, t);
+  else
+    insert_x86_binary(ag, i, X86_MOV, new_x86_reg(q), res, t);
+}
+
+// dst = x / d or x % d, false if it's left to idiv
+static bool gen_div_by_const(x86_asm_gen *ag, taci *i, tacv x, int_const d,
+                             tacv dst, bool mod, bool is_signed,
+                             x86_asm_type t) {
+  int width = t == X86_LONGWORD ? 32 : 64;
+  uint64_t v = d.v & width_mask(width);
+  if (x.t != TACV_VAR || v == 0)
+    return false;
+
+  x86_op src = operand_from_tac_val(x);
+  x86_op res = operand_from_tac_val(dst);
+
+  // x / 1, x / -1, their remainder is 0
+  if (v == 1 || (is_signed && v == width_mask(width))) {
+    if (mod) {
+      insert_x86_binary(ag, i, X86_MOV, new_x86_imm(0), res, t);
+      return true;
     }
+    insert_x86_binary(ag, i, X86_MOV, src, res, t);
+    if (v != 1)
+      insert_x86_unary(ag, i, X86_NEG, res, t);
+    return true;
+  }
+
+  if (is_signed)
+    gen_signed_div_by_const(ag, i, src, sign_extend(v, width), mod, res,
+                            width);
+  else
+    gen_unsigned_div_by_const(ag, i, src, v, mod, res, width);
+  return true;
+}
+
+// dst = x / y or x % y
+static void gen_asm_div(x86_asm_gen *ag, taci *i, tacv x, tacv y, tacv dst,
+                        bool mod, bool is_signed, x86_asm_type t) {
+  if (y.t == TACV_CONST &&
+      gen_div_by_const(ag, i, x, y.v.iconst, dst, mod, is_signed, t))
+    return;
+
+  insert_x86_binary(ag, i, X86_MOV, operand_from_tac_val(x),
+                    new_x86_reg(X86_AX), t);
+  if (is_signed)
+    insert_x86_instr(ag, X86_CDQ, i)->v.cdq.type = t;
+  else
+    insert_x86_binary(ag, i, X86_MOV, new_x86_imm(0), new_x86_reg(X86_DX), t);
+  insert_x86_unary(ag, i, is_signed ? X86_IDIV : X86_DIV,
+                   operand_from_tac_val(y), t);
+  insert_x86_binary(ag, i, X86_MOV, new_x86_reg(mod ? X86_DX : X86_AX),
+                    operand_from_tac_val(dst), t);
+}
+
+// Selection of adds, subs and multiplies which fit lea or shifts:
+//  - `a * 2^k` is shl, `a * {3, 5, 9}` is lea (a, a, 2/4/8), products of
+//    those are lea followed by shl or second lea
+//  - `a + b` and `a + c` into other var than a are single lea
+//  - `a += 1`, `a = a - 1` and alike are inc / dec
+//  - `t = b << {1, 2, 3}; d = a + t` (same for b * {2, 4, 8}) and
+//    `t = a + b; d = t + c` are single lea, when temporary t isn't read
+//    anywhere else
+
+static bool same_var(tacv a, tacv b) {
+  return a.t == TACV_VAR && b.t == TACV_VAR && !strcmp(a.v.var, b.v.var);
+}
+
+static uint64_t type_mask(x86_asm_type t) {
+  return t == X86_LONGWORD ? 0xFFFFFFFFull : ~0ull;
+}
+
+// constant as displacement of lea with type t. Displacement is sign extended,
+// for longword only low half of result matters, so any constant fits
+static bool const_disp(uint64_t v, x86_asm_type t, int32_t *disp) {
+  if (t == X86_QUADWORD && (int64_t)v != (int32_t)v)
+    return false;
+  *disp = (int32_t)v;
+  return true;
+}
+
+static x86_instr *insert_x86_lea(x86_asm_gen *ag, taci *i, x86_op base,
+                                 x86_op index, int scale, int32_t disp,
+                                 x86_op dst, x86_asm_type type) {
+  x86_instr *res = insert_x86_instr(ag, X86_LEA, i);
+  res->v.lea.base = base;
+  res->v.lea.index = index;
+  res->v.lea.scale = scale;
+  res->v.lea.disp = disp;
+  res->v.lea.dst = dst;
+  res->v.lea.type = type;
+  return res;
+}
+
+static int lea_factor(uint64_t c) { return c == 3 || c == 5 || c == 9; }
+
+// dst = a * c, false if c doesn't fit
+static bool gen_mul_by_const(x86_asm_gen *ag, taci *i, tacv a, uint64_t c,
+                             tacv dst, x86_asm_type t) {
+  c &= type_mask(t);
+  if (a.t != TACV_VAR)
+    return false;
+
+  x86_op src = operand_from_tac_val(a);
+  x86_op res = operand_from_tac_val(dst);
+  int k = log2_exact(c);
+  if (k > 0) {
+    insert_x86_binary(ag, i, X86_MOV, src, res, t);
+    insert_x86_binary(ag, i, X86_SHL, new_x86_imm(k), res, t);
+    return true;
+  }
+
+  for (uint64_t f = 9; f >= 3; f -= f == 9 ? 4 : 2) {
+    if (c % f != 0)
+      continue;
+    uint64_t rest = c / f;
+    int rest_k = log2_exact(rest);
+    if (rest_k < 0 && !lea_factor(rest))
+      continue;
+
+    insert_x86_lea(ag, i, src, src, f - 1, 0, res, t);
+    if (rest_k > 0)
+      insert_x86_binary(ag, i, X86_SHL, new_x86_imm(rest_k), res, t);
+    else if (rest_k < 0)
+      insert_x86_lea(ag, i, res, res, rest - 1, 0, res, t);
+    return true;
+  }
+  return false;
+}
+
+// dst = a + c or dst = a - c as inc, dec or lea
+static bool gen_add_const(x86_asm_gen *ag, taci *i, tacv a, uint64_t c,
+                          tacv dst, x86_asm_type t) {
+  if (a.t != TACV_VAR)
+    return false;
+  c &= type_mask(t);
+  x86_op res = operand_from_tac_val(dst);
+
+  if (same_var(a, dst)) {
+    if (c != 1 && c != type_mask(t))
+      return false;
+    insert_x86_unary(ag, i, c == 1 ? X86_INC : X86_DEC, res, t);
+    return true;
+  }
+
+  int32_t disp;
+  if (!const_disp(c, t, &disp))
+    return false;
+  insert_x86_lea(ag, i, operand_from_tac_val(a), operand_from_tac_val(a), 0,
+                 disp, res, t);
+  return true;
+}
+
+// selects single add, sub or mul, false if it's left to generic lowering
+static bool gen_lea_binary(x86_asm_gen *ag, taci *i) {
+  tacv a = i->v.s.src1, b = i->v.s.src2;
+  x86_asm_type t = get_x86_asm_type(ag, i->dst);
+  if (t == X86_BYTE)
+    return false;
+
+  // commutative, constant goes second
+  if ((i->op == TAC_ADD || i->op == TAC_MUL) && a.t == TACV_CONST) {
+    a = i->v.s.src2;
+    b = i->v.s.src1;
+  }
+  if (a.t != TACV_VAR)
+    return false;
+
+  switch (i->op) {
+  case TAC_MUL:
+    return b.t == TACV_CONST &&
+           gen_mul_by_const(ag, i, a, b.v.iconst.v, i->dst, t);
+  case TAC_SUB:
+    return b.t == TACV_CONST &&
+           gen_add_const(ag, i, a, -b.v.iconst.v, i->dst, t);
+  case TAC_ADD:
+    if (b.t == TACV_CONST)
+      return gen_add_const(ag, i, a, b.v.iconst.v, i->dst, t);
+    if (same_var(a, i->dst) || same_var(b, i->dst))
+      return false;
+    insert_x86_lea(ag, i, operand_from_tac_val(a), operand_from_tac_val(b), 1,
+                   0, operand_from_tac_val(i->dst), t);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// scale of `b << k` or `b * s` which fits index of lea, 0 if none
+static int index_scale(taci *i, tacv *b) {
+  tacv x = i->v.s.src1, y = i->v.s.src2;
+  if (i->op == TAC_MUL && x.t == TACV_CONST) {
+    x = i->v.s.src2;
+    y = i->v.s.src1;
+  }
+  if (x.t != TACV_VAR || y.t != TACV_CONST)
+    return 0;
+  *b = x;
+  uint64_t v = y.v.iconst.v;
+  if (i->op == TAC_LSHIFT && v >= 1 && v <= 3)
+    return 1 << v;
+  if (i->op == TAC_MUL && (v == 2 || v == 4 || v == 8))
+    return v;
+  return 0;
+}
 
-    x86_instr *idiv = insert_x86_instr(ag, is_signed ? X86_IDIV : X86_DIV, i);
-    x86_instr *mov2 = insert_x86_instr(ag, X86_MOV, i);
+// temporary read only once in func
+static bool single_read_temp(x86_asm_gen *ag, tacv v) {
+  if (v.t != TACV_VAR)
+    return false;
+  syme *e = ht_get(ag->st->t, v.v.var);
+  return e != NULL && e->a.t == ATTR_LOCAL && e->ref == NULL &&
+         (intptr_t)ht_get(ag->reads, v.v.var) == 1;
+}
 
-    mov1->v.binary.dst = new_x86_reg(X86_AX);
-    mov1->v.binary.src = operand_from_tac_val(i->v.s.src1);
-    mov1->v.binary.type = get_x86_asm_type(ag, i->v.s.src1);
+// `t = ...; d = t + ...` as single lea, true if both i and next are done
+static bool gen_lea_pair(x86_asm_gen *ag, taci *i) {
+  taci *n = i->next;
+  if (n == NULL || (n->op != TAC_ADD && n->op != TAC_SUB) ||
+      !single_read_temp(ag, i->dst))
+    return false;
+
+  x86_asm_type t = get_x86_asm_type(ag, n->dst);
+  if (t == X86_BYTE || get_x86_asm_type(ag, i->dst) != t)
+    return false;
+
+  // other operand of n
+  tacv o;
+  if (same_var(n->v.s.src1, i->dst))
+    o = n->v.s.src2;
+  else if (n->op == TAC_ADD && same_var(n->v.s.src2, i->dst))
+    o = n->v.s.src1;
+  else
+    return false;
+
+  x86_op dst = operand_from_tac_val(n->dst);
+  tacv b;
+  int scale = index_scale(i, &b);
+  if (scale != 0 && n->op == TAC_ADD && o.t == TACV_VAR) {
+    insert_x86_lea(ag, n, operand_from_tac_val(o), operand_from_tac_val(b),
+                   scale, 0, dst, t);
+    return true;
+  }
 
-    idiv->v.unary.src = operand_from_tac_val(i->v.s.src2);
-    idiv->v.unary.type = get_x86_asm_type(ag, i->v.s.src1);
+  if (i->op != TAC_ADD || i->v.s.src1.t != TACV_VAR)
+    return false;
+  tacv a = i->v.s.src1, c = i->v.s.src2;
+  int32_t disp;
+
+  // (a + b) + c
+  if (c.t == TACV_VAR && o.t == TACV_CONST) {
+    uint64_t v = n->op == TAC_ADD ? o.v.iconst.v : -o.v.iconst.v;
+    if (!const_disp(v & type_mask(t), t, &disp))
+      return false;
+    insert_x86_lea(ag, n, operand_from_tac_val(a), operand_from_tac_val(c), 1,
+                   disp, dst, t);
+    return true;
+  }
 
-    mov2->v.binary.src = new_x86_reg(i->op == TAC_DIV ? X86_AX : X86_DX);
-    mov2->v.binary.dst = operand_from_tac_val(i->dst);
-    mov2->v.binary.type = get_x86_asm_type(ag, i->v.s.src1);
+  // (a + c) + o
+  if (c.t == TACV_CONST && o.t == TACV_VAR && n->op == TAC_ADD &&
+      const_disp(c.v.iconst.v & type_mask(t), t, &disp)) {
+    insert_x86_lea(ag, n, operand_from_tac_val(a), operand_from_tac_val(o), 1,
+                   disp, dst, t);
+    return true;
+  }
+  return false;
+}
 
+static void count_read(tacv *v, void *ctx) {
+  ht *reads = ctx;
+  if (v->t == TACV_VAR)
+    ht_set(reads, v->v.var, (void *)((intptr_t)ht_get(reads, v->v.var) + 1));
+}
+
+static void gen_asm_from_binary_instr(x86_asm_gen *ag, taci *i) {
+  if (gen_lea_binary(ag, i))
+    return;
+  if (i->op == TAC_DIV || i->op == TAC_MOD) {
+    gen_asm_div(ag, i, i->v.s.src1, i->v.s.src2, i->dst, i->op == TAC_MOD,
+                type_signed(get_type(ag, i->v.s.src1)),
+                get_x86_asm_type(ag, i->v.s.src1));
     return;
   }
 
@@ -256,14 +790,17 @@ static void gen_asm_from_binary_instr(x86_asm_gen *ag, taci *i) {
   }
 
   x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
-  x86_instr *bini = insert_x86_instr(ag, op, i);
 
   mov->v.binary.dst = operand_from_tac_val(i->dst);
   mov->v.binary.src = operand_from_tac_val(i->v.s.src1);
   mov->v.binary.type = get_x86_asm_type(ag, i->dst);
 
+  x86_op src2 =
+      shift_count(ag, i, op, i->v.s.src2, get_x86_asm_type(ag, i->dst));
+  x86_instr *bini = insert_x86_instr(ag, op, i);
+
   bini->v.binary.dst = mov->v.binary.dst;
-  bini->v.binary.src = operand_from_tac_val(i->v.s.src2);
+  bini->v.binary.src = src2;
   bini->v.binary.type = get_x86_asm_type(ag, i->dst);
 }
 
@@ -342,18 +879,56 @@ static void gen_asm_from_jump_instr(x86_asm_gen *ag, taci *i) {
     return;
   }
 
+  bool zero_cmp = i->op == TAC_JZ || i->op == TAC_JNZ;
+  bool is_signed = type_signed(get_type(ag, i->v.s.src1));
+
   x86_instr *cmp = insert_x86_instr(ag, X86_CMP, i);
   x86_instr *jcc = insert_x86_instr(ag, X86_JMPCC, i);
 
   cmp->v.binary.src =
-      i->op == TAC_JE ? operand_from_tac_val(i->v.s.src2) : new_x86_imm(0);
+      zero_cmp ? new_x86_imm(0) : operand_from_tac_val(i->v.s.src2);
   cmp->v.binary.dst = operand_from_tac_val(i->v.s.src1);
   cmp->v.binary.type = get_x86_asm_type(ag, i->v.s.src1);
 
-  jcc->v.jmpcc.cc = i->op == TAC_JZ || i->op == TAC_JE ? CC_E : CC_NE;
+  int cc;
+  switch (i->op) {
+  case TAC_JZ:
+  case TAC_JE:
+    cc = CC_E;
+    break;
+  case TAC_JNZ:
+  case TAC_JNE:
+    cc = CC_NE;
+    break;
+  case TAC_JLT:
+    cc = is_signed ? CC_L : CC_B;
+    break;
+  case TAC_JLE:
+    cc = is_signed ? CC_LE : CC_BE;
+    break;
+  case TAC_JGT:
+    cc = is_signed ? CC_G : CC_A;
+    break;
+  case TAC_JGE:
+    cc = is_signed ? CC_GE : CC_AE;
+    break;
+  default:
+    UNREACHABLE();
+  }
+
+  jcc->v.jmpcc.cc = cc;
   jcc->v.jmpcc.label_idx = i->label_idx;
 }
 
+static void gen_asm_from_jtab_instr(x86_asm_gen *ag, taci *i) {
+  x86_instr *res = insert_x86_instr(ag, X86_JMP_TABLE, i);
+  res->v.jtab.idx = operand_from_tac_val(i->v.jtab.idx);
+  res->v.jtab.type = get_x86_asm_type(ag, i->v.jtab.idx);
+  res->v.jtab.labels = i->v.jtab.labels;
+  res->v.jtab.labels_len = i->v.jtab.labels_len;
+  res->v.jtab.table_label = i->v.jtab.table_label;
+}
+
 static void gen_asm_from_label_instr(x86_asm_gen *ag, taci *i) {
   insert_x86_instr(ag, X86_LABEL, i)->v.label = i->label_idx;
 }
@@ -366,28 +941,24 @@ static void gen_asm_from_inc_dec(x86_asm_gen *ag, taci *i) {
   instr->v.unary.type = get_x86_asm_type(ag, i->v.s.src1);
 }
 
+// signedness of /=, %= and >>= is the one of dst, src is converted to it
 static void gen_asm_from_assign(x86_asm_gen *ag, taci *i) {
   if (i->op == TAC_ASDIV || i->op == TAC_ASMOD) {
-    x86_instr *mov1 = insert_x86_instr(ag, X86_MOV, i);
-    x86_instr *cdq = insert_x86_instr(ag, X86_CDQ, i);
-    x86_instr *idiv = insert_x86_instr(ag, X86_IDIV, i);
-    x86_instr *mov2 = insert_x86_instr(ag, X86_MOV, i);
-
-    cdq->v.cdq.type = get_x86_asm_type(ag, i->dst);
-
-    mov1->v.binary.dst = new_x86_reg(X86_AX);
-    mov2->v.binary.dst = mov1->v.binary.src = operand_from_tac_val(i->dst);
-    mov2->v.binary.type = mov1->v.binary.type = get_x86_asm_type(ag, i->dst);
-    mov2->v.binary.src = new_x86_reg(i->op == TAC_ASDIV ? X86_AX : X86_DX);
-
-    idiv->v.unary.src = operand_from_tac_val(i->v.s.src1);
-
-    mov1->v.binary.type = get_x86_asm_type(ag, i->v.s.src1);
-    mov2->v.binary.type = get_x86_asm_type(ag, i->dst);
-    idiv->v.unary.type = get_x86_asm_type(ag, i->v.s.src2);
+    gen_asm_div(ag, i, i->dst, i->v.s.src1, i->dst, i->op == TAC_ASMOD,
+                type_signed(get_type(ag, i->dst)),
+                get_x86_asm_type(ag, i->dst));
     return;
   }
 
+  if ((i->op == TAC_ASADD || i->op == TAC_ASSUB) &&
+      get_x86_asm_type(ag, i->dst) != X86_BYTE &&
+      i->v.s.src1.t == TACV_CONST) {
+    uint64_t c = i->v.s.src1.v.iconst.v;
+    if (gen_add_const(ag, i, i->dst, i->op == TAC_ASADD ? c : -c, i->dst,
+                      get_x86_asm_type(ag, i->dst)))
+      return;
+  }
+
   int op;
 
   switch (i->op) {
@@ -413,17 +984,19 @@ static void gen_asm_from_assign(x86_asm_gen *ag, taci *i) {
     op = X86_SHL;
     break;
   case TAC_ASRSHIFT: {
-    op = type_signed(get_type(ag, i->v.s.src1)) ? X86_SAR : X86_SHR;
+    op = type_signed(get_type(ag, i->dst)) ? X86_SAR : X86_SHR;
     break;
   }
   default:
     UNREACHABLE();
   }
 
+  x86_op src =
+      shift_count(ag, i, op, i->v.s.src1, get_x86_asm_type(ag, i->dst));
   x86_instr *instr = insert_x86_instr(ag, op, i);
 
   instr->v.binary.dst = operand_from_tac_val(i->dst);
-  instr->v.binary.src = operand_from_tac_val(i->v.s.src1);
+  instr->v.binary.src = src;
   instr->v.binary.type = get_x86_asm_type(ag, i->dst);
 }
 
@@ -431,56 +1004,55 @@ static x86_reg arg_regs[6] = {
     X86_DI, X86_SI, X86_DX, X86_CX, X86_R8, X86_R9,
 };
 
-static void gen_asm_from_call(x86_asm_gen *ag, taci *i) {
-  int padding = 0;
-  if (i->v.call.args_len % 2 == 1) {
-    x86_instr *alloc_instr = insert_x86_instr(ag, X86_SUB, i);
-    alloc_instr->v.binary.dst = new_x86_reg(X86_SP);
-    alloc_instr->v.binary.src = new_x86_imm(padding = 8);
-    alloc_instr->v.binary.type = X86_QUADWORD;
-  }
-
-  for (int j = 0;
-       j < sizeof(arg_regs) / sizeof(x86_reg) && j < i->v.call.args_len; ++j) {
+// frame of caller is reused, all args are in regs (see tac_tail_call.c)
+static void gen_asm_from_tail_call(x86_asm_gen *ag, taci *i) {
+  assert(i->v.call.args_len <= sizeof(arg_regs) / sizeof(x86_reg));
+  for (int j = 0; j < i->v.call.args_len; ++j) {
     x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
     mov->v.binary.dst = new_x86_reg(arg_regs[j]);
     mov->v.binary.src = operand_from_tac_val(i->v.call.args[j]);
     mov->v.binary.type = get_x86_asm_type(ag, i->v.call.args[j]);
   }
 
-  int stack_args = 0;
-  for (int j = i->v.call.args_len - 1; j > 5; --j) {
-    ++stack_args;
-    x86_op op = operand_from_tac_val(i->v.call.args[j]);
+  x86_instr *jmp = insert_x86_instr(ag, X86_TAIL_CALL, i);
+  jmp->v.call.str_label = i->v.call.name;
+  jmp->v.call.reg_args = i->v.call.args_len;
+}
 
-    x86_asm_type asm_type = get_x86_asm_type(ag, i->v.call.args[j]);
-    if (op.t == X86_OP_REG || op.t == X86_OP_IMM || asm_type == X86_QUADWORD) {
-      x86_instr *push = insert_x86_instr(ag, X86_PUSH, i);
-      push->v.unary.src = op;
-      push->v.unary.type = X86_QUADWORD;
-    } else {
-      // work around bc pushing 4 byte value by using 8 byte pushq will cause
-      // problems so we move 4 byte value into eax and then push rax.
-      // quadwords dont need this workaround so they are handled in if before
-      x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
-      mov->v.binary.dst = new_x86_reg(X86_AX);
-      mov->v.binary.src = op;
-      mov->v.binary.type = X86_LONGWORD;
-      x86_instr *push = insert_x86_instr(ag, X86_PUSH, i);
-      push->v.unary.src = new_x86_reg(X86_AX);
-      push->v.unary.type = X86_QUADWORD;
-    }
+static void gen_asm_from_call(x86_asm_gen *ag, taci *i) {
+  if (i->v.call.tail) {
+    gen_asm_from_tail_call(ag, i);
+    return;
+  }
+
+  // stack args are stored to outgoing args area at bottom of frame, which is
+  // big enough for every call of function, so %rsp stays aligned to 16 in the
+  // whole body. Upper half of longword arg in its slot is undefined, as in abi
+  int reg_args = sizeof(arg_regs) / sizeof(x86_reg);
+  int args = i->v.call.args_len;
+  int stack_args = args > reg_args ? args - reg_args : 0;
+  int area = (8 * stack_args + 15) & ~15;
+  if (area > ag->out_args)
+    ag->out_args = area;
+
+  for (int j = 0; j < stack_args; ++j) {
+    x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
+    mov->v.binary.dst.t = X86_OP_ARG;
+    mov->v.binary.dst.v.arg_offset = 8 * j;
+    mov->v.binary.src = operand_from_tac_val(i->v.call.args[reg_args + j]);
+    mov->v.binary.type = get_x86_asm_type(ag, i->v.call.args[reg_args + j]);
+  }
+
+  for (int j = 0; j < reg_args && j < args; ++j) {
+    x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
+    mov->v.binary.dst = new_x86_reg(arg_regs[j]);
+    mov->v.binary.src = operand_from_tac_val(i->v.call.args[j]);
+    mov->v.binary.type = get_x86_asm_type(ag, i->v.call.args[j]);
   }
 
   x86_instr *call = insert_x86_instr(ag, X86_CALL, i);
   call->v.call.str_label = i->v.call.name;
-  padding += 8 * stack_args;
-  if (padding != 0) {
-    x86_instr *dealloc_instr = insert_x86_instr(ag, X86_ADD, i);
-    dealloc_instr->v.binary.dst = new_x86_reg(X86_SP);
-    dealloc_instr->v.binary.src = new_x86_imm(padding);
-    dealloc_instr->v.binary.type = X86_QUADWORD;
-  }
+  call->v.call.reg_args = args < reg_args ? args : reg_args;
 
   x86_op dst = operand_from_tac_val(i->dst);
   x86_instr *mov = insert_x86_instr(ag, X86_MOV, i);
@@ -550,8 +1122,16 @@ static void gen_asm_from_instr(x86_asm_gen *ag, taci *i) {
   case TAC_JZ:
   case TAC_JNZ:
   case TAC_JE:
+  case TAC_JNE:
+  case TAC_JLT:
+  case TAC_JLE:
+  case TAC_JGT:
+  case TAC_JGE:
     gen_asm_from_jump_instr(ag, i);
     break;
+  case TAC_JTAB:
+    gen_asm_from_jtab_instr(ag, i);
+    break;
   case TAC_LABEL:
     gen_asm_from_label_instr(ag, i);
     break;
@@ -622,8 +1202,18 @@ static x86_top_level *gen_asm_from_func(x86_asm_gen *ag, tacf *f) {
         get_x86_asm_type_from_type(fn_type->v.fntype.params[i]);
   }
 
+  ag->reads = ht_create();
   for (taci *i = f->firsti; i != NULL; i = i->next)
+    taci_foreach_src(i, count_read, ag->reads);
+
+  for (taci *i = f->firsti; i != NULL; i = i->next) {
+    if (gen_lea_pair(ag, i)) {
+      i = i->next;
+      continue;
+    }
     gen_asm_from_instr(ag, i);
+  }
+  ht_destroy(ag->reads);
 
   func->v.f.first = ag->head;
   return func;
@@ -666,6 +1256,77 @@ static void convert_to_be_syme(be_syme *e, syme *olde) {
   }
 }
 
+// slots of callee saved regs, per node - X86_CALLER_SAVED_REGS. Names can't
+// clash with vars of program
+static const char *save_slots[X86_ALLOC_REGS - X86_CALLER_SAVED_REGS] = {
+    "save.rbx", "save.r12", "save.r13", "save.r14", "save.r15", "save.rbp",
+};
+
+static void add_save_slots(arena *be_syme_arena, ht *be_st) {
+  for (int j = 0; j < X86_ALLOC_REGS - X86_CALLER_SAVED_REGS; ++j) {
+    be_syme *e = ARENA_ALLOC_OBJ(be_syme_arena, be_syme);
+    e->t = BE_SYME_OBJ;
+    e->v.obj.type = X86_QUADWORD;
+    e->v.obj.is_static = false;
+    ht_set(be_st, save_slots[j], e);
+  }
+}
+
+static bool uses_reg(x86_func *f, x86_reg reg) {
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    x86_op_ref refs[X86_INSTR_MAX_OPS];
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j)
+      if (refs[j].op->t == X86_OP_REG && refs[j].op->v.reg == reg)
+        return true;
+  }
+  return false;
+}
+
+static x86_instr *new_save_mov(x86_asm_gen *ag, x86_reg reg, int slot,
+                               bool restore) {
+  x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
+  x86_op mem;
+  mem.t = X86_OP_PSEUDO;
+  mem.v.pseudo = (string)save_slots[slot];
+  mov->v.binary.dst = restore ? new_x86_reg(reg) : mem;
+  mov->v.binary.src = restore ? mem : new_x86_reg(reg);
+  mov->v.binary.type = X86_QUADWORD;
+  return mov;
+}
+
+static void insert_before(x86_func *f, x86_instr *at, x86_instr *i) {
+  i->prev = at->prev;
+  i->next = at;
+  if (at->prev != NULL)
+    at->prev->next = i;
+  else
+    f->first = i;
+  at->prev = i;
+}
+
+// callee saved regs given by allocator are stored to their slots after alloc
+// of frame and loaded back before each return and tail call
+static void save_callee_saved_regs(x86_asm_gen *ag, x86_func *f,
+                                   x86_instr *alloc_instr) {
+  for (int j = 0; j < X86_ALLOC_REGS - X86_CALLER_SAVED_REGS; ++j) {
+    x86_reg reg = x86_alloc_regs[X86_CALLER_SAVED_REGS + j];
+    if (!uses_reg(f, reg))
+      continue;
+
+    x86_instr *save = new_save_mov(ag, reg, j, false);
+    save->prev = alloc_instr;
+    save->next = alloc_instr->next;
+    if (alloc_instr->next != NULL)
+      alloc_instr->next->prev = save;
+    alloc_instr->next = save;
+
+    for (x86_instr *i = f->first; i != NULL; i = i->next)
+      if (i->op == X86_RET || i->op == X86_TAIL_CALL)
+        insert_before(f, i, new_save_mov(ag, reg, j, true));
+  }
+}
+
 static void convert_symtable(arena *be_syme_arena, ht *be_st, sym_table *st) {
   ht *fe_st = st->t;
 
@@ -710,21 +1371,24 @@ void emit_be_st(ht *be_st) {
   }
 }
 
-x86_program gen_asm(tac_program *prog, sym_table *st) {
+x86_program gen_asm(tac_program *prog, sym_table *st, pass_manager *pm) {
   x86_program res;
   x86_asm_gen ag;
 
   init_x86_asm_gen(&ag, st);
+  ag.verbose_asm = res.verbose_asm = pm->verbose_asm;
+  ag.omit_frame_pointer = pm->omit_frame_pointer;
 
   arena *be_syme_arena;
   NEW_ARENA(be_syme_arena, be_syme);
 
   ht *be_st = ht_create();
 
-  res.be_syme_arena = be_syme_arena;
+  res.be_syme_arena = ag.be_syme_arena = be_syme_arena;
   res.be_st = be_st;
 
   convert_symtable(be_syme_arena, be_st, st);
+  add_save_slots(be_syme_arena, be_st);
 
   res.top_level_arena = ag.top_level_arena;
   res.instr_arena = ag.instr_arena;
@@ -734,26 +1398,33 @@ x86_program gen_asm(tac_program *prog, sym_table *st) {
   for (tac_top_level *tl = prog->first; tl != NULL; tl = tl->next) {
     x86_top_level *res;
     if (tl->is_func) {
+      ag.out_args = 0;
       res = gen_asm_from_func(&ag, &tl->v.f);
+      res->v.f.omit_frame_pointer = ag.omit_frame_pointer;
 
 // 2 step fix
 #ifndef ASM_DONT_FIX_PSEUDO
       x86_instr *alloc_instr = alloc_x86_instr(&ag, X86_SUB);
+      alloc_instr->v.binary.dst = new_x86_reg(X86_SP);
+      alloc_instr->v.binary.src = new_x86_imm(0);
+      alloc_instr->v.binary.type = X86_QUADWORD;
 
       alloc_instr->next = res->v.f.first;
       res->v.f.first = alloc_instr;
       alloc_instr->next->prev = alloc_instr;
 
+      run_x86_passes(pm, PASS_X86, &ag, &res->v.f, be_st);
+      save_callee_saved_regs(&ag, &res->v.f, alloc_instr);
       int bytes_to_alloc = fix_pseudo_for_func(&ag, &res->v.f, be_st);
-
-      alloc_instr->v.binary.dst = new_x86_reg(X86_SP);
       alloc_instr->v.binary.src = new_x86_imm(bytes_to_alloc);
-      alloc_instr->v.binary.type = X86_QUADWORD;
 
 #endif
 
 #ifndef ASM_DONT_FIX_INSTRUCTIONS
       fix_instructions_for_func(&ag, &res->v.f);
+      if (res->v.f.stack_alloc == 0)
+        x86_remove_instr(&res->v.f, alloc_instr);
+      run_x86_passes(pm, PASS_X86_LATE, &ag, &res->v.f, be_st);
 #endif
     } else {
       res = gen_asm_from_static_var(&ag, &tl->v.v);
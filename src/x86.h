@@ -12,6 +12,7 @@ typedef struct _x86_op x86_op;
 typedef struct _x86_func x86_func;
 typedef struct _x86_static_var x86_static_var;
 typedef struct _x86_top_level x86_top_level;
+typedef struct _pass_manager pass_manager; // see pass.h
 
 // Automatically enable ASM_DONT_FIX_INSTRUCTIONS if ASM_DONT_FIX_PSEUDO is
 // enabled. (see common.h)
@@ -19,12 +20,6 @@ typedef struct _x86_top_level x86_top_level;
 #define ASM_DONT_FIX_INSTRUCTIONS
 #endif
 
-#ifndef PRINT_TAC_ORIGIN_X86
-#ifdef PRINT_TAC_ORIGIN_X86_ONE_TIME
-#undef PRINT_TAC_ORIGIN_X86_ONE_TIME
-#endif
-#endif
-
 typedef enum {
   CC_E,
   CC_NE,
@@ -48,6 +43,12 @@ typedef enum {
   X86_R9,
   X86_R10,
   X86_R11,
+  X86_BX, // bx, r12-r15 and bp are callee saved
+  X86_R12,
+  X86_R13,
+  X86_R14,
+  X86_R15,
+  X86_BP, // allocatable only without frame pointer
   X86_SP,
 } x86_reg;
 
@@ -57,6 +58,7 @@ typedef enum {
   X86_OP_PSEUDO,
   X86_OP_STACK,
   X86_OP_DATA,
+  X86_OP_ARG, // outgoing stack arg of call, at arg_offset(%rsp)
 } x86_op_t;
 
 typedef enum {
@@ -69,9 +71,10 @@ typedef enum {
   X86_NEG,
   X86_IDIV,
   X86_DIV,
+  X86_IMUL_WIDE, // one operand imul, dx:ax = ax * src
+  X86_MUL_WIDE,  // one operand mul, dx:ax = ax * src
   X86_INC,
   X86_DEC,
-  X86_PUSH,
 
   // binary
   X86_MOV,
@@ -85,6 +88,7 @@ typedef enum {
   X86_SHR,
   X86_SAR,
   X86_CMP,
+  X86_TEST, // only made by peephole, as `test %r, %r`
   X86_MOVSX,
   X86_MOVZEXT,
 
@@ -92,9 +96,14 @@ typedef enum {
   X86_JMP,
   X86_JMPCC,
   X86_SETCC,
+  X86_CMOV, // only made by if conversion
   X86_LABEL,
   X86_CALL,
+  X86_TAIL_CALL, // tears down frame and jumps to function, uses call
+  X86_JMP_TABLE,
+  X86_LEA,
 
+  X86_ALIGN, // only made by block placement, aligns next label (loop header)
   X86_COMMENT,
 } x86_t;
 
@@ -111,6 +120,7 @@ struct _x86_op {
     string pseudo;
     string data;
     int stack_offset;
+    int arg_offset;
     x86_reg reg;
   } v;
 };
@@ -135,14 +145,36 @@ struct _x86_instr {
       x86_cc cc;
       x86_op op;
     } setcc;
+    struct {
+      x86_cc cc;
+      x86_op src;
+      x86_op dst; // written only if cc holds
+      x86_asm_type type;
+    } cmov;
     int label; // label or jump
     struct {
       char plt;
-      string str_label; // call
+      string str_label; // call, tail call
+      int reg_args;     // amount of args passed in regs
     } call;
     struct {
       x86_asm_type type;
     } cdq;
+    struct {
+      x86_op idx; // in bounds of labels, zero extended from type
+      x86_asm_type type;
+      int *labels;
+      size_t labels_len;
+      int table_label;
+    } jtab;
+    struct {
+      x86_op base;
+      x86_op index; // only if scale isn't 0
+      int scale;    // 0, 1, 2, 4 or 8
+      int32_t disp;
+      x86_op dst;
+      x86_asm_type type;
+    } lea; // dst = base + index * scale + disp
     string comment; // for comment instr
   } v;
   x86_instr *next;
@@ -155,6 +187,12 @@ struct _x86_func {
   x86_instr *first;
   x86_func *next;
   bool global;
+
+  // stack operand with offset k is at -k from %rbp or, without frame pointer,
+  // at stack_alloc - 8 - k from %rsp. Outgoing stack args are below locals
+  int frame_size;  // bytes of locals and outgoing stack args
+  int stack_alloc; // bytes subtracted from %rsp after push of %rbp, if any
+  bool omit_frame_pointer;
 };
 
 struct _x86_static_var {
@@ -181,6 +219,15 @@ struct _x86_asm_gen {
 
   x86_instr *head; // head of instr linked list for curr func
   x86_instr *tail; // tail of instr linked list for curr func
+
+  ht *reads; // var of curr func -> amount of its reads, for instr selection
+
+  bool verbose_asm; // annotate asm with tac origins and layouts of vars
+  bool omit_frame_pointer; // address frame off %rsp, %rbp is allocatable
+
+  int out_args; // bytes of outgoing stack args area of curr func
+
+  arena *be_syme_arena; // for pseudos made by passes
 };
 
 typedef struct _x86_program x86_program;
@@ -190,6 +237,7 @@ struct _x86_program {
   arena *be_syme_arena;   // will be freed by free_x86_program
   x86_top_level *first;
   ht *be_st; // will be destoyed by free_x86_program
+  bool verbose_asm;
 };
 
 typedef struct _be_syme be_syme;
@@ -212,18 +260,51 @@ struct _be_syme {
   } v;
 };
 
-x86_program gen_asm(tac_program *tac_prog, sym_table *st);
+// x86 passes of pass manager are run by gen_asm for each function
+x86_program gen_asm(tac_program *tac_prog, sym_table *st, pass_manager *pm);
 void emit_be_st(ht *be_st);
 
 void free_x86_program(x86_program *p);
 
-// replaces pseudo instructions, is called by gen_asm
-// returns amount of bytes to be allocated for locals
+// assigns registers to non-static pseudos by graph coloring, is run by pass
+// manager before fix_pseudo_for_func. Pseudos which didn't get a register are
+// left for fix_pseudo_for_func
+void alloc_regs_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+
+// same as alloc_regs_for_func, but by linear scan over live intervals
+void linear_scan_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+
+// threads jump chains, removes unreachable instrs, unused labels and jumps to
+// next label
+void simplify_x86_cfg_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+
+// replaces short branches which select value by cmov, before register
+// allocation
+void cmov_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+void print_cmov_stats(void);
+
+// renames pseudos left in memory with disjoint live intervals to one name, so
+// fix_pseudo_for_func gives them one stack slot
+void share_stack_slots_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+void print_stack_slot_stats(void);
+
+// replaces pseudo instructions and lays out frame, is called by gen_asm
+// returns amount of bytes to be allocated for frame, see stack_alloc
 int fix_pseudo_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
 
 // fixes invalid instructions, is called by gen_asm
 void fix_instructions_for_func(x86_asm_gen *ag, x86_func *f);
 
+// rewrites short instr sequences of final code by table of rules, is run by
+// pass manager after fix_instructions_for_func
+void peephole_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+void print_peephole_stats(void);
+
+// orders blocks of final code so likely successors fall through and cold ones
+// are at the end, aligns loop headers
+void place_blocks_for_func(x86_asm_gen *ag, x86_func *f, ht *bst);
+void print_block_placement_stats(void);
+
 void emit_x86(FILE *w, x86_program *prog);
 
 #endif
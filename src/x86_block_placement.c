@@ -0,0 +1,360 @@
+#include "bitset.h"
+#include "common.h"
+#include "dataflow.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Block placement, last pass over final code. Each conditional jump gets
+// likely successor by static rules, first one which tells them apart wins:
+//  - block which is cold is unlikely. Cold blocks call function which doesn't
+//    return (exit, abort, ...) or lead only to cold blocks
+//  - back edge of loop is likely
+//  - edge leaving loop is unlikely
+//  - block which returns is unlikely
+//  - otherwise fallthrough of the jump is likely
+// Block returning on unlikely edge is taken as cold too (early return).
+//
+// Blocks are then chained from entry: after each block goes its likely
+// successor (or other one), if it isn't placed yet, isn't cold and wouldn't
+// be taken away from other preds, i.e. has single pred or was next already.
+// When chain ends, it goes on from first block not placed yet, cold blocks
+// are put at the end of function. Jumps are fixed up for new order: cond jump
+// is inverted when its target follows it, jump is added where fallthrough is
+// broken and jumps to next block are dropped. Headers of loops which aren't
+// cold get aligned.
+
+// functions which never return, calls of them start cold paths
+static const char *noreturn_funcs[] = {
+    "exit", "_exit", "_Exit", "abort", "__assert_fail", "__stack_chk_fail",
+};
+
+#define NORETURN_FUNCS_LEN (sizeof(noreturn_funcs) / sizeof(noreturn_funcs[0]))
+
+extern int label_idx_counter; // defined in resolve.c
+
+// defined in x86.c
+x86_instr *alloc_x86_instr(x86_asm_gen *ag, int op);
+
+typedef struct {
+  x86_asm_gen *ag;
+  x86_func *f;
+  x86_cfg g;
+  df_loop_vec loops;
+
+  int *fall;    // block -> block it falls into, -1 if none
+  int *target;  // block -> block its jmp or jcc goes to, -1 if none
+  int *likely;  // block -> its more likely successor, -1 if none
+  bool *cold;   // block -> true if it's rarely run
+  bool *placed; // block -> true if it's in order already
+  bool *empty;  // block -> true if it's only jmp which can be dropped
+  int_vec order;
+} placement_ctx;
+
+static struct {
+  int cold;
+  int inverted;
+  int aligned;
+} stats;
+
+static bool is_noreturn_call(x86_instr *i) {
+  if (i->op != X86_CALL && i->op != X86_TAIL_CALL)
+    return false;
+  for (size_t k = 0; k < NORETURN_FUNCS_LEN; ++k)
+    if (!strcmp(i->v.call.str_label, noreturn_funcs[k]))
+      return true;
+  return false;
+}
+
+static bool falls_through(x86_instr *last) {
+  return last->op != X86_RET && last->op != X86_JMP &&
+         last->op != X86_JMP_TABLE && last->op != X86_TAIL_CALL;
+}
+
+static bool returns(placement_ctx *c, int b) {
+  return c->g.blocks.data[b].last->op == X86_RET;
+}
+
+// fills fall and target, false if last block falls off the end of function
+static bool link_blocks(placement_ctx *c) {
+  size_t n = c->g.blocks.size;
+  ht *label_block = ht_create_int();
+  vec_foreach(x86_block, c->g.blocks, b) {
+    if (b->first->op == X86_LABEL)
+      ht_set_int(label_block, b->first->v.label,
+                 (void *)(intptr_t)(b->idx + 1));
+  }
+
+  bool ok = true;
+  vec_foreach(x86_block, c->g.blocks, b) {
+    x86_instr *last = b->last;
+    c->fall[b->idx] = -1;
+    c->target[b->idx] = -1;
+    if (falls_through(last)) {
+      if ((size_t)b->idx + 1 >= n)
+        ok = false;
+      else
+        c->fall[b->idx] = b->idx + 1;
+    }
+    int l = last->op == X86_JMP     ? last->v.label
+            : last->op == X86_JMPCC ? last->v.jmpcc.label_idx
+                                    : -1;
+    if (l >= 0)
+      c->target[b->idx] = (int)(intptr_t)ht_get_int(label_block, l) - 1;
+  }
+
+  ht_destroy(label_block);
+  return ok;
+}
+
+static void find_cold(placement_ctx *c) {
+  vec_foreach(x86_block, c->g.blocks, b) {
+    c->cold[b->idx] = false;
+    for (x86_instr *i = b->first;; i = i->next) {
+      if (is_noreturn_call(i))
+        c->cold[b->idx] = true;
+      if (i == b->last)
+        break;
+    }
+  }
+
+  // blocks from which every path goes into cold one, entry is never cold
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t b = c->g.blocks.size - 1; b > 0; --b) {
+      int_vec *succs = &c->g.blocks.data[b].succs;
+      if (c->cold[b] || succs->size == 0)
+        continue;
+      bool all = true;
+      vec_foreach(int, *succs, it) {
+        all &= c->cold[*it];
+      }
+      changed |= c->cold[b] = all;
+    }
+  }
+}
+
+static bool is_back_edge(placement_ctx *c, int from, int to) {
+  vec_foreach(df_loop, c->loops, l) {
+    if (l->header == to && bitset_test(&l->body, from))
+      return true;
+  }
+  return false;
+}
+
+static bool leaves_loop(placement_ctx *c, int from, int to) {
+  vec_foreach(df_loop, c->loops, l) {
+    if (bitset_test(&l->body, from) && !bitset_test(&l->body, to))
+      return true;
+  }
+  return false;
+}
+
+// more likely of successors t (jumped to) and f (fallen into) of block b
+static int pick_likely(placement_ctx *c, int b, int t, int f) {
+  if (c->cold[t] != c->cold[f])
+    return c->cold[t] ? f : t;
+  bool back_t = is_back_edge(c, b, t), back_f = is_back_edge(c, b, f);
+  if (back_t != back_f)
+    return back_t ? t : f;
+  bool exit_t = leaves_loop(c, b, t), exit_f = leaves_loop(c, b, f);
+  if (exit_t != exit_f)
+    return exit_t ? f : t;
+  if (returns(c, t) != returns(c, f))
+    return returns(c, t) ? f : t;
+  return f;
+}
+
+static void find_likely(placement_ctx *c) {
+  size_t n = c->g.blocks.size;
+  for (size_t b = 0; b < n; ++b) {
+    int t = c->target[b], f = c->fall[b];
+    c->likely[b] = t < 0 ? f : f < 0 ? t : pick_likely(c, b, t, f);
+  }
+
+  // early returns, which are computed after likely so they don't decide it
+  for (size_t b = 0; b < n; ++b) {
+    int t = c->target[b], f = c->fall[b];
+    if (t < 0 || f < 0 || t == f || c->cold[b])
+      continue;
+    int unlikely = c->likely[b] == t ? f : t;
+    if (returns(c, unlikely) && c->g.blocks.data[unlikely].preds.size == 1)
+      c->cold[unlikely] = true;
+  }
+
+  for (size_t b = 0; b < n; ++b)
+    stats.cold += c->cold[b];
+}
+
+static bool can_follow(placement_ctx *c, int b, int s) {
+  return s >= 0 && !c->placed[s] && (c->cold[b] || !c->cold[s]) &&
+         (s == b + 1 || c->g.blocks.data[s].preds.size == 1);
+}
+
+// first block not placed yet, hot ones first
+static int next_unplaced(placement_ctx *c) {
+  size_t n = c->g.blocks.size;
+  for (size_t b = 0; b < n; ++b)
+    if (!c->placed[b] && !c->cold[b])
+      return b;
+  for (size_t b = 0; b < n; ++b)
+    if (!c->placed[b])
+      return b;
+  return -1;
+}
+
+static void order_blocks(placement_ctx *c) {
+  for (int b = 0; b >= 0;) {
+    c->placed[b] = true;
+    vec_push_back(c->order, b);
+
+    int s = c->likely[b];
+    int other = s == c->fall[b] ? c->target[b] : c->fall[b];
+    if (can_follow(c, b, s))
+      b = s;
+    else if (can_follow(c, b, other))
+      b = other;
+    else
+      b = next_unplaced(c);
+  }
+}
+
+// label block starts with, new one is put at its start if it has none
+static int block_label(placement_ctx *c, int b) {
+  x86_block *blk = &c->g.blocks.data[b];
+  if (blk->first->op == X86_LABEL)
+    return blk->first->v.label;
+  x86_instr *l = alloc_x86_instr(c->ag, X86_LABEL);
+  l->v.label = ++label_idx_counter;
+  l->next = blk->first;
+  blk->first->prev = l;
+  blk->first = l;
+  return l->v.label;
+}
+
+static void append_jmp(placement_ctx *c, int b, int to) {
+  x86_block *blk = &c->g.blocks.data[b];
+  x86_instr *j = alloc_x86_instr(c->ag, X86_JMP);
+  j->v.label = block_label(c, to);
+  j->prev = blk->last;
+  blk->last->next = j;
+  blk->last = j;
+}
+
+// makes block b, which is followed by block next (-1 if none), go to same
+// successors as before
+static void fix_jumps(placement_ctx *c, int b, int next) {
+  x86_block *blk = &c->g.blocks.data[b];
+  x86_instr *last = blk->last;
+  int t = c->target[b], f = c->fall[b];
+
+  if (last->op == X86_JMPCC) {
+    if (f == next)
+      return;
+    if (t == next) {
+      last->v.jmpcc.cc = x86_invert_cc(last->v.jmpcc.cc);
+      last->v.jmpcc.label_idx = block_label(c, f);
+      ++stats.inverted;
+      return;
+    }
+    append_jmp(c, b, f);
+    return;
+  }
+
+  // jmp which is whole block is dropped with the block in relink, unless
+  // block gets label later
+  if (last->op == X86_JMP && t == next) {
+    if (blk->first == last)
+      c->empty[b] = true;
+    else
+      blk->last = last->prev;
+    return;
+  }
+
+  if (f >= 0 && f != next)
+    append_jmp(c, b, f);
+}
+
+static bool is_dropped(placement_ctx *c, int b) {
+  x86_block *blk = &c->g.blocks.data[b];
+  return c->empty[b] && blk->first == blk->last;
+}
+
+static void align_loops(placement_ctx *c) {
+  vec_foreach(df_loop, c->loops, l) {
+    x86_block *h = &c->g.blocks.data[l->header];
+    if (c->cold[l->header] || is_dropped(c, l->header))
+      continue;
+    x86_instr *a = alloc_x86_instr(c->ag, X86_ALIGN);
+    a->next = h->first;
+    h->first->prev = a;
+    h->first = a;
+    ++stats.aligned;
+  }
+}
+
+static void relink(placement_ctx *c) {
+  x86_instr *prev = NULL;
+  vec_foreach(int, c->order, it) {
+    x86_block *blk = &c->g.blocks.data[*it];
+    if (is_dropped(c, *it))
+      continue;
+    if (prev == NULL)
+      c->f->first = blk->first;
+    else
+      prev->next = blk->first;
+    blk->first->prev = prev;
+    prev = blk->last;
+  }
+  prev->next = NULL;
+}
+
+void place_blocks_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  placement_ctx c;
+  c.ag = ag;
+  c.f = f;
+  build_x86_cfg(&c.g, f, bst);
+  find_x86_loops(&c.g, &c.loops);
+  vec_init(c.order);
+
+  size_t n = c.g.blocks.size;
+  c.fall = malloc(sizeof(int) * n);
+  c.target = malloc(sizeof(int) * n);
+  c.likely = malloc(sizeof(int) * n);
+  c.cold = malloc(sizeof(bool) * n);
+  c.placed = calloc(n, sizeof(bool));
+  c.empty = calloc(n, sizeof(bool));
+  assert(c.fall && c.target && c.likely && c.cold && c.placed && c.empty);
+
+  if (link_blocks(&c)) {
+    find_cold(&c);
+    find_likely(&c);
+    order_blocks(&c);
+    for (size_t p = 0; p < n; ++p)
+      fix_jumps(&c, c.order.data[p], p + 1 < n ? c.order.data[p + 1] : -1);
+    align_loops(&c);
+    relink(&c);
+  }
+
+  free(c.fall);
+  free(c.target);
+  free(c.likely);
+  free(c.cold);
+  free(c.placed);
+  free(c.empty);
+  vec_free(c.order);
+  df_free_loops(&c.loops);
+  free_x86_cfg(&c.g);
+}
+
+void print_block_placement_stats(void) {
+  fprintf(stderr, "block-placement  cold blocks %d\n", stats.cold);
+  fprintf(stderr, "block-placement  inverted jumps %d\n", stats.inverted);
+  fprintf(stderr, "block-placement  aligned loops %d\n", stats.aligned);
+}
@@ -0,0 +1,595 @@
+#include "x86_cfg.h"
+#include "bitset.h"
+#include "common.h"
+#include "dataflow.h"
+#include "strings.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+const x86_reg x86_alloc_regs[X86_ALLOC_REGS] = {
+    X86_AX, X86_CX,  X86_DX,  X86_DI,  X86_SI,  X86_R8, X86_R9,
+    X86_BX, X86_R12, X86_R13, X86_R14, X86_R15, X86_BP,
+};
+
+int x86_usable_regs(x86_asm_gen *ag) {
+  return ag->omit_frame_pointer ? X86_ALLOC_REGS : X86_ALLOC_REGS - 1;
+}
+
+// regs used to pass args, in order
+static const x86_reg arg_regs[6] = {
+    X86_DI, X86_SI, X86_DX, X86_CX, X86_R8, X86_R9,
+};
+
+static int reg_node(x86_reg reg) {
+  for (int i = 0; i < X86_ALLOC_REGS; ++i)
+    if (x86_alloc_regs[i] == reg)
+      return i;
+  return -1;
+}
+
+int x86_instr_ops(x86_instr *i, x86_op_ref refs[X86_INSTR_MAX_OPS]) {
+  switch (i->op) {
+  case X86_NOT:
+  case X86_NEG:
+  case X86_INC:
+  case X86_DEC:
+    refs[0] = (x86_op_ref){&i->v.unary.src, true, true};
+    return 1;
+  case X86_IDIV:
+  case X86_DIV:
+  case X86_IMUL_WIDE:
+  case X86_MUL_WIDE:
+    refs[0] = (x86_op_ref){&i->v.unary.src, true, false};
+    return 1;
+  case X86_MOV:
+  case X86_MOVSX:
+  case X86_MOVZEXT:
+    refs[0] = (x86_op_ref){&i->v.binary.src, true, false};
+    refs[1] = (x86_op_ref){&i->v.binary.dst, false, true};
+    return 2;
+  case X86_ADD:
+  case X86_SUB:
+  case X86_MULT:
+  case X86_AND:
+  case X86_OR:
+  case X86_XOR:
+  case X86_SHL:
+  case X86_SHR:
+  case X86_SAR:
+    refs[0] = (x86_op_ref){&i->v.binary.src, true, false};
+    refs[1] = (x86_op_ref){&i->v.binary.dst, true, true};
+    return 2;
+  case X86_CMP:
+  case X86_TEST:
+    refs[0] = (x86_op_ref){&i->v.binary.src, true, false};
+    refs[1] = (x86_op_ref){&i->v.binary.dst, true, false};
+    return 2;
+  case X86_SETCC:
+    // setcc writes only low byte, rest of dst is kept
+    refs[0] = (x86_op_ref){&i->v.setcc.op, true, true};
+    return 1;
+  case X86_CMOV:
+    refs[0] = (x86_op_ref){&i->v.cmov.src, true, false};
+    refs[1] = (x86_op_ref){&i->v.cmov.dst, true, true};
+    return 2;
+  case X86_JMP_TABLE:
+    refs[0] = (x86_op_ref){&i->v.jtab.idx, true, false};
+    return 1;
+  case X86_LEA:
+    refs[0] = (x86_op_ref){&i->v.lea.dst, false, true};
+    refs[1] = (x86_op_ref){&i->v.lea.base, true, false};
+    if (i->v.lea.scale == 0)
+      return 2;
+    refs[2] = (x86_op_ref){&i->v.lea.index, true, false};
+    return 3;
+  case X86_RET:
+  case X86_CDQ:
+  case X86_JMP:
+  case X86_JMPCC:
+  case X86_LABEL:
+  case X86_CALL:
+  case X86_TAIL_CALL:
+  case X86_ALIGN:
+  case X86_COMMENT:
+    return 0;
+  }
+
+  UNREACHABLE();
+}
+
+int x86_op_node(x86_cfg *g, x86_op *op) {
+  switch (op->t) {
+  case X86_OP_REG:
+    return reg_node(op->v.reg);
+  case X86_OP_PSEUDO:
+    return (int)(intptr_t)ht_get(g->pseudo_node, op->v.pseudo) - 1;
+  default:
+    return -1;
+  }
+}
+
+#define PUSH_NODE(arr, n, node)                                                \
+  do {                                                                         \
+    int _node = (node);                                                        \
+    if (_node >= 0)                                                            \
+      (arr)[(n)++] = _node;                                                    \
+  } while (0)
+
+void get_x86_instr_nodes(x86_cfg *g, x86_instr *i, x86_instr_nodes *res) {
+  res->nuses = res->ndefs = 0;
+
+  x86_op_ref refs[X86_INSTR_MAX_OPS];
+  int n = x86_instr_ops(i, refs);
+  for (int j = 0; j < n; ++j) {
+    int node = x86_op_node(g, refs[j].op);
+    if (refs[j].use)
+      PUSH_NODE(res->uses, res->nuses, node);
+    if (refs[j].def)
+      PUSH_NODE(res->defs, res->ndefs, node);
+  }
+
+  switch (i->op) {
+  case X86_RET:
+    PUSH_NODE(res->uses, res->nuses, reg_node(X86_AX));
+    break;
+  case X86_CDQ:
+    PUSH_NODE(res->uses, res->nuses, reg_node(X86_AX));
+    PUSH_NODE(res->defs, res->ndefs, reg_node(X86_DX));
+    break;
+  case X86_IDIV:
+  case X86_DIV:
+    PUSH_NODE(res->uses, res->nuses, reg_node(X86_AX));
+    PUSH_NODE(res->uses, res->nuses, reg_node(X86_DX));
+    PUSH_NODE(res->defs, res->ndefs, reg_node(X86_AX));
+    PUSH_NODE(res->defs, res->ndefs, reg_node(X86_DX));
+    break;
+  case X86_IMUL_WIDE:
+  case X86_MUL_WIDE:
+    PUSH_NODE(res->uses, res->nuses, reg_node(X86_AX));
+    PUSH_NODE(res->defs, res->ndefs, reg_node(X86_AX));
+    PUSH_NODE(res->defs, res->ndefs, reg_node(X86_DX));
+    break;
+  case X86_CALL:
+    for (int j = 0; j < i->v.call.reg_args; ++j)
+      PUSH_NODE(res->uses, res->nuses, reg_node(arg_regs[j]));
+    for (int j = 0; j < X86_CALLER_SAVED_REGS; ++j)
+      PUSH_NODE(res->defs, res->ndefs, j);
+    break;
+  case X86_TAIL_CALL:
+    for (int j = 0; j < i->v.call.reg_args; ++j)
+      PUSH_NODE(res->uses, res->nuses, reg_node(arg_regs[j]));
+    break;
+  default:
+    break;
+  }
+}
+
+static bool is_terminator(x86_instr *i) {
+  return i->op == X86_RET || i->op == X86_JMP || i->op == X86_JMPCC ||
+         i->op == X86_JMP_TABLE || i->op == X86_TAIL_CALL;
+}
+
+static void register_pseudo(x86_cfg *g, x86_op *op) {
+  if (op->t != X86_OP_PSEUDO || ht_get(g->pseudo_node, op->v.pseudo) != NULL)
+    return;
+
+  be_syme *e = ht_get(g->bst, op->v.pseudo);
+  assert(e != NULL && e->t == BE_SYME_OBJ);
+  if (e->v.obj.is_static)
+    return;
+
+  vec_push_back(g->pseudos, op->v.pseudo);
+  ht_set(g->pseudo_node, op->v.pseudo,
+         (void *)(intptr_t)(X86_ALLOC_REGS + g->pseudos.size));
+}
+
+static void new_block(x86_cfg *g, x86_instr *first) {
+  x86_block b;
+  b.idx = g->blocks.size;
+  b.first = b.last = first;
+  b.loop_depth = 0;
+  vec_init(b.succs);
+  vec_init(b.preds);
+  vec_push_back(g->blocks, b);
+}
+
+static void add_edge(x86_cfg *g, int from, int to) {
+  vec_foreach(int, g->blocks.data[from].succs, it) {
+    if (*it == to)
+      return;
+  }
+  vec_push_back(g->blocks.data[from].succs, to);
+  vec_push_back(g->blocks.data[to].preds, from);
+}
+
+static int jump_target(x86_instr *i) {
+  return i->op == X86_JMP ? i->v.label : i->v.jmpcc.label_idx;
+}
+
+// finds nodes which are read before written in some block
+static void find_live_nodes(x86_cfg *g) {
+  size_t n = g->nodes;
+  int *def_block = malloc(sizeof(int) * n);
+  g->live_idx = malloc(sizeof(int) * n);
+  assert(def_block && g->live_idx);
+  memset(def_block, -1, sizeof(int) * n);
+  memset(g->live_idx, -1, sizeof(int) * n);
+  vec_init(g->live_nodes);
+
+  x86_instr_nodes in;
+  vec_foreach(x86_block, g->blocks, b) {
+    for (x86_instr *i = b->first;; i = i->next) {
+      get_x86_instr_nodes(g, i, &in);
+      for (int j = 0; j < in.nuses; ++j) {
+        int node = in.uses[j];
+        if (def_block[node] != b->idx && g->live_idx[node] < 0) {
+          g->live_idx[node] = g->live_nodes.size;
+          vec_push_back(g->live_nodes, node);
+        }
+      }
+      for (int j = 0; j < in.ndefs; ++j)
+        def_block[in.defs[j]] = b->idx;
+      if (i == b->last)
+        break;
+    }
+  }
+
+  free(def_block);
+}
+
+static void compute_use_def(x86_cfg *g, x86_block *b) {
+  x86_instr_nodes in;
+  for (x86_instr *i = b->first;; i = i->next) {
+    get_x86_instr_nodes(g, i, &in);
+    for (int j = 0; j < in.nuses; ++j) {
+      int idx = g->live_idx[in.uses[j]];
+      if (idx >= 0 && !bitset_test(&b->def, idx))
+        bitset_set(&b->use, idx);
+    }
+    for (int j = 0; j < in.ndefs; ++j) {
+      int idx = g->live_idx[in.defs[j]];
+      if (idx >= 0)
+        bitset_set(&b->def, idx);
+    }
+    if (i == b->last)
+      break;
+  }
+}
+
+void build_x86_cfg(x86_cfg *g, x86_func *f, ht *bst) {
+  g->f = f;
+  g->bst = bst;
+  g->pseudo_node = ht_create();
+  vec_init(g->pseudos);
+  vec_init(g->blocks);
+
+  // number pseudos and find biggest label
+  int max_label = 0;
+  x86_op_ref refs[X86_INSTR_MAX_OPS];
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j)
+      register_pseudo(g, refs[j].op);
+    if (i->op == X86_LABEL && i->v.label > max_label)
+      max_label = i->v.label;
+  }
+  g->nodes = X86_ALLOC_REGS + g->pseudos.size;
+
+  // split into blocks
+  int *label_block = malloc(sizeof(int) * (max_label + 1));
+  assert(label_block);
+  memset(label_block, -1, sizeof(int) * (max_label + 1));
+
+  x86_instr *prev = NULL;
+  for (x86_instr *i = f->first; i != NULL; prev = i, i = i->next) {
+    if (prev == NULL || is_terminator(prev) || i->op == X86_LABEL)
+      new_block(g, i);
+    else
+      vec_back(g->blocks).last = i;
+
+    if (i->op == X86_LABEL)
+      label_block[i->v.label] = vec_back(g->blocks).idx;
+  }
+
+  // link blocks
+  for (size_t b = 0; b < g->blocks.size; ++b) {
+    x86_instr *last = g->blocks.data[b].last;
+
+    if (last->op == X86_JMP || last->op == X86_JMPCC) {
+      int l = jump_target(last);
+      assert(l <= max_label && label_block[l] >= 0);
+      add_edge(g, b, label_block[l]);
+    }
+    if (last->op == X86_JMP_TABLE) {
+      for (size_t j = 0; j < last->v.jtab.labels_len; ++j) {
+        int l = last->v.jtab.labels[j];
+        assert(l <= max_label && label_block[l] >= 0);
+        add_edge(g, b, label_block[l]);
+      }
+    }
+
+    if (last->op != X86_RET && last->op != X86_JMP &&
+        last->op != X86_JMP_TABLE && last->op != X86_TAIL_CALL &&
+        b + 1 < g->blocks.size)
+      add_edge(g, b, b + 1);
+  }
+
+  free(label_block);
+
+  find_live_nodes(g);
+
+  // alloc bitsets
+  size_t bits = g->live_nodes.size;
+  size_t words = BITSET_WORDS(bits);
+  g->sets = calloc(words * 4 * g->blocks.size + 1, sizeof(uint64_t));
+  assert(g->sets);
+
+  uint64_t *s = g->sets;
+  vec_foreach(x86_block, g->blocks, b) {
+    bitset_init_on(&b->use, s, bits);
+    bitset_init_on(&b->def, s + words, bits);
+    bitset_init_on(&b->live_in, s + words * 2, bits);
+    bitset_init_on(&b->live_out, s + words * 3, bits);
+    s += words * 4;
+    compute_use_def(g, b);
+  }
+}
+
+static int_vec *block_succs(int node, void *ctx) {
+  return &((x86_cfg *)ctx)->blocks.data[node].succs;
+}
+
+static int_vec *block_preds(int node, void *ctx) {
+  return &((x86_cfg *)ctx)->blocks.data[node].preds;
+}
+
+static bool liveness_transfer(int node, bitset *res, const bitset *input,
+                              void *ctx) {
+  x86_block *b = &((x86_cfg *)ctx)->blocks.data[node];
+  return bitset_gen_kill(res, &b->use, input, &b->def);
+}
+
+void analyze_x86_liveness(x86_cfg *g) {
+  size_t n = g->blocks.size;
+  bitset *in = malloc(sizeof(bitset) * (n ? n : 1));
+  bitset *out = malloc(sizeof(bitset) * (n ? n : 1));
+  assert(in && out);
+  for (size_t i = 0; i < n; ++i) {
+    in[i] = g->blocks.data[i].live_in;
+    out[i] = g->blocks.data[i].live_out;
+  }
+
+  df_problem p;
+  p.backward = true;
+  p.nodes = n;
+  p.bits = g->live_nodes.size;
+  p.succs = block_succs;
+  p.preds = block_preds;
+  p.meet = bitset_union;
+  p.transfer = liveness_transfer;
+  p.ctx = g;
+  p.in = in;
+  p.out = out;
+  df_solve(&p);
+
+  free(in);
+  free(out);
+}
+
+void compute_x86_loop_depths(x86_cfg *g) {
+  size_t n = g->blocks.size;
+  int *depth = malloc(sizeof(int) * (n ? n : 1));
+  assert(depth);
+  df_loop_depths(n, block_succs, block_preds, g, depth);
+  for (size_t i = 0; i < n; ++i)
+    g->blocks.data[i].loop_depth = depth[i];
+  free(depth);
+}
+
+void find_x86_loops(x86_cfg *g, df_loop_vec *loops) {
+  df_find_loops(g->blocks.size, block_succs, block_preds, g, loops);
+}
+
+void free_x86_cfg(x86_cfg *g) {
+  vec_foreach(x86_block, g->blocks, b) {
+    vec_free(b->succs);
+    vec_free(b->preds);
+  }
+  vec_free(g->blocks);
+  vec_free(g->pseudos);
+  vec_free(g->live_nodes);
+  ht_destroy(g->pseudo_node);
+  free(g->live_idx);
+  free(g->sets);
+}
+
+x86_cc x86_invert_cc(x86_cc cc) {
+  switch (cc) {
+  case CC_E:
+    return CC_NE;
+  case CC_NE:
+    return CC_E;
+  case CC_G:
+    return CC_LE;
+  case CC_GE:
+    return CC_L;
+  case CC_L:
+    return CC_GE;
+  case CC_LE:
+    return CC_G;
+  case CC_A:
+    return CC_BE;
+  case CC_AE:
+    return CC_B;
+  case CC_B:
+    return CC_AE;
+  case CC_BE:
+    return CC_A;
+  }
+  UNREACHABLE();
+}
+
+void x86_remove_instr(x86_func *f, x86_instr *i) {
+  if (i->prev != NULL)
+    i->prev->next = i->next;
+  else
+    f->first = i->next;
+  if (i->next != NULL)
+    i->next->prev = i->prev;
+}
+
+static bool is_mem_op(x86_op *op) {
+  return op->t == X86_OP_STACK || op->t == X86_OP_DATA || op->t == X86_OP_ARG;
+}
+
+static bool is_reg_op(x86_op *op, x86_reg reg) {
+  return op->t == X86_OP_REG && op->v.reg == reg;
+}
+
+bool x86_upper_zero(x86_instr *i, x86_reg reg) {
+  for (i = i->prev; i != NULL; i = i->prev) {
+    if (i->op == X86_COMMENT ||
+        (i->op == X86_MOV && is_mem_op(&i->v.binary.dst)))
+      continue;
+    switch (i->op) {
+    case X86_MOV:
+    case X86_ADD:
+    case X86_SUB:
+    case X86_MULT:
+    case X86_AND:
+    case X86_OR:
+    case X86_XOR:
+      return i->v.binary.type == X86_LONGWORD &&
+             is_reg_op(&i->v.binary.dst, reg);
+    case X86_LEA:
+      return i->v.lea.type == X86_LONGWORD && is_reg_op(&i->v.lea.dst, reg);
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+
+void x86_apply_colors(x86_cfg *g, const int *color) {
+  x86_op_ref refs[X86_INSTR_MAX_OPS];
+  for (x86_instr *i = g->f->first; i != NULL;) {
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j) {
+      int node = x86_op_node(g, refs[j].op);
+      if (node < X86_ALLOC_REGS || color[node] < 0)
+        continue;
+      refs[j].op->t = X86_OP_REG;
+      refs[j].op->v.reg = x86_alloc_regs[color[node]];
+    }
+
+    x86_instr *next = i->next;
+
+    // moves between values sharing reg became mov %reg, %reg. Longword one
+    // zeroes upper half (truncation, zero extension), so it stays unless the
+    // half is zero already
+    if (i->op == X86_MOV && i->v.binary.src.t == X86_OP_REG &&
+        is_reg_op(&i->v.binary.dst, i->v.binary.src.v.reg) &&
+        (i->v.binary.type == X86_QUADWORD ||
+         x86_upper_zero(i, i->v.binary.src.v.reg)))
+      x86_remove_instr(g->f, i);
+
+    i = next;
+  }
+}
+
+static const char *reg_name(x86_reg reg) {
+  switch (reg) {
+  case X86_AX:
+    return "rax";
+  case X86_CX:
+    return "rcx";
+  case X86_DX:
+    return "rdx";
+  case X86_DI:
+    return "rdi";
+  case X86_SI:
+    return "rsi";
+  case X86_R8:
+    return "r8";
+  case X86_R9:
+    return "r9";
+  case X86_BX:
+    return "rbx";
+  case X86_R12:
+    return "r12";
+  case X86_R13:
+    return "r13";
+  case X86_R14:
+    return "r14";
+  case X86_R15:
+    return "r15";
+  case X86_BP:
+    return "rbp";
+  default:
+    UNREACHABLE();
+  }
+}
+
+// defined in x86.c
+x86_instr *alloc_x86_instr(x86_asm_gen *ag, int op);
+
+void x86_emit_regs_layout(x86_asm_gen *ag, x86_cfg *g, const int *color) {
+  x86_instr *head = alloc_x86_instr(ag, X86_COMMENT);
+  head->v.comment = new_string("---- regs layout ----");
+  x86_instr *tail = head;
+
+  for (size_t node = X86_ALLOC_REGS; node < g->nodes; ++node) {
+    if (color[node] < 0)
+      continue;
+    x86_instr *i = alloc_x86_instr(ag, X86_COMMENT);
+    i->v.comment = string_sprintf(" %s: %%%s",
+                                  g->pseudos.data[node - X86_ALLOC_REGS],
+                                  reg_name(x86_alloc_regs[color[node]]));
+    i->prev = tail;
+    tail->next = i;
+    tail = i;
+  }
+
+  g->f->first->prev = tail;
+  tail->next = g->f->first;
+  g->f->first = head;
+}
+
+void x86_live_init(x86_live *s, size_t nodes) {
+  s->dense = malloc(sizeof(int) * (nodes ? nodes : 1));
+  s->sparse = calloc(nodes ? nodes : 1, sizeof(int));
+  assert(s->dense && s->sparse);
+  s->size = 0;
+}
+
+void x86_live_free(x86_live *s) {
+  free(s->dense);
+  free(s->sparse);
+}
+
+void x86_block_walk(x86_cfg *g, x86_block *b, x86_live *live,
+                    void (*fn)(x86_instr *i, x86_instr_nodes *n,
+                               x86_live *live, void *ctx),
+                    void *ctx) {
+  live->size = 0;
+  bitset_foreach(&b->live_out, idx) {
+    x86_live_add(live, g->live_nodes.data[idx]);
+  }
+
+  x86_instr_nodes in;
+  for (x86_instr *i = b->last;; i = i->prev) {
+    get_x86_instr_nodes(g, i, &in);
+    fn(i, &in, live, ctx);
+    for (int j = 0; j < in.ndefs; ++j)
+      x86_live_remove(live, in.defs[j]);
+    for (int j = 0; j < in.nuses; ++j)
+      x86_live_add(live, in.uses[j]);
+    if (i == b->first)
+      break;
+  }
+}
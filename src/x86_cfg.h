@@ -0,0 +1,163 @@
+#ifndef _ASCC_X86_CFG_H
+#define _ASCC_X86_CFG_H
+
+#include "bitset.h"
+#include "common.h"
+#include "dataflow.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+
+// Basic blocks and liveness over x86 instrs of one function, used by register
+// allocators. Values tracked are "nodes": allocatable hard regs come first
+// [0, X86_ALLOC_REGS), then non-static pseudos. Scratch regs (r10, r11, used
+// by fix_instructions_for_func) and rsp are never tracked.
+
+typedef struct _x86_cfg x86_cfg;
+typedef struct _x86_block x86_block;
+typedef struct _x86_live x86_live;
+
+#define X86_ALLOC_REGS 13
+// first ones of x86_alloc_regs are caller saved, rest must be saved by
+// function itself if it uses them
+#define X86_CALLER_SAVED_REGS 7
+
+// regs which can be given to pseudos, node i is x86_alloc_regs[i]
+extern const x86_reg x86_alloc_regs[X86_ALLOC_REGS];
+
+// amount of first regs of x86_alloc_regs allocators may use, %rbp (last one)
+// only without frame pointer
+int x86_usable_regs(x86_asm_gen *ag);
+
+struct _x86_block {
+  int idx;
+  x86_instr *first; // first instr of block
+  x86_instr *last;  // last instr of block (inclusive)
+
+  int_vec succs; // idxs of successor blocks
+  int_vec preds; // idxs of predecessor blocks
+
+  int loop_depth; // amount of loops block is nested in
+
+  // bitsets over live idxs [0, live_nodes.size)
+  bitset use;      // nodes read before being written in block
+  bitset def;      // nodes written in block
+  bitset live_in;  // nodes live at block entry
+  bitset live_out; // nodes live at block exit
+};
+
+struct _x86_cfg {
+  x86_func *f;
+  ht *bst;
+
+  VEC(x86_block) blocks; // blocks[0] is entry
+
+  size_t nodes;
+  ht *pseudo_node;     // pseudo name -> node + 1
+  VEC(string) pseudos; // node - X86_ALLOC_REGS -> pseudo name
+
+  // same trick as in cfg.h, only nodes which are read before written in some
+  // block can be live across blocks, so only they are kept in bitsets
+  int *live_idx;      // node -> live idx, -1 if node never leaves it's block
+  int_vec live_nodes; // live idx -> node
+
+  uint64_t *sets; // storage for all bitsets of blocks
+};
+
+// nodes read and written by instr, including implicit ones (e.g. idiv reads
+// and writes ax and dx, call clobbers all caller saved regs)
+#define X86_INSTR_MAX_NODES 16
+typedef struct {
+  int uses[X86_INSTR_MAX_NODES];
+  int defs[X86_INSTR_MAX_NODES];
+  int nuses;
+  int ndefs;
+} x86_instr_nodes;
+
+// explicit operand of instr
+typedef struct {
+  x86_op *op;
+  bool use;
+  bool def;
+} x86_op_ref;
+
+#define X86_INSTR_MAX_OPS 3
+
+// fills refs with explicit operands of instr, returns amount of them
+int x86_instr_ops(x86_instr *i, x86_op_ref refs[X86_INSTR_MAX_OPS]);
+
+// returns node of operand, -1 if operand is not tracked
+int x86_op_node(x86_cfg *g, x86_op *op);
+
+void get_x86_instr_nodes(x86_cfg *g, x86_instr *i, x86_instr_nodes *res);
+
+// splits instrs of function into basic blocks, links them and numbers nodes
+void build_x86_cfg(x86_cfg *g, x86_func *f, ht *bst);
+
+// computes live_in/live_out for each block of built cfg
+void analyze_x86_liveness(x86_cfg *g);
+
+// computes loop_depth for each block of built cfg
+void compute_x86_loop_depths(x86_cfg *g);
+
+// finds loops of built cfg, see df_find_loops, free with df_free_loops
+void find_x86_loops(x86_cfg *g, df_loop_vec *loops);
+
+void free_x86_cfg(x86_cfg *g);
+
+// condition which holds exactly when cc doesn't
+x86_cc x86_invert_cc(x86_cc cc);
+
+// unlinks instr from list of function
+void x86_remove_instr(x86_func *f, x86_instr *i);
+
+// true if upper half of reg is known to be zero before instr, i.e. reg was
+// last written by longword instr. Only stores to memory are skipped
+bool x86_upper_zero(x86_instr *i, x86_reg reg);
+
+// replaces pseudos by regs, `color` maps node to idx in x86_alloc_regs or -1
+// if pseudo stays in memory. Deletes moves which became mov %reg, %reg and
+// don't zero upper half of it
+void x86_apply_colors(x86_cfg *g, const int *color);
+
+// inserts table of pseudo names to regs at start of function (-fverbose-asm)
+void x86_emit_regs_layout(x86_asm_gen *ag, x86_cfg *g, const int *color);
+
+// Sparse set of nodes, O(1) insert/remove/test and iteration over members only
+struct _x86_live {
+  int *dense;  // members
+  int *sparse; // node -> position in dense
+  size_t size;
+};
+
+void x86_live_init(x86_live *s, size_t nodes);
+void x86_live_free(x86_live *s);
+
+static inline bool x86_live_has(x86_live *s, int n) {
+  size_t p = s->sparse[n];
+  return p < s->size && s->dense[p] == n;
+}
+
+static inline void x86_live_add(x86_live *s, int n) {
+  if (x86_live_has(s, n))
+    return;
+  s->sparse[n] = s->size;
+  s->dense[s->size++] = n;
+}
+
+static inline void x86_live_remove(x86_live *s, int n) {
+  if (!x86_live_has(s, n))
+    return;
+  int last = s->dense[--s->size];
+  s->dense[s->sparse[n]] = last;
+  s->sparse[last] = s->sparse[n];
+}
+
+// calls fn for each instr of block from last to first, `live` holds nodes live
+// right after instr. `live` is reused storage, it's contents are replaced
+void x86_block_walk(x86_cfg *g, x86_block *b, x86_live *live,
+                    void (*fn)(x86_instr *i, x86_instr_nodes *n,
+                               x86_live *live, void *ctx),
+                    void *ctx);
+
+#endif
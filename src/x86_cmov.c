@@ -0,0 +1,424 @@
+#include "bitset.h"
+#include "common.h"
+#include "strings.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// If conversion of short branches which only select value, run before register
+// allocation. Ternaries and if/else assigning one var are both lowered to
+//
+//   cmp X, Y; jcc else; T; mov a, d; jmp end; else: E; mov b, d; end:
+//
+// or, without else arm, to `cmp X, Y; jcc end; T; mov a, d; end:`. Instrs of
+// arms T and E are moved above cmp and select is done by
+// `mov a, d; cmovcc b, d` (`cmov!cc a, d` without else arm), so data dependent
+// conditions can't be mispredicted. Arm which computes into d itself (e.g.
+// `mov x, d; shr $1, d`) computes into new pseudo instead and gets final mov.
+//
+// Arms are executed always then, so only few cheap instrs which can't fault
+// (no div) are allowed. Nodes they write mustn't be live at start of other arm
+// (or at end without else arm), mustn't be read by cmp and mustn't be written
+// by both arms. Writes to statics are never moved. Nested selects are
+// converted from inside out in next round.
+
+#define CMOV_MAX_ARM 6 // instrs of arm, without final mov
+#define CMOV_MAX_ROUNDS 4
+
+typedef struct {
+  x86_asm_gen *ag;
+  x86_cfg g;
+  int *label_block; // label -> idx of block it starts, -1 if none
+  int max_label;
+  bitset defs_t; // nodes written by then arm, before its final mov
+  bitset defs_e; // same for else arm
+} cmov_ctx;
+
+static struct {
+  int diamonds;
+  int triangles;
+} stats;
+
+static int pseudo_counter = 0; // for names of new pseudos
+
+// defined in x86.c
+x86_instr *alloc_x86_instr(x86_asm_gen *ag, int op);
+
+static bool op_eq(x86_op *a, x86_op *b) {
+  if (a->t != b->t)
+    return false;
+  switch (a->t) {
+  case X86_OP_IMM:
+    return a->v.imm == b->v.imm;
+  case X86_OP_REG:
+    return a->v.reg == b->v.reg;
+  case X86_OP_PSEUDO:
+    return !strcmp(a->v.pseudo, b->v.pseudo);
+  default:
+    return false;
+  }
+}
+
+static x86_instr *skip_comments(x86_instr *i) {
+  while (i != NULL && i->op == X86_COMMENT)
+    i = i->next;
+  return i;
+}
+
+// ops which can't fault and write nothing but their nodes and flags
+static bool is_cheap(x86_instr *i) {
+  switch (i->op) {
+  case X86_MOV:
+  case X86_MOVSX:
+  case X86_MOVZEXT:
+  case X86_ADD:
+  case X86_SUB:
+  case X86_MULT:
+  case X86_AND:
+  case X86_OR:
+  case X86_XOR:
+  case X86_SHL:
+  case X86_SHR:
+  case X86_SAR:
+  case X86_NOT:
+  case X86_NEG:
+  case X86_INC:
+  case X86_DEC:
+  case X86_LEA:
+  case X86_CMP:
+  case X86_CDQ:
+  case X86_SETCC:
+  case X86_CMOV:
+  case X86_COMMENT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+typedef struct {
+  x86_instr *first; // first instr of arm
+  x86_instr *last;  // last instr of arm, writes d
+  x86_instr *mov;   // final `mov a, d`, set by finish_arm
+  x86_op dst;       // d
+  x86_asm_type type;
+  bool rename; // last isn't mov, d is renamed in arm and mov is added
+  bitset *defs; // nodes written in arm, without d if renamed and final mov
+} arm;
+
+// arm starts at i and runs up to first label or jump. Returns instr after it,
+// NULL if arm can't be converted
+static x86_instr *scan_arm(cmov_ctx *c, x86_instr *i, arm *a, bitset *defs) {
+  a->first = i;
+  a->last = a->mov = NULL;
+  a->defs = defs;
+  bitset_clear(defs);
+  int n = 0;
+  for (; i != NULL && i->op != X86_LABEL && i->op != X86_JMP; i = i->next) {
+    if (!is_cheap(i) || (i->op != X86_COMMENT && ++n > CMOV_MAX_ARM + 1))
+      return NULL;
+    if (i->op != X86_COMMENT)
+      a->last = i;
+  }
+  if (a->last == NULL)
+    return NULL;
+
+  x86_op_ref refs[X86_INSTR_MAX_OPS];
+  a->rename = a->last->op != X86_MOV;
+  if (!a->rename) {
+    a->dst = a->last->v.binary.dst;
+    a->type = a->last->v.binary.type;
+  } else {
+    int nops = x86_instr_ops(a->last, refs), ndefs = 0;
+    for (int k = 0; k < nops; ++k)
+      if (refs[k].def) {
+        a->dst = *refs[k].op;
+        ++ndefs;
+      }
+    if (ndefs != 1 || a->dst.t != X86_OP_PSEUDO || a->last->op == X86_SETCC)
+      return NULL;
+    be_syme *e = ht_get(c->g.bst, a->dst.v.pseudo);
+    a->type = e->v.obj.type;
+  }
+  int d = x86_op_node(&c->g, &a->dst);
+  if (a->type == X86_BYTE || d < 0)
+    return NULL;
+
+  x86_instr_nodes in;
+  x86_instr *stop = a->rename ? a->last->next : a->last;
+  for (x86_instr *j = a->first; j != stop; j = j->next) {
+    // writes to statics aren't tracked
+    int nops = x86_instr_ops(j, refs);
+    for (int k = 0; k < nops; ++k)
+      if (refs[k].def && x86_op_node(&c->g, refs[k].op) < 0)
+        return NULL;
+    get_x86_instr_nodes(&c->g, j, &in);
+    for (int k = 0; k < in.ndefs; ++k)
+      if (!a->rename || in.defs[k] != d)
+        bitset_set(defs, in.defs[k]);
+  }
+  return i;
+}
+
+static x86_instr *new_mov(cmov_ctx *c, x86_instr *at, x86_op src, x86_op dst,
+                          x86_asm_type type) {
+  x86_instr *mov = alloc_x86_instr(c->ag, X86_MOV);
+  mov->v.binary.src = src;
+  mov->v.binary.dst = dst;
+  mov->v.binary.type = type;
+  mov->origin = at->origin;
+  return mov;
+}
+
+static void insert_before(x86_func *f, x86_instr *at, x86_instr *i) {
+  i->prev = at->prev;
+  i->next = at;
+  if (at->prev != NULL)
+    at->prev->next = i;
+  else
+    f->first = i;
+  at->prev = i;
+}
+
+static void insert_after(x86_instr *at, x86_instr *i) {
+  i->prev = at;
+  i->next = at->next;
+  if (at->next != NULL)
+    at->next->prev = i;
+  at->next = i;
+}
+
+// renames d of arm to new pseudo r, which is copied to d at end of arm. If
+// arm reads d before writing it, r starts as copy of d
+static void finish_arm(cmov_ctx *c, arm *a) {
+  if (!a->rename) {
+    a->mov = a->last;
+    return;
+  }
+
+  be_syme *e = ARENA_ALLOC_OBJ(c->ag->be_syme_arena, be_syme);
+  e->t = BE_SYME_OBJ;
+  e->v.obj.type = a->type;
+  e->v.obj.is_static = false;
+  x86_op r;
+  r.t = X86_OP_PSEUDO;
+  r.v.pseudo = string_sprintf("cmov.%d", ++pseudo_counter);
+  ht_set(c->g.bst, r.v.pseudo, e);
+
+  // d is read first if instr which mentions it first reads it
+  bool seen = false, read_first = false;
+  x86_op_ref refs[X86_INSTR_MAX_OPS];
+  for (x86_instr *i = a->first;; i = i->next) {
+    int nops = x86_instr_ops(i, refs);
+    bool hit = false;
+    for (int k = 0; k < nops; ++k) {
+      if (!op_eq(refs[k].op, &a->dst))
+        continue;
+      read_first |= !seen && refs[k].use;
+      hit = true;
+      *refs[k].op = r;
+    }
+    seen |= hit;
+    if (i == a->last)
+      break;
+  }
+
+  if (read_first) {
+    x86_instr *init = new_mov(c, a->first, a->dst, r, a->type);
+    insert_before(c->g.f, a->first, init);
+    a->first = init;
+  }
+  a->mov = new_mov(c, a->last, r, a->dst, a->type);
+  insert_after(a->last, a->mov);
+}
+
+static bool live_in(cmov_ctx *c, int block, int node) {
+  int idx = c->g.live_idx[node];
+  return idx >= 0 && bitset_test(&c->g.blocks.data[block].live_in, idx);
+}
+
+// true if none of defs is live at start of block
+static bool dead_at(cmov_ctx *c, bitset *defs, int block) {
+  bitset_foreach(defs, node) {
+    if (live_in(c, block, node))
+      return false;
+  }
+  return true;
+}
+
+static bool reads_def(cmov_ctx *c, x86_instr *i, bitset *defs) {
+  x86_instr_nodes in;
+  get_x86_instr_nodes(&c->g, i, &in);
+  for (int k = 0; k < in.nuses; ++k)
+    if (bitset_test(defs, in.uses[k]))
+      return true;
+  return false;
+}
+
+static bool disjoint(bitset *a, bitset *b) {
+  for (size_t w = 0; w < a->words; ++w)
+    if (a->w[w] & b->w[w])
+      return false;
+  return true;
+}
+
+// moves instrs of arm before its final mov to right before instr at
+static void hoist(x86_func *f, arm *a, x86_instr *at) {
+  for (x86_instr *i = a->first; i != a->mov;) {
+    x86_instr *next = i->next;
+    x86_remove_instr(f, i);
+    insert_before(f, at, i);
+    i = next;
+  }
+}
+
+static void make_cmov(x86_instr *i, x86_cc cc) {
+  x86_op src = i->v.binary.src, dst = i->v.binary.dst;
+  x86_asm_type type = i->v.binary.type;
+  i->op = X86_CMOV;
+  i->v.cmov.cc = cc;
+  i->v.cmov.src = src;
+  i->v.cmov.dst = dst;
+  i->v.cmov.type = type;
+}
+
+// label is dropped if only converted code jumped to it
+static void drop_label(cmov_ctx *c, x86_instr *label, size_t preds) {
+  int b = c->label_block[label->v.label];
+  if (c->g.blocks.data[b].preds.size == preds)
+    x86_remove_instr(c->g.f, label);
+}
+
+// j is last instr of block jb. Returns true if code was converted
+static bool convert(cmov_ctx *c, int jb) {
+  x86_instr *j = c->g.blocks.data[jb].last;
+  x86_instr *cmp = j->prev;
+  while (cmp != NULL && cmp->op == X86_COMMENT)
+    cmp = cmp->prev;
+  if (j->op != X86_JMPCC || cmp == NULL || cmp->op != X86_CMP ||
+      (size_t)jb + 1 >= c->g.blocks.size)
+    return false;
+  int target = j->v.jmpcc.label_idx;
+  int tb = jb + 1, eb = c->label_block[target];
+
+  arm t;
+  x86_instr *after = scan_arm(c, j->next, &t, &c->defs_t);
+  if (after == NULL || reads_def(c, cmp, t.defs))
+    return false;
+
+  // without else arm
+  x86_instr *label = skip_comments(after);
+  if (label != NULL && label->op == X86_LABEL && label->v.label == target) {
+    if (!dead_at(c, t.defs, eb))
+      return false;
+    finish_arm(c, &t);
+    hoist(c->g.f, &t, cmp);
+    make_cmov(t.mov, x86_invert_cc(j->v.jmpcc.cc));
+    x86_remove_instr(c->g.f, j);
+    drop_label(c, label, 2);
+    ++stats.triangles;
+    return true;
+  }
+
+  // jmp end; else: E; end:
+  x86_instr *jmp = after;
+  if (jmp == NULL || jmp->op != X86_JMP)
+    return false;
+  x86_instr *else_label = skip_comments(jmp->next);
+  if (else_label == NULL || else_label->op != X86_LABEL ||
+      else_label->v.label != target || c->g.blocks.data[eb].preds.size != 1)
+    return false;
+
+  arm e;
+  x86_instr *end = scan_arm(c, else_label->next, &e, &c->defs_e);
+  if (end == NULL)
+    return false;
+  end = skip_comments(end);
+  if (end == NULL || end->op != X86_LABEL || end->v.label != jmp->v.label)
+    return false;
+
+  if (t.type != e.type || !op_eq(&t.dst, &e.dst) ||
+      reads_def(c, cmp, e.defs) || !disjoint(t.defs, e.defs) ||
+      !dead_at(c, t.defs, eb) || !dead_at(c, e.defs, tb))
+    return false;
+
+  // d = cc ? b : a
+  finish_arm(c, &t);
+  finish_arm(c, &e);
+  x86_instr *mt = t.mov, *me = e.mov;
+  x86_cc cc = j->v.jmpcc.cc;
+  x86_op *a = &mt->v.binary.src, *b = &me->v.binary.src;
+  x86_op *d = &mt->v.binary.dst;
+  hoist(c->g.f, &t, cmp);
+  hoist(c->g.f, &e, cmp);
+  x86_remove_instr(c->g.f, j);
+  x86_remove_instr(c->g.f, jmp);
+  x86_remove_instr(c->g.f, else_label);
+  if (op_eq(b, d)) {
+    // else arm keeps d
+    x86_remove_instr(c->g.f, me);
+    make_cmov(mt, x86_invert_cc(cc));
+  } else if (op_eq(a, b)) {
+    // both arms select same value
+    x86_remove_instr(c->g.f, mt);
+  } else if (op_eq(a, d)) {
+    x86_remove_instr(c->g.f, mt);
+    make_cmov(me, cc);
+  } else {
+    make_cmov(me, cc);
+  }
+  drop_label(c, end, 2);
+  ++stats.diamonds;
+  return true;
+}
+
+static bool convert_round(cmov_ctx *c) {
+  x86_cfg *g = &c->g;
+  c->max_label = 0;
+  for (x86_instr *i = g->f->first; i != NULL; i = i->next)
+    if (i->op == X86_LABEL && i->v.label > c->max_label)
+      c->max_label = i->v.label;
+  c->label_block = malloc(sizeof(int) * (c->max_label + 1));
+  assert(c->label_block);
+  memset(c->label_block, -1, sizeof(int) * (c->max_label + 1));
+  for (size_t b = 0; b < g->blocks.size; ++b)
+    if (g->blocks.data[b].first->op == X86_LABEL)
+      c->label_block[g->blocks.data[b].first->v.label] = b;
+
+  bitset_init(&c->defs_t, g->nodes);
+  bitset_init(&c->defs_e, g->nodes);
+
+  // converted code is only moved within its blocks and later blocks are
+  // untouched, liveness of them stays valid
+  bool changed = false;
+  for (size_t b = 0; b < g->blocks.size; ++b)
+    changed |= convert(c, b);
+
+  bitset_free(&c->defs_t);
+  bitset_free(&c->defs_e);
+  free(c->label_block);
+  return changed;
+}
+
+void cmov_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  for (int round = 0; round < CMOV_MAX_ROUNDS; ++round) {
+    cmov_ctx c;
+    c.ag = ag;
+    build_x86_cfg(&c.g, f, bst);
+    analyze_x86_liveness(&c.g);
+    bool changed = convert_round(&c);
+    free_x86_cfg(&c.g);
+    if (!changed)
+      break;
+  }
+}
+
+void print_cmov_stats(void) {
+  fprintf(stderr, "cmov             diamonds %d\n", stats.diamonds);
+  fprintf(stderr, "cmov             triangles %d\n", stats.triangles);
+}
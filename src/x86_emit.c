@@ -63,6 +63,24 @@ static void emit_x86_reg(FILE *w, x86_reg reg, x86_asm_type t) {
     case X86_R11:
       fprintf(w, "%%r11");
       return;
+    case X86_BX:
+      fprintf(w, "%%rbx");
+      return;
+    case X86_R12:
+      fprintf(w, "%%r12");
+      return;
+    case X86_R13:
+      fprintf(w, "%%r13");
+      return;
+    case X86_R14:
+      fprintf(w, "%%r14");
+      return;
+    case X86_R15:
+      fprintf(w, "%%r15");
+      return;
+    case X86_BP:
+      fprintf(w, "%%rbp");
+      return;
     case X86_SP:
       fprintf(w, "%%rsp");
       return;
@@ -98,6 +116,24 @@ static void emit_x86_reg(FILE *w, x86_reg reg, x86_asm_type t) {
     case X86_R11:
       fprintf(w, "%%r11d");
       return;
+    case X86_BX:
+      fprintf(w, "%%ebx");
+      return;
+    case X86_R12:
+      fprintf(w, "%%r12d");
+      return;
+    case X86_R13:
+      fprintf(w, "%%r13d");
+      return;
+    case X86_R14:
+      fprintf(w, "%%r14d");
+      return;
+    case X86_R15:
+      fprintf(w, "%%r15d");
+      return;
+    case X86_BP:
+      fprintf(w, "%%ebp");
+      return;
     case X86_SP:
       fprintf(w, "%%esp");
       return;
@@ -134,6 +170,24 @@ static void emit_x86_reg(FILE *w, x86_reg reg, x86_asm_type t) {
     case X86_R11:
       fprintf(w, "%%r11b");
       return;
+    case X86_BX:
+      fprintf(w, "%%bl");
+      return;
+    case X86_R12:
+      fprintf(w, "%%r12b");
+      return;
+    case X86_R13:
+      fprintf(w, "%%r13b");
+      return;
+    case X86_R14:
+      fprintf(w, "%%r14b");
+      return;
+    case X86_R15:
+      fprintf(w, "%%r15b");
+      return;
+    case X86_BP:
+      fprintf(w, "%%bpl");
+      return;
     case X86_SP:
       fprintf(w, "%%spl");
       return;
@@ -146,14 +200,15 @@ static void emit_x86_reg(FILE *w, x86_reg reg, x86_asm_type t) {
 }
 
 static taci *last_origin = NULL;
+static bool verbose_asm = false; // of program being emitted
+static x86_func *func = NULL;    // being emitted
 
 static void emit_origin(FILE *w, x86_instr *i) {
-  if (i->origin == NULL) {
+  if (i->origin == NULL || !verbose_asm) {
     fprintf(w, "\n");
     return;
   }
   fprintf(w, "\t");
-#ifdef PRINT_TAC_ORIGIN_X86
 #ifdef PRINT_TAC_ORIGIN_X86_ONE_TIME
   if (i->origin != last_origin) {
     fprintf(w, "\n");
@@ -164,7 +219,6 @@ static void emit_origin(FILE *w, x86_instr *i) {
 #else
   fprintf(w, "# ");
   fprint_taci(w, i->origin);
-#endif
 #endif
   fprintf(w, "\n");
 }
@@ -181,7 +235,9 @@ static void emit_x86_op(FILE *w, x86_op op, x86_asm_type t) {
     fprintf(w, "PSEUDO(%s)", op.v.pseudo);
     break;
   case X86_OP_STACK:
-    if (op.v.stack_offset > 0)
+    if (func->omit_frame_pointer)
+      fprintf(w, "%d(%%rsp)", func->stack_alloc - 8 - op.v.stack_offset);
+    else if (op.v.stack_offset > 0)
       fprintf(w, "-%d(%%rbp)", op.v.stack_offset);
     else
       fprintf(w, "%d(%%rbp)", -op.v.stack_offset);
@@ -189,6 +245,9 @@ static void emit_x86_op(FILE *w, x86_op op, x86_asm_type t) {
   case X86_OP_DATA:
     fprintf(w, "%s(%%rip)", op.v.data);
     break;
+  case X86_OP_ARG:
+    fprintf(w, "%d(%%rsp)", op.v.arg_offset);
+    break;
   }
 }
 
@@ -245,13 +304,66 @@ static const char *cc_code(x86_cc cc) {
   UNREACHABLE();
 }
 
+// idx is zero extended into r10, table holds offsets of labels from table
+// itself, so it needs no relocations. Tables are emitted after function
+static void emit_x86_jmp_table(FILE *w, x86_instr *i) {
+  SMART_EMIT_ORIGIN({
+    fprintf(w, "\tmov%c ", get_suff(i->v.jtab.type));
+    emit_x86_op(w, i->v.jtab.idx, i->v.jtab.type);
+    fprintf(w, ", ");
+    emit_x86_reg(w, X86_R10, i->v.jtab.type);
+    fprintf(w, "\n\tleaq .L%d(%%rip), %%r11\n", i->v.jtab.table_label);
+    fprintf(w, "\tmovslq (%%r11,%%r10,4), %%r10\n");
+    fprintf(w, "\taddq %%r11, %%r10\n");
+    fprintf(w, "\tjmp *%%r10");
+  });
+}
+
+static void emit_x86_jmp_tables(FILE *w, x86_func *f) {
+  bool any = false;
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    if (i->op != X86_JMP_TABLE)
+      continue;
+    if (!any)
+      fprintf(w, "\n\t.section .rodata\n");
+    any = true;
+
+    fprintf(w, "\t.balign 4\n");
+    fprintf(w, ".L%d:\n", i->v.jtab.table_label);
+    for (size_t j = 0; j < i->v.jtab.labels_len; ++j)
+      fprintf(w, "\t.long .L%d-.L%d\n", i->v.jtab.labels[j],
+              i->v.jtab.table_label);
+  }
+  if (any)
+    fprintf(w, "\t.text\n");
+}
+
+// frees frame, %rsp points to return address after it
+static void emit_x86_epilogue(FILE *w) {
+  fprintf(w, "\n");
+  if (func->omit_frame_pointer) {
+    if (func->stack_alloc != 0)
+      fprintf(w, "\taddq $%d, %%rsp\n", func->stack_alloc);
+    return;
+  }
+  if (func->stack_alloc != 0)
+    fprintf(w, "\tmovq %%rbp, %%rsp\n");
+  fprintf(w, "\tpopq %%rbp\n");
+}
+
 static void emit_x86_instr(FILE *w, x86_instr *i) {
   switch (i->op) {
   case X86_RET:
-    fprintf(w, "\n\tmovq %%rbp, %%rsp\n");
-    fprintf(w, "\tpopq %%rbp\n");
+    emit_x86_epilogue(w);
     fprintf(w, "\tret\n");
     break;
+  case X86_TAIL_CALL:
+    emit_x86_epilogue(w);
+    if (i->v.call.plt)
+      SMART_EMIT_ORIGIN(fprintf(w, "\tjmp %s@plt\n", i->v.call.str_label););
+    else
+      SMART_EMIT_ORIGIN(fprintf(w, "\tjmp %s\n", i->v.call.str_label););
+    break;
   case X86_MOV:
     emit_x86_binary(w, i, "mov");
     break;
@@ -285,6 +397,9 @@ static void emit_x86_instr(FILE *w, x86_instr *i) {
   case X86_CMP:
     emit_x86_binary(w, i, "cmp");
     break;
+  case X86_TEST:
+    emit_x86_binary(w, i, "test");
+    break;
   case X86_NOT:
     emit_x86_unary(w, i, "not");
     break;
@@ -297,15 +412,18 @@ static void emit_x86_instr(FILE *w, x86_instr *i) {
   case X86_DIV:
     emit_x86_unary(w, i, "div");
     break;
+  case X86_IMUL_WIDE:
+    emit_x86_unary(w, i, "imul");
+    break;
+  case X86_MUL_WIDE:
+    emit_x86_unary(w, i, "mul");
+    break;
   case X86_INC:
     emit_x86_unary(w, i, "inc");
     break;
   case X86_DEC:
     emit_x86_unary(w, i, "dec");
     break;
-  case X86_PUSH:
-    emit_x86_unary(w, i, "push");
-    break;
   case X86_CDQ:
     SMART_EMIT_ORIGIN(
         fprintf(w, "\t%s", i->v.cdq.type == X86_QUADWORD ? "cqo" : "cdq"););
@@ -320,14 +438,47 @@ static void emit_x86_instr(FILE *w, x86_instr *i) {
     break;
   case X86_SETCC:
     SMART_EMIT_ORIGIN(fprintf(w, "\tset%s ", cc_code(i->v.setcc.cc));
-                      emit_x86_op(w, i->v.setcc.op, 1););
+                      emit_x86_op(w, i->v.setcc.op, X86_BYTE););
+    break;
+  case X86_CMOV:
+    // size is taken from dst reg
+    SMART_EMIT_ORIGIN({
+      fprintf(w, "\tcmov%s ", cc_code(i->v.cmov.cc));
+      emit_x86_op(w, i->v.cmov.src, i->v.cmov.type);
+      fprintf(w, ", ");
+      emit_x86_op(w, i->v.cmov.dst, i->v.cmov.type);
+    });
     break;
   case X86_LABEL:
     SMART_EMIT_ORIGIN(fprintf(w, "\t.L%d:", i->v.label););
     break;
+  case X86_ALIGN:
+    // to 16 bytes, unless it takes more than 10 bytes of padding
+    SMART_EMIT_ORIGIN(fprintf(w, "\t.p2align 4,,10"););
+    break;
   case X86_COMMENT:
     fprintf(w, "\t#%s\n", i->v.comment);
     break;
+  case X86_JMP_TABLE:
+    emit_x86_jmp_table(w, i);
+    break;
+  case X86_LEA:
+    // address is computed in 64 bits, low half of it is same
+    SMART_EMIT_ORIGIN({
+      fprintf(w, "\tlea%c ", get_suff(i->v.lea.type));
+      if (i->v.lea.disp != 0)
+        fprintf(w, "%d", i->v.lea.disp);
+      fprintf(w, "(");
+      emit_x86_op(w, i->v.lea.base, X86_QUADWORD);
+      if (i->v.lea.scale != 0) {
+        fprintf(w, ", ");
+        emit_x86_op(w, i->v.lea.index, X86_QUADWORD);
+        fprintf(w, ", %d", i->v.lea.scale);
+      }
+      fprintf(w, "), ");
+      emit_x86_op(w, i->v.lea.dst, i->v.lea.type);
+    });
+    break;
   case X86_CALL:
     if (i->v.call.plt)
       SMART_EMIT_ORIGIN(fprintf(w, "\tcall %s@plt\n", i->v.call.str_label););
@@ -355,19 +506,28 @@ static void emit_x86_global(FILE *w, bool global, string name) {
 }
 
 static void emit_x86_func(FILE *w, x86_func *f) {
-  fprintf(w, "# Start of function %s\n", f->name);
+  func = f;
+  if (verbose_asm)
+    fprintf(w, "# Start of function %s\n", f->name);
   emit_x86_global(w, f->global, f->name);
   fprintf(w, "\t.text\n");
   fprintf(w, "%s:\n", f->name);
-  fprintf(w, "\t# func prologue \n");
-  fprintf(w, "\tpushq %%rbp\n");
-  fprintf(w, "\tmovq %%rsp, %%rbp\n\n");
+  // frame itself is allocated by first instr of function, if it's needed
+  if (!f->omit_frame_pointer) {
+    if (verbose_asm)
+      fprintf(w, "\t# func prologue \n");
+    fprintf(w, "\tpushq %%rbp\n");
+    fprintf(w, "\tmovq %%rsp, %%rbp\n\n");
+  }
 
   for (x86_instr *i = f->first; i != NULL; i = i->next) {
     emit_x86_instr(w, i);
   }
+  emit_x86_jmp_tables(w, f);
 
-  fprintf(w, "# End of function %s\n\n", f->name);
+  if (verbose_asm)
+    fprintf(w, "# End of function %s\n", f->name);
+  fprintf(w, "\n");
 }
 
 static void emit_x86_static_var(FILE *w, x86_static_var *sv) {
@@ -401,6 +561,8 @@ static void emit_x86_static_var(FILE *w, x86_static_var *sv) {
 }
 
 void emit_x86(FILE *w, x86_program *prog) {
+  verbose_asm = prog->verbose_asm;
+  last_origin = NULL;
   for (x86_top_level *tl = prog->first; tl != NULL; tl = tl->next)
     if (tl->is_func)
       emit_x86_func(w, &tl->v.f);
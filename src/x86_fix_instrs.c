@@ -5,7 +5,9 @@
 #include <stdint.h>
 #include <stdio.h>
 
-static bool is_mem(int t) { return t == X86_OP_STACK || t == X86_OP_DATA; }
+static bool is_mem(int t) {
+  return t == X86_OP_STACK || t == X86_OP_DATA || t == X86_OP_ARG;
+}
 
 static void fix_instr(x86_asm_gen *ag, x86_instr *i);
 
@@ -65,16 +67,6 @@ static void insert_after_x86_instr(x86_asm_gen *ag, x86_instr *i,
   i->next = new;
 }
 
-static void fix_unary_too_big_const(x86_asm_gen *ag, x86_instr *i) {
-  if (i->v.unary.src.t == X86_OP_IMM && i->v.unary.src.v.imm > INT32_MAX) {
-    x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
-    mov->v.binary.src = i->v.unary.src;
-    i->v.unary.src = mov->v.binary.dst = new_r10();
-    mov->v.binary.type = i->v.unary.type;
-    insert_before_x86_instr(ag, i, mov);
-  }
-}
-
 static void fix_binary_too_big_const(x86_asm_gen *ag, x86_instr *i) {
   if (i->v.binary.src.t == X86_OP_IMM && i->v.binary.src.v.imm > INT32_MAX) {
     x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
@@ -97,8 +89,10 @@ static void fix_both_ops_mem(x86_asm_gen *ag, x86_instr *i) {
   }
 }
 
+// also for one operand mul, which can't take imm either
 static void fix_div(x86_asm_gen *ag, x86_instr *i) {
-  assert(i->op == X86_IDIV || i->op == X86_DIV);
+  assert(i->op == X86_IDIV || i->op == X86_DIV || i->op == X86_IMUL_WIDE ||
+         i->op == X86_MUL_WIDE);
 
   if (i->v.unary.src.t == X86_OP_IMM) {
     x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
@@ -222,6 +216,58 @@ static void fix_movzext(x86_asm_gen *ag, x86_instr *i) {
   }
 }
 
+// address regs of lea can only be regs, same for dst
+static void fix_lea(x86_asm_gen *ag, x86_instr *i) {
+  x86_op *addr[2] = {&i->v.lea.base, &i->v.lea.index};
+  x86_op scratch[2] = {new_r10(), new_r11()};
+  for (int j = 0; j < (i->v.lea.scale != 0 ? 2 : 1); ++j) {
+    if (addr[j]->t == X86_OP_REG)
+      continue;
+    x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
+    mov->v.binary.src = *addr[j];
+    mov->v.binary.dst = scratch[j];
+    mov->v.binary.type = i->v.lea.type;
+    insert_before_x86_instr(ag, i, mov);
+    *addr[j] = scratch[j];
+  }
+
+  if (i->v.lea.dst.t != X86_OP_REG) {
+    x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
+    mov->v.binary.src = new_r10();
+    mov->v.binary.dst = i->v.lea.dst;
+    mov->v.binary.type = i->v.lea.type;
+    i->v.lea.dst = new_r10();
+    insert_after_x86_instr(ag, i, mov);
+  }
+}
+
+// src can't be immediate, dst must be reg. Movs around don't touch flags
+static void fix_cmov(x86_asm_gen *ag, x86_instr *i) {
+  if (i->v.cmov.src.t == X86_OP_IMM) {
+    x86_instr *mov = alloc_x86_instr(ag, X86_MOV);
+    mov->v.binary.src = i->v.cmov.src;
+    mov->v.binary.dst = new_r10();
+    mov->v.binary.type = i->v.cmov.type;
+    insert_before_x86_instr(ag, i, mov);
+    i->v.cmov.src = new_r10();
+  }
+
+  if (i->v.cmov.dst.t != X86_OP_REG) {
+    x86_instr *load = alloc_x86_instr(ag, X86_MOV);
+    load->v.binary.src = i->v.cmov.dst;
+    load->v.binary.dst = new_r11();
+    load->v.binary.type = i->v.cmov.type;
+    insert_before_x86_instr(ag, i, load);
+
+    x86_instr *store = alloc_x86_instr(ag, X86_MOV);
+    store->v.binary.src = new_r11();
+    store->v.binary.dst = i->v.cmov.dst;
+    store->v.binary.type = i->v.cmov.type;
+    i->v.cmov.dst = new_r11();
+    insert_after_x86_instr(ag, i, store);
+  }
+}
+
 static void fix_instr(x86_asm_gen *ag, x86_instr *i) {
   switch (i->op) {
   case X86_RET:
@@ -232,13 +278,19 @@ static void fix_instr(x86_asm_gen *ag, x86_instr *i) {
   case X86_JMPCC:
   case X86_SETCC:
   case X86_LABEL:
+  case X86_ALIGN:
   case X86_COMMENT:
   case X86_INC:
   case X86_DEC:
   case X86_CALL:
+  case X86_TAIL_CALL:
+  case X86_JMP_TABLE:
+    break;
+  case X86_LEA:
+    fix_lea(ag, i);
     break;
-  case X86_PUSH:
-    fix_unary_too_big_const(ag, i);
+  case X86_CMOV:
+    fix_cmov(ag, i);
     break;
   case X86_ADD:
   case X86_SUB:
@@ -255,6 +307,8 @@ static void fix_instr(x86_asm_gen *ag, x86_instr *i) {
     break;
   case X86_IDIV:
   case X86_DIV:
+  case X86_IMUL_WIDE:
+  case X86_MUL_WIDE:
     fix_div(ag, i);
     break;
   case X86_MULT:
@@ -266,6 +320,7 @@ static void fix_instr(x86_asm_gen *ag, x86_instr *i) {
     fix_shifts(ag, i);
     break;
   case X86_CMP:
+  case X86_TEST:
     fix_cmp(ag, i);
     break;
   case X86_MOVSX:
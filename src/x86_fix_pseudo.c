@@ -5,18 +5,24 @@
 #include "table.h"
 #include "typecheck.h"
 #include "x86.h"
+#include "x86_cfg.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+// bytes below %rsp which leaf function may use without allocating them (abi)
+#define RED_ZONE 128
 
 static int max_offset = 0;
 static int offset = 0;
+static int hole = 0; // offset of longword left free by alignment, 0 if none
 static ht *offset_table;
+static ht *statics; // static vars referenced by func, only for -fverbose-asm
 
 // defined in x86.c
 x86_instr *alloc_x86_instr(x86_asm_gen *ag, int op);
 
-// TODO: register allocation, graph coloring etc.
 static void fix_pseudo_op(x86_op *op, ht *bst) {
   if (op->t != X86_OP_PSEUDO)
     return;
@@ -26,6 +32,8 @@ static void fix_pseudo_op(x86_op *op, ht *bst) {
   if (be->v.obj.is_static) {
     op->t = X86_OP_DATA;
     op->v.data = op->v.pseudo;
+    if (statics != NULL)
+      ht_set(statics, op->v.data, (void *)1);
     return;
   }
 
@@ -38,13 +46,21 @@ static void fix_pseudo_op(x86_op *op, ht *bst) {
       max_offset = d;
     op->v.stack_offset = d;
   } else {
+    int d = 0;
     switch (be->v.obj.type) {
     case X86_LONGWORD:
-      offset += 4;
+      if (hole != 0) {
+        d = hole;
+        hole = 0;
+        break;
+      }
+      d = offset += 4;
       break;
     case X86_QUADWORD:
+      if (offset % 8 != 0)
+        hole = offset + 4;
       offset += 8;
-      offset = (offset + 7) & ~7; // align to 8
+      d = offset = (offset + 7) & ~7; // align to 8
       break;
     case X86_BYTE:
       UNREACHABLE();
@@ -52,9 +68,9 @@ static void fix_pseudo_op(x86_op *op, ht *bst) {
     }
     if (offset > max_offset)
       max_offset = offset;
-    ht_set(offset_table, op->v.pseudo, (void *)(intptr_t)offset);
+    ht_set(offset_table, op->v.pseudo, (void *)(intptr_t)d);
 
-    op->v.stack_offset = offset;
+    op->v.stack_offset = d;
   }
 
   if (op->v.stack_offset > max_offset)
@@ -67,9 +83,10 @@ static void fix_pseudo_for_instr(x86_instr *i, ht *bst) {
   case X86_NEG:
   case X86_IDIV:
   case X86_DIV:
+  case X86_IMUL_WIDE:
+  case X86_MUL_WIDE:
   case X86_INC:
   case X86_DEC:
-  case X86_PUSH:
     fix_pseudo_op(&i->v.unary.src, bst);
     break;
   case X86_MOV:
@@ -84,6 +101,7 @@ static void fix_pseudo_for_instr(x86_instr *i, ht *bst) {
   case X86_SAR:
   case X86_SHR:
   case X86_CMP:
+  case X86_TEST:
   case X86_MOVSX:
     fix_pseudo_op(&i->v.binary.src, bst);
     fix_pseudo_op(&i->v.binary.dst, bst);
@@ -91,97 +109,151 @@ static void fix_pseudo_for_instr(x86_instr *i, ht *bst) {
   case X86_SETCC:
     fix_pseudo_op(&i->v.setcc.op, bst);
     break;
+  case X86_CMOV:
+    fix_pseudo_op(&i->v.cmov.src, bst);
+    fix_pseudo_op(&i->v.cmov.dst, bst);
+    break;
+  case X86_JMP_TABLE:
+    fix_pseudo_op(&i->v.jtab.idx, bst);
+    break;
+  case X86_LEA:
+    fix_pseudo_op(&i->v.lea.base, bst);
+    if (i->v.lea.scale != 0)
+      fix_pseudo_op(&i->v.lea.index, bst);
+    fix_pseudo_op(&i->v.lea.dst, bst);
+    break;
   case X86_RET:
   case X86_CDQ:
   case X86_LABEL:
   case X86_JMP:
   case X86_JMPCC:
+  case X86_ALIGN:
   case X86_COMMENT:
   case X86_CALL:
+  case X86_TAIL_CALL:
     break;
   }
 }
 
-#ifdef PRINT_VARS_LAYOUT_X86
 typedef struct _tmp tmp_entry;
 struct _tmp {
   int offset;
   const char *name;
 };
 
-int tmp_entry_cmp(const void *a, const void *b) {
-  tmp_entry *aa = (tmp_entry *)a;
-  tmp_entry *bb = (tmp_entry *)b;
-
-  return aa->offset < bb->offset;
+static int tmp_entry_cmp(const void *a, const void *b) {
+  const tmp_entry *aa = a;
+  const tmp_entry *bb = b;
+  if (aa->offset != bb->offset)
+    return aa->offset < bb->offset ? -1 : 1;
+  return strcmp(aa->name, bb->name);
 }
 
-#endif
-
-int fix_pseudo_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
-  max_offset = 0;
-  offset = 0;
-
-  offset_table = ht_create();
-
-  for (x86_instr *i = f->first; i != NULL; i = i->next)
-    fix_pseudo_for_instr(i, bst);
+static x86_instr *append_comment(x86_asm_gen *ag, x86_instr *tail,
+                                 string comment) {
+  x86_instr *c = alloc_x86_instr(ag, X86_COMMENT);
+  c->v.comment = comment;
+  c->prev = tail;
+  if (tail != NULL)
+    tail->next = c;
+  return c;
+}
 
-#ifdef PRINT_VARS_LAYOUT_X86
-  x86_instr *head = alloc_x86_instr(ag, X86_COMMENT);
-  head->v.comment = new_string("---- vars layout ----");
-  head->prev = NULL;
+// inserts table of vars used by func to their places at start of func, only
+// vars from offset table and statics are listed, so size is linear in func
+static void emit_vars_layout(x86_asm_gen *ag, x86_func *f) {
+  x86_instr *head =
+      append_comment(ag, NULL, new_string("---- vars layout ----"));
   x86_instr *tail = head;
 
-  // get all entries from offset table
-  hti it = ht_iterator(offset_table);
   VEC(tmp_entry) arr;
   vec_init(arr);
+  hti it = ht_iterator(offset_table);
   while (ht_next(&it)) {
-    tmp_entry val;
-    val.name = it.key;
-    val.offset = (int)(intptr_t)it.value;
+    tmp_entry val = {(int)(intptr_t)it.value, it.key};
     vec_push_back(arr, val);
   }
-
-  // sort entries
   qsort(arr.data, arr.size, sizeof(tmp_entry), tmp_entry_cmp);
-
-  // print entries
-  vec_foreach(tmp_entry, arr, it) {
-    x86_instr *c = alloc_x86_instr(ag, X86_COMMENT);
-    c->v.comment = string_sprintf(" %s: -%d(%%rbp)", it->name, it->offset);
-    c->prev = tail;
-    tail->next = c;
-    tail = c;
+  vec_foreach(tmp_entry, arr, e) {
+    string place =
+        f->omit_frame_pointer
+            ? string_sprintf("%d(%%rsp)", f->stack_alloc - 8 - e->offset)
+            : string_sprintf("-%d(%%rbp)", e->offset);
+    tail = append_comment(ag, tail, string_sprintf(" %s: %s", e->name, place));
   }
 
-  // print static vars
-  it = ht_iterator(bst);
+  // statics have no offset, they are sorted by name
+  vec_clear(arr);
+  it = ht_iterator(statics);
   while (ht_next(&it)) {
-    be_syme *e = it.value;
-    if (e->t != BE_SYME_FN && !e->v.obj.is_static)
-      continue;
-    x86_instr *c = alloc_x86_instr(ag, X86_COMMENT);
-    c->v.comment = string_sprintf(" %s: %s(%%rsp)", it.key, it.key);
-    c->prev = tail;
-    tail->next = c;
-    tail = c;
+    tmp_entry val = {0, it.key};
+    vec_push_back(arr, val);
   }
+  qsort(arr.data, arr.size, sizeof(tmp_entry), tmp_entry_cmp);
+  vec_foreach(tmp_entry, arr, e) tail = append_comment(
+      ag, tail, string_sprintf(" %s: %s(%%rip)", e->name, e->name));
+  vec_free(arr);
 
-  x86_instr *c = alloc_x86_instr(ag, X86_COMMENT);
-  c->v.comment = new_string("--------------------");
-  c->prev = tail;
-  tail->next = c;
-  tail = c;
-
+  tail = append_comment(ag, tail, new_string("--------------------"));
   f->first->prev = tail;
   tail->next = f->first;
   f->first = head;
+}
 
-#endif
+static bool is_leaf(x86_func *f) {
+  for (x86_instr *i = f->first; i != NULL; i = i->next)
+    if (i->op == X86_CALL)
+      return false;
+  return true;
+}
+
+static bool uses_stack(x86_func *f) {
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    x86_op_ref refs[X86_INSTR_MAX_OPS];
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j)
+      if (refs[j].op->t == X86_OP_STACK)
+        return true;
+  }
+  return false;
+}
+
+// Without frame pointer return address is the only thing pushed, it's counted
+// in alloc, so %rsp is aligned to 16 at calls. Leaf function (tail calls free
+// frame before jump) keeps locals which fit into red zone below %rsp, and one
+// which doesn't touch stack at all needs no frame pointer either
+static void layout_frame(x86_asm_gen *ag, x86_func *f) {
+  f->frame_size = ((max_offset + 15) & ~15) + ag->out_args; // round to 16
+
+  int pushed = f->omit_frame_pointer ? 8 : 0;
+  f->stack_alloc = f->frame_size + pushed;
+  if (!is_leaf(f))
+    return;
+  if (f->stack_alloc <= RED_ZONE)
+    f->stack_alloc = 0;
+  if (f->frame_size == 0 && !uses_stack(f))
+    f->omit_frame_pointer = true;
+}
+
+int fix_pseudo_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  max_offset = 0;
+  offset = 0;
+  hole = 0;
+
+  offset_table = ht_create();
+  statics = ag->verbose_asm ? ht_create() : NULL;
+
+  for (x86_instr *i = f->first; i != NULL; i = i->next)
+    fix_pseudo_for_instr(i, bst);
+  layout_frame(ag, f);
+
+  if (ag->verbose_asm) {
+    emit_vars_layout(ag, f);
+    ht_destroy(statics);
+    statics = NULL;
+  }
 
   ht_destroy(offset_table);
 
-  return (max_offset + 15) & ~15; // round to 16
+  return f->stack_alloc;
 }
@@ -0,0 +1,263 @@
+#include "common.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Linear scan (Poletto & Sarkar). Each pseudo gets one interval [start, end]
+// over linear instr positions, covering all points where it's live (holes are
+// ignored). Intervals are visited by start, keeping active ones in regs and
+// spilling the one which ends furthest when regs run out. Spilled pseudos are
+// left for fix_pseudo_for_func, same as with graph coloring.
+//
+// Hard regs are precise: each has sorted list of ranges where it's occupied
+// (e.g. ax and dx around idiv, caller saved regs at call), interval can't get
+// a reg which is occupied inside of it.
+//
+// Instr at position p reads at 2p and writes at 2p + 1, so value which dies at
+// instr can share reg with value written by it.
+
+#define K X86_ALLOC_REGS
+
+typedef struct {
+  int start;
+  int end;
+} ls_range;
+
+typedef struct {
+  x86_cfg g;
+
+  ls_range *iv; // per node, interval of pseudo, start is -1 if not seen
+  int *hint;    // per node, other side of move, -1 if none
+  int *color;   // per node, idx in x86_alloc_regs or -1
+
+  VEC(ls_range) fixed[K]; // occupied ranges of hard regs
+  int usable_regs;        // regs which can be given, see x86_usable_regs
+
+  int pos; // position of current instr during walk
+} ls_ctx;
+
+static void extend(ls_ctx *c, int node, int p) {
+  ls_range *r = &c->iv[node];
+  if (r->start < 0) {
+    r->start = r->end = p;
+    return;
+  }
+  if (p < r->start)
+    r->start = p;
+  if (p > r->end)
+    r->end = p;
+}
+
+// inside of block ranges are added going backward, so only last one can
+// overlap new one
+static void occupy(ls_ctx *c, int reg, int start, int end) {
+  if (!vec_empty(c->fixed[reg])) {
+    ls_range *last = &vec_back(c->fixed[reg]);
+    if (end + 1 >= last->start && start <= last->end + 1) {
+      if (start < last->start)
+        last->start = start;
+      if (end > last->end)
+        last->end = end;
+      return;
+    }
+  }
+  ls_range r = {start, end};
+  vec_push_back(c->fixed[reg], r);
+}
+
+static void walk_instr(x86_instr *i, x86_instr_nodes *in, x86_live *live,
+                       void *ctx) {
+  ls_ctx *c = ctx;
+  int p = c->pos--;
+
+  for (int reg = 0; reg < K; ++reg)
+    if (x86_live_has(live, reg))
+      occupy(c, reg, 2 * p + 1, 2 * p + 2);
+
+  for (int j = 0; j < in->ndefs; ++j) {
+    int node = in->defs[j];
+    if (node < K)
+      occupy(c, node, 2 * p + 1, 2 * p + 1);
+    else
+      extend(c, node, 2 * p + 1);
+  }
+  for (int j = 0; j < in->nuses; ++j) {
+    int node = in->uses[j];
+    if (node < K)
+      occupy(c, node, 2 * p, 2 * p);
+    else
+      extend(c, node, 2 * p);
+  }
+
+  if (i->op == X86_MOV) {
+    int src = x86_op_node(&c->g, &i->v.binary.src);
+    int dst = x86_op_node(&c->g, &i->v.binary.dst);
+    if (src >= 0 && dst >= 0) {
+      if (src >= K)
+        c->hint[src] = dst;
+      if (dst >= K)
+        c->hint[dst] = src;
+    }
+  }
+}
+
+static int range_cmp(const void *a, const void *b) {
+  return ((ls_range *)a)->start - ((ls_range *)b)->start;
+}
+
+static void build_intervals(ls_ctx *c) {
+  x86_live live;
+  x86_live_init(&live, c->g.nodes);
+
+  int pos = 0;
+  for (size_t b = 0; b < c->g.blocks.size; ++b) {
+    x86_block *blk = &c->g.blocks.data[b];
+    int first = pos;
+    for (x86_instr *i = blk->first;; i = i->next) {
+      ++pos;
+      if (i == blk->last)
+        break;
+    }
+    int last = pos - 1;
+
+    c->pos = last;
+    x86_block_walk(&c->g, blk, &live, walk_instr, c);
+
+    bitset_foreach(&blk->live_in, idx) {
+      int node = c->g.live_nodes.data[idx];
+      if (node >= K)
+        extend(c, node, 2 * first);
+    }
+    bitset_foreach(&blk->live_out, idx) {
+      int node = c->g.live_nodes.data[idx];
+      if (node >= K)
+        extend(c, node, 2 * last + 1);
+    }
+  }
+
+  x86_live_free(&live);
+
+  // blocks were walked backward, so ranges of each block are reversed, but
+  // blocks themselves are in increasing order
+  for (int reg = 0; reg < K; ++reg) {
+    if (!vec_empty(c->fixed[reg]))
+      qsort(c->fixed[reg].data, c->fixed[reg].size, sizeof(ls_range),
+            range_cmp);
+  }
+}
+
+// true if reg is occupied somewhere in r
+static bool fixed_conflict(ls_ctx *c, int reg, ls_range *r) {
+  // first range which ends at or after r->start
+  size_t lo = 0, hi = c->fixed[reg].size;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c->fixed[reg].data[mid].end < r->start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < c->fixed[reg].size && c->fixed[reg].data[lo].start <= r->end;
+}
+
+static ls_ctx *sort_ctx;
+
+static int interval_cmp(const void *a, const void *b) {
+  return sort_ctx->iv[*(int *)a].start - sort_ctx->iv[*(int *)b].start;
+}
+
+static void scan(ls_ctx *c) {
+  int_vec order;
+  vec_init(order);
+  for (size_t node = K; node < c->g.nodes; ++node)
+    if (c->iv[node].start >= 0)
+      vec_push_back(order, node);
+
+  sort_ctx = c;
+  if (!vec_empty(order))
+    qsort(order.data, order.size, sizeof(int), interval_cmp);
+
+  int active[K]; // node holding each reg, -1 if free
+  memset(active, -1, sizeof(active));
+
+  vec_foreach(int, order, it) {
+    int node = *it;
+    ls_range *r = &c->iv[node];
+
+    // expire
+    for (int reg = 0; reg < K; ++reg)
+      if (active[reg] >= 0 && c->iv[active[reg]].end < r->start)
+        active[reg] = -1;
+
+    // prefer reg of other side of move, so move can be dropped (longword one
+    // which zero extends is kept by x86_apply_colors)
+    int reg = -1;
+    int h = c->hint[node];
+    if (h >= 0) {
+      int hr = h < K ? h : c->color[h];
+      if (hr >= 0 && active[hr] < 0 && !fixed_conflict(c, hr, r))
+        reg = hr;
+    }
+    for (int j = 0; reg < 0 && j < c->usable_regs; ++j)
+      if (active[j] < 0 && !fixed_conflict(c, j, r))
+        reg = j;
+
+    if (reg < 0) {
+      // spill interval which ends last, if it outlives current one
+      int victim = -1;
+      for (int j = 0; j < c->usable_regs; ++j)
+        if (active[j] >= 0 && c->iv[active[j]].end > r->end &&
+            !fixed_conflict(c, j, r) &&
+            (victim < 0 || c->iv[active[j]].end > c->iv[active[victim]].end))
+          victim = j;
+      if (victim < 0)
+        continue;
+      c->color[active[victim]] = -1;
+      reg = victim;
+    }
+
+    c->color[node] = reg;
+    active[reg] = node;
+  }
+
+  vec_free(order);
+}
+
+void linear_scan_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  ls_ctx c;
+  c.usable_regs = x86_usable_regs(ag);
+  build_x86_cfg(&c.g, f, bst);
+  analyze_x86_liveness(&c.g);
+
+  size_t n = c.g.nodes;
+  c.iv = malloc(sizeof(ls_range) * n);
+  c.hint = malloc(sizeof(int) * n);
+  c.color = malloc(sizeof(int) * n);
+  assert(c.iv && c.hint && c.color);
+  for (size_t node = 0; node < n; ++node) {
+    c.iv[node].start = c.iv[node].end = -1;
+    c.hint[node] = -1;
+    c.color[node] = node < K ? (int)node : -1;
+  }
+  for (int reg = 0; reg < K; ++reg)
+    vec_init(c.fixed[reg]);
+
+  build_intervals(&c);
+  scan(&c);
+
+  x86_apply_colors(&c.g, c.color);
+
+  if (ag->verbose_asm)
+    x86_emit_regs_layout(ag, &c.g, c.color);
+
+  for (int reg = 0; reg < K; ++reg)
+    vec_free(c.fixed[reg]);
+  free(c.iv);
+  free(c.hint);
+  free(c.color);
+  free_x86_cfg(&c.g);
+}
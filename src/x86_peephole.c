@@ -0,0 +1,236 @@
+#include "common.h"
+#include "table.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <stdio.h>
+#include <string.h>
+
+// Peephole optimizer over final x86 of function (only regs, stack and data
+// operands are left). Each rule of the table looks at instr and the ones right
+// after it:
+//  - store-load forwarding: `mov X, M; op M, Y` reads X instead of M
+//  - redundant mov: `mov %r, %r`, `mov A, B` repeated or followed by
+//    `mov B, A`. Longword `mov %r, %r` zero-extends, so it stays unless upper
+//    half of %r is known to be zero
+//  - `mov $0, %r` is `xor %r, %r`, when flags aren't read before next write
+//  - `cmp $0, %r` is `test %r, %r`, flags are the same
+//  - jumps to label right after them (fix ups can leave new ones)
+// After rewrite the scan goes back by one instr, so rewrites can feed each
+// other (forwarding `mov $0, M; mov M, %r` makes zeroing of %r).
+
+// bound for instrs looked at when searching for reader of flags
+#define PEEPHOLE_MAX_FLAGS_SCAN 32
+
+typedef struct {
+  const char *name;
+  bool (*apply)(x86_func *f, x86_instr *i); // true if code was rewritten
+  int hits;                                 // over whole program
+} peephole_rule;
+
+static bool is_mem(x86_op *op) {
+  return op->t == X86_OP_STACK || op->t == X86_OP_DATA || op->t == X86_OP_ARG;
+}
+
+static bool is_reg(x86_op *op, x86_reg reg) {
+  return op->t == X86_OP_REG && op->v.reg == reg;
+}
+
+static bool op_eq(x86_op *a, x86_op *b) {
+  if (a->t != b->t)
+    return false;
+  switch (a->t) {
+  case X86_OP_IMM:
+    return a->v.imm == b->v.imm;
+  case X86_OP_REG:
+    return a->v.reg == b->v.reg;
+  case X86_OP_PSEUDO:
+    return !strcmp(a->v.pseudo, b->v.pseudo);
+  case X86_OP_STACK:
+    return a->v.stack_offset == b->v.stack_offset;
+  case X86_OP_DATA:
+    return !strcmp(a->v.data, b->v.data);
+  case X86_OP_ARG:
+    return a->v.arg_offset == b->v.arg_offset;
+  }
+  UNREACHABLE();
+}
+
+// next instr which emits code or is label, NULL if none
+static x86_instr *next_instr(x86_instr *i) {
+  for (i = i->next; i != NULL && i->op == X86_COMMENT; i = i->next)
+    ;
+  return i;
+}
+
+// binary instrs which can read reg instead of memory src
+static bool reads_src_as_reg(x86_instr *i) {
+  switch (i->op) {
+  case X86_MOV:
+  case X86_ADD:
+  case X86_SUB:
+  case X86_MULT:
+  case X86_AND:
+  case X86_OR:
+  case X86_XOR:
+  case X86_CMP:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool forward_store(x86_func *f, x86_instr *i) {
+  (void)f;
+  x86_instr *n = next_instr(i);
+  if (i->op != X86_MOV || !is_mem(&i->v.binary.dst) || n == NULL ||
+      !reads_src_as_reg(n) || n->v.binary.type != i->v.binary.type ||
+      !op_eq(&n->v.binary.src, &i->v.binary.dst))
+    return false;
+
+  x86_op *src = &i->v.binary.src;
+  // immediate of store is valid for mov, not necessarily for others
+  if (src->t == X86_OP_REG || (src->t == X86_OP_IMM && n->op == X86_MOV)) {
+    n->v.binary.src = *src;
+    return true;
+  }
+  return false;
+}
+
+static bool redundant_mov(x86_func *f, x86_instr *i) {
+  if (i->op != X86_MOV)
+    return false;
+  x86_op *src = &i->v.binary.src, *dst = &i->v.binary.dst;
+  if (src->t == X86_OP_REG && is_reg(dst, src->v.reg) &&
+      (i->v.binary.type == X86_QUADWORD || x86_upper_zero(i, src->v.reg))) {
+    x86_remove_instr(f, i);
+    return true;
+  }
+
+  x86_instr *n = next_instr(i);
+  if (n == NULL || n->op != X86_MOV || n->v.binary.type != i->v.binary.type ||
+      op_eq(src, dst))
+    return false;
+
+  // `mov A, B; mov A, B` or `mov A, B; mov B, A`, unless it zero-extends A
+  bool same = op_eq(&n->v.binary.src, src) && op_eq(&n->v.binary.dst, dst);
+  bool back = op_eq(&n->v.binary.src, dst) && op_eq(&n->v.binary.dst, src) &&
+              (i->v.binary.type == X86_QUADWORD || src->t != X86_OP_REG);
+  if (!same && !back)
+    return false;
+  x86_remove_instr(f, n);
+  return true;
+}
+
+// true if flags written by instr are never read, conservative at jumps
+static bool flags_dead_after(x86_instr *i) {
+  int n = 0;
+  for (i = i->next; i != NULL && n < PEEPHOLE_MAX_FLAGS_SCAN;
+       i = i->next, ++n) {
+    switch (i->op) {
+    case X86_JMPCC:
+    case X86_SETCC:
+    case X86_CMOV:
+    case X86_JMP:
+    case X86_JMP_TABLE:
+      return false;
+    case X86_CMP:
+    case X86_TEST:
+    case X86_ADD:
+    case X86_SUB:
+    case X86_MULT:
+    case X86_AND:
+    case X86_OR:
+    case X86_XOR:
+    case X86_NEG:
+    case X86_IDIV:
+    case X86_DIV:
+    case X86_IMUL_WIDE:
+    case X86_MUL_WIDE:
+    case X86_CALL:
+    case X86_TAIL_CALL:
+    case X86_RET:
+      return true;
+    case X86_SHL:
+    case X86_SHR:
+    case X86_SAR:
+      // shift by 0 keeps flags
+      if (i->v.binary.src.t == X86_OP_IMM && (i->v.binary.src.v.imm & 63))
+        return true;
+      break;
+    default:
+      // inc and dec keep carry flag
+      break;
+    }
+  }
+  return false;
+}
+
+static bool xor_zero(x86_func *f, x86_instr *i) {
+  (void)f;
+  if (i->op != X86_MOV || i->v.binary.type == X86_BYTE ||
+      i->v.binary.dst.t != X86_OP_REG || i->v.binary.src.t != X86_OP_IMM ||
+      i->v.binary.src.v.imm != 0 || !flags_dead_after(i))
+    return false;
+  // writing low half zeroes the rest of reg
+  i->op = X86_XOR;
+  i->v.binary.src = i->v.binary.dst;
+  i->v.binary.type = X86_LONGWORD;
+  return true;
+}
+
+static bool test_zero(x86_func *f, x86_instr *i) {
+  (void)f;
+  if (i->op != X86_CMP || i->v.binary.dst.t != X86_OP_REG ||
+      i->v.binary.src.t != X86_OP_IMM || i->v.binary.src.v.imm != 0)
+    return false;
+  i->op = X86_TEST;
+  i->v.binary.src = i->v.binary.dst;
+  return true;
+}
+
+static bool jump_to_next(x86_func *f, x86_instr *i) {
+  if (i->op != X86_JMP && i->op != X86_JMPCC)
+    return false;
+  int target = i->op == X86_JMP ? i->v.label : i->v.jmpcc.label_idx;
+  for (x86_instr *n = next_instr(i); n != NULL && n->op == X86_LABEL;
+       n = next_instr(n)) {
+    if (n->v.label == target) {
+      x86_remove_instr(f, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static peephole_rule rules[] = {
+    {"forward-store", forward_store, 0},
+    {"redundant-mov", redundant_mov, 0},
+    {"xor-zero", xor_zero, 0},
+    {"test-zero", test_zero, 0},
+    {"jump-to-next", jump_to_next, 0},
+};
+
+#define RULES_LEN (sizeof(rules) / sizeof(rules[0]))
+
+void peephole_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  (void)ag;
+  (void)bst;
+  for (x86_instr *i = f->first; i != NULL;) {
+    // rules remove only instr itself and ones after it
+    x86_instr *prev = i->prev;
+    bool hit = false;
+    for (size_t r = 0; r < RULES_LEN && !hit; ++r) {
+      hit = rules[r].apply(f, i);
+      rules[r].hits += hit;
+    }
+    if (!hit)
+      i = i->next;
+    else
+      i = prev != NULL ? prev : f->first;
+  }
+}
+
+void print_peephole_stats(void) {
+  for (size_t r = 0; r < RULES_LEN; ++r)
+    fprintf(stderr, "peephole %-16s %d\n", rules[r].name, rules[r].hits);
+}
@@ -0,0 +1,659 @@
+#include "common.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Iterated register coalescing (George & Appel). Pseudos are nodes of
+// interference graph, which is simplified, coalesced and frozen until it can be
+// colored with x86_usable_regs colors. Nodes which can't be colored are left as
+// pseudos, so fix_pseudo_for_func gives them stack slots and
+// fix_instructions_for_func legalizes memory operands with r10/r11. Since
+// spilled values never need a register, no rewrite and rebuild round is needed.
+
+typedef enum {
+  NS_PRECOLORED,
+  NS_INITIAL,
+  NS_SIMPLIFY,
+  NS_FREEZE,
+  NS_SPILL,
+  NS_SPILLED,
+  NS_COALESCED,
+  NS_COLORED,
+  NS_SELECT,
+} node_state;
+
+typedef enum {
+  MS_WORKLIST,
+  MS_ACTIVE,
+  MS_COALESCED,
+  MS_CONSTRAINED,
+  MS_FROZEN,
+} move_state;
+
+typedef struct {
+  int src;
+  int dst;
+  move_state state;
+  int prev, next; // links in list of state (worklist or active)
+} ra_move;
+
+typedef struct {
+  double score;
+  int node;
+} spill_entry;
+
+// set of interference edges, open addressing over (min << 32 | max) keys
+typedef struct {
+  uint64_t *keys; // 0 is empty slot, so keys are stored + 1
+  size_t cap;
+  size_t size;
+} edge_set;
+
+typedef struct {
+  x86_cfg g;
+  int k; // amount of colors
+
+  size_t n;           // amount of nodes
+  node_state *state;  // per node
+  int *degree;        // per node
+  int *alias;         // per node
+  int *color;         // per node, idx in x86_alloc_regs or -1
+  double *cost;       // per node, spill cost weighted by loop depth
+  int_vec *adj;       // per node, neighbours (only for not precolored)
+  int_vec *moves_of;  // per node, idxs of moves which node is part of
+  int *prev, *next;   // per node, links in list of it's state
+  int heads[NS_SELECT + 1];
+
+  edge_set edges;
+
+  VEC(ra_move) moves;
+  int move_heads[MS_ACTIVE + 1];
+
+  int_vec select; // stack of simplified nodes
+
+  VEC(spill_entry) spill_heap; // min heap of spill candidates by score
+
+  int *stamp; // per node, used to find union of neighbours
+  int curr_stamp;
+} ra_ctx;
+
+static uint64_t edge_key(int u, int v) {
+  if (u > v) {
+    int t = u;
+    u = v;
+    v = t;
+  }
+  return ((uint64_t)u << 32 | (uint64_t)v) + 1;
+}
+
+static size_t edge_slot(edge_set *s, uint64_t key) {
+  uint64_t h = key * 0x9e3779b97f4a7c15ull;
+  size_t i = (h ^ (h >> 29)) & (s->cap - 1);
+  while (s->keys[i] != 0 && s->keys[i] != key)
+    i = (i + 1) & (s->cap - 1);
+  return i;
+}
+
+static bool edge_set_has(edge_set *s, int u, int v) {
+  uint64_t key = edge_key(u, v);
+  return s->keys[edge_slot(s, key)] == key;
+}
+
+// returns false if edge already was in set
+static bool edge_set_add(edge_set *s, int u, int v) {
+  if ((s->size + 1) * 2 > s->cap) {
+    uint64_t *old = s->keys;
+    size_t old_cap = s->cap;
+    s->cap *= 2;
+    s->keys = calloc(s->cap, sizeof(uint64_t));
+    assert(s->keys);
+    for (size_t i = 0; i < old_cap; ++i)
+      if (old[i] != 0)
+        s->keys[edge_slot(s, old[i])] = old[i];
+    free(old);
+  }
+
+  uint64_t key = edge_key(u, v);
+  size_t slot = edge_slot(s, key);
+  if (s->keys[slot] == key)
+    return false;
+  s->keys[slot] = key;
+  ++s->size;
+  return true;
+}
+
+static double spill_score(ra_ctx *c, int node) {
+  return c->cost[node] / c->degree[node];
+}
+
+static void spill_heap_push(ra_ctx *c, int node) {
+  spill_entry e = {spill_score(c, node), node};
+  vec_push_back(c->spill_heap, e);
+  size_t i = c->spill_heap.size - 1;
+  while (i > 0 && c->spill_heap.data[(i - 1) / 2].score > e.score) {
+    c->spill_heap.data[i] = c->spill_heap.data[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  c->spill_heap.data[i] = e;
+}
+
+static spill_entry spill_heap_pop(ra_ctx *c) {
+  assert(!vec_empty(c->spill_heap));
+  spill_entry res = c->spill_heap.data[0];
+  spill_entry e = vec_back(c->spill_heap);
+  vec_pop_back(c->spill_heap);
+
+  size_t n = c->spill_heap.size, i = 0;
+  while (n > 0) {
+    size_t child = i * 2 + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n &&
+        c->spill_heap.data[child + 1].score < c->spill_heap.data[child].score)
+      ++child;
+    if (c->spill_heap.data[child].score >= e.score)
+      break;
+    c->spill_heap.data[i] = c->spill_heap.data[child];
+    i = child;
+  }
+  if (n > 0)
+    c->spill_heap.data[i] = e;
+  return res;
+}
+
+// node lists, every node is in exactly one list of it's state
+
+static void list_push(ra_ctx *c, int node, node_state st) {
+  if (st == NS_SPILL)
+    spill_heap_push(c, node);
+  c->state[node] = st;
+  c->prev[node] = -1;
+  c->next[node] = c->heads[st];
+  if (c->heads[st] >= 0)
+    c->prev[c->heads[st]] = node;
+  c->heads[st] = node;
+}
+
+static void list_remove(ra_ctx *c, int node) {
+  node_state st = c->state[node];
+  if (c->prev[node] >= 0)
+    c->next[c->prev[node]] = c->next[node];
+  else
+    c->heads[st] = c->next[node];
+  if (c->next[node] >= 0)
+    c->prev[c->next[node]] = c->prev[node];
+}
+
+static void list_move(ra_ctx *c, int node, node_state st) {
+  list_remove(c, node);
+  list_push(c, node, st);
+}
+
+static int list_pop(ra_ctx *c, node_state st) {
+  int node = c->heads[st];
+  list_remove(c, node);
+  return node;
+}
+
+// move lists, only worklist and active moves are linked
+
+static void move_set_state(ra_ctx *c, int m, move_state st) {
+  ra_move *mv = &c->moves.data[m];
+  if (mv->state <= MS_ACTIVE) {
+    if (mv->prev >= 0)
+      c->moves.data[mv->prev].next = mv->next;
+    else
+      c->move_heads[mv->state] = mv->next;
+    if (mv->next >= 0)
+      c->moves.data[mv->next].prev = mv->prev;
+  }
+
+  mv->state = st;
+  if (st <= MS_ACTIVE) {
+    mv->prev = -1;
+    mv->next = c->move_heads[st];
+    if (mv->next >= 0)
+      c->moves.data[mv->next].prev = m;
+    c->move_heads[st] = m;
+  }
+}
+
+static bool is_precolored(int node) { return node < X86_ALLOC_REGS; }
+
+static void add_edge(ra_ctx *c, int u, int v) {
+  if (u == v || !edge_set_add(&c->edges, u, v))
+    return;
+  if (!is_precolored(u)) {
+    vec_push_back(c->adj[u], v);
+    ++c->degree[u];
+    if (c->state[u] == NS_SPILL)
+      spill_heap_push(c, u);
+  }
+  if (!is_precolored(v)) {
+    vec_push_back(c->adj[v], u);
+    ++c->degree[v];
+    if (c->state[v] == NS_SPILL)
+      spill_heap_push(c, v);
+  }
+}
+
+// build
+
+// hard regs take any width
+static bool has_width(x86_cfg *g, x86_op *op, x86_asm_type t) {
+  if (op->t != X86_OP_PSEUDO)
+    return true;
+  be_syme *e = ht_get(g->bst, op->v.pseudo);
+  assert(e != NULL && e->t == BE_SYME_OBJ);
+  return e->v.obj.type == t;
+}
+
+// only moves which copy value can be coalesced, longword mov truncating or
+// zero extending quadword value changes the reg
+static bool is_move(x86_cfg *g, x86_instr *i) {
+  if (i->op != X86_MOV || x86_op_node(g, &i->v.binary.src) < 0 ||
+      x86_op_node(g, &i->v.binary.dst) < 0)
+    return false;
+  x86_asm_type t = i->v.binary.type;
+  return has_width(g, &i->v.binary.src, t) && has_width(g, &i->v.binary.dst, t);
+}
+
+typedef struct {
+  ra_ctx *c;
+  double weight; // of current block
+} build_ctx;
+
+static void build_instr(x86_instr *i, x86_instr_nodes *in, x86_live *live,
+                        void *ctx) {
+  build_ctx *bc = ctx;
+  ra_ctx *c = bc->c;
+
+  for (int j = 0; j < in->nuses; ++j)
+    c->cost[in->uses[j]] += bc->weight;
+  for (int j = 0; j < in->ndefs; ++j)
+    c->cost[in->defs[j]] += bc->weight;
+
+  int move_src = -1;
+  if (is_move(&c->g, i)) {
+    move_src = x86_op_node(&c->g, &i->v.binary.src);
+    int move_dst = x86_op_node(&c->g, &i->v.binary.dst);
+    if (move_src != move_dst) {
+      ra_move m;
+      m.src = move_src;
+      m.dst = move_dst;
+      m.state = MS_FROZEN; // not linked yet
+      vec_push_back(c->moves, m);
+      move_set_state(c, c->moves.size - 1, MS_WORKLIST);
+      vec_push_back(c->moves_of[move_src], c->moves.size - 1);
+      vec_push_back(c->moves_of[move_dst], c->moves.size - 1);
+    }
+  }
+
+  // values written interfere with everything live after instr, except source
+  // of move, since they hold same value
+  for (int j = 0; j < in->ndefs; ++j)
+    for (size_t l = 0; l < live->size; ++l)
+      if (live->dense[l] != move_src)
+        add_edge(c, in->defs[j], live->dense[l]);
+
+  // written values interfere with each other too (e.g. call clobbers)
+  for (int j = 0; j < in->ndefs; ++j)
+    for (int l = j + 1; l < in->ndefs; ++l)
+      add_edge(c, in->defs[j], in->defs[l]);
+}
+
+static void build(ra_ctx *c) {
+  x86_live live;
+  x86_live_init(&live, c->n);
+
+  vec_foreach(x86_block, c->g.blocks, b) {
+    build_ctx bc;
+    bc.c = c;
+    bc.weight = 1;
+    for (int d = 0; d < b->loop_depth && d < 8; ++d)
+      bc.weight *= 10;
+    x86_block_walk(&c->g, b, &live, build_instr, &bc);
+  }
+
+  x86_live_free(&live);
+}
+
+// simplify, coalesce, freeze, spill
+
+static bool node_skipped(ra_ctx *c, int node) {
+  return c->state[node] == NS_SELECT || c->state[node] == NS_COALESCED;
+}
+
+static bool move_pending(ra_ctx *c, int m) {
+  move_state st = c->moves.data[m].state;
+  return st == MS_WORKLIST || st == MS_ACTIVE;
+}
+
+static bool move_related(ra_ctx *c, int node) {
+  vec_foreach(int, c->moves_of[node], it) {
+    if (move_pending(c, *it))
+      return true;
+  }
+  return false;
+}
+
+static void make_worklists(ra_ctx *c) {
+  while (c->heads[NS_INITIAL] >= 0) {
+    int node = list_pop(c, NS_INITIAL);
+    if (c->degree[node] >= c->k)
+      list_push(c, node, NS_SPILL);
+    else if (move_related(c, node))
+      list_push(c, node, NS_FREEZE);
+    else
+      list_push(c, node, NS_SIMPLIFY);
+  }
+}
+
+static void enable_moves(ra_ctx *c, int node) {
+  vec_foreach(int, c->moves_of[node], it) {
+    if (c->moves.data[*it].state == MS_ACTIVE)
+      move_set_state(c, *it, MS_WORKLIST);
+  }
+}
+
+static void decrement_degree(ra_ctx *c, int node) {
+  if (is_precolored(node))
+    return;
+
+  int d = c->degree[node]--;
+  if (d != c->k)
+    return;
+
+  enable_moves(c, node);
+  vec_foreach(int, c->adj[node], it) {
+    if (!node_skipped(c, *it))
+      enable_moves(c, *it);
+  }
+
+  if (c->state[node] == NS_SPILL)
+    list_move(c, node, move_related(c, node) ? NS_FREEZE : NS_SIMPLIFY);
+}
+
+static void simplify(ra_ctx *c) {
+  int node = list_pop(c, NS_SIMPLIFY);
+  c->state[node] = NS_SELECT;
+  vec_push_back(c->select, node);
+
+  vec_foreach(int, c->adj[node], it) {
+    if (!node_skipped(c, *it))
+      decrement_degree(c, *it);
+  }
+}
+
+static int get_alias(ra_ctx *c, int node) {
+  while (c->state[node] == NS_COALESCED)
+    node = c->alias[node];
+  return node;
+}
+
+static void add_work_list(ra_ctx *c, int node) {
+  if (!is_precolored(node) && !move_related(c, node) &&
+      c->degree[node] < c->k && c->state[node] == NS_FREEZE)
+    list_move(c, node, NS_SIMPLIFY);
+}
+
+static bool george_ok(ra_ctx *c, int t, int r) {
+  return c->degree[t] < c->k || is_precolored(t) ||
+         edge_set_has(&c->edges, t, r);
+}
+
+// George test, every significant neighbour of v already interferes with u
+static bool george(ra_ctx *c, int u, int v) {
+  vec_foreach(int, c->adj[v], it) {
+    if (!node_skipped(c, *it) && !george_ok(c, *it, u))
+      return false;
+  }
+  return true;
+}
+
+// Briggs test, nodes of significant degree in union of neighbours should be
+// less than amount of colors
+static bool briggs(ra_ctx *c, int u, int v) {
+  ++c->curr_stamp;
+  int k = 0;
+  int nodes[2] = {u, v};
+  for (int j = 0; j < 2; ++j) {
+    vec_foreach(int, c->adj[nodes[j]], it) {
+      int t = *it;
+      if (node_skipped(c, t) || c->stamp[t] == c->curr_stamp)
+        continue;
+      c->stamp[t] = c->curr_stamp;
+      if (is_precolored(t) || c->degree[t] >= c->k)
+        ++k;
+    }
+  }
+  return k < c->k;
+}
+
+// both tests are conservative. George needs only neighbours of v, so it is
+// tried first, it's cheap when u is a long lived value with many neighbours,
+// which has absorbed lots of temporaries
+static bool can_coalesce(ra_ctx *c, int u, int v) {
+  if (is_precolored(u))
+    return george(c, u, v);
+  return george(c, u, v) || briggs(c, u, v);
+}
+
+static void combine(ra_ctx *c, int u, int v) {
+  list_move(c, v, NS_COALESCED);
+  c->alias[v] = u;
+
+  vec_foreach(int, c->moves_of[v], it) {
+    vec_push_back(c->moves_of[u], *it);
+  }
+  enable_moves(c, v);
+
+  for (size_t j = 0; j < c->adj[v].size; ++j) {
+    int t = c->adj[v].data[j];
+    if (node_skipped(c, t))
+      continue;
+    add_edge(c, t, u);
+    decrement_degree(c, t);
+  }
+
+  if (c->degree[u] >= c->k && c->state[u] == NS_FREEZE)
+    list_move(c, u, NS_SPILL);
+}
+
+static void coalesce(ra_ctx *c) {
+  int m = c->move_heads[MS_WORKLIST];
+  int x = get_alias(c, c->moves.data[m].src);
+  int y = get_alias(c, c->moves.data[m].dst);
+  int u = x, v = y;
+  if (is_precolored(y)) {
+    u = y;
+    v = x;
+  }
+
+  if (u == v) {
+    move_set_state(c, m, MS_COALESCED);
+    add_work_list(c, u);
+  } else if (is_precolored(v) || edge_set_has(&c->edges, u, v)) {
+    move_set_state(c, m, MS_CONSTRAINED);
+    add_work_list(c, u);
+    add_work_list(c, v);
+  } else if (can_coalesce(c, u, v)) {
+    move_set_state(c, m, MS_COALESCED);
+    combine(c, u, v);
+    add_work_list(c, u);
+  } else {
+    move_set_state(c, m, MS_ACTIVE);
+  }
+}
+
+static void freeze_moves(ra_ctx *c, int u) {
+  for (size_t j = 0; j < c->moves_of[u].size; ++j) {
+    int m = c->moves_of[u].data[j];
+    if (!move_pending(c, m))
+      continue;
+
+    int x = get_alias(c, c->moves.data[m].src);
+    int y = get_alias(c, c->moves.data[m].dst);
+    int v = y == get_alias(c, u) ? x : y;
+    move_set_state(c, m, MS_FROZEN);
+
+    if (!is_precolored(v) && c->state[v] == NS_FREEZE &&
+        !move_related(c, v) && c->degree[v] < c->k)
+      list_move(c, v, NS_SIMPLIFY);
+  }
+}
+
+static void freeze(ra_ctx *c) {
+  int node = list_pop(c, NS_FREEZE);
+  list_push(c, node, NS_SIMPLIFY);
+  freeze_moves(c, node);
+}
+
+// picks node with lowest cost per degree, those are cheapest to keep in memory
+// and help the most when removed. Entries of heap may be stale, they are
+// checked against current score when popped
+static void select_spill(ra_ctx *c) {
+  while (true) {
+    spill_entry e = spill_heap_pop(c);
+    if (c->state[e.node] != NS_SPILL)
+      continue;
+
+    double score = spill_score(c, e.node);
+    if (score > e.score) {
+      // degree went down since push
+      spill_heap_push(c, e.node);
+      continue;
+    }
+    if (score < e.score)
+      continue; // degree went up, newer entry was pushed
+
+    list_move(c, e.node, NS_SIMPLIFY);
+    freeze_moves(c, e.node);
+    return;
+  }
+}
+
+static void assign_colors(ra_ctx *c) {
+  while (!vec_empty(c->select)) {
+    int node = vec_back(c->select);
+    vec_pop_back(c->select);
+
+    bool used[X86_ALLOC_REGS] = {0};
+    vec_foreach(int, c->adj[node], it) {
+      int a = get_alias(c, *it);
+      if (c->state[a] == NS_COLORED || is_precolored(a))
+        used[c->color[a]] = true;
+    }
+
+    int color = -1;
+    for (int j = 0; j < c->k; ++j)
+      if (!used[j]) {
+        color = j;
+        break;
+      }
+
+    if (color < 0) {
+      list_push(c, node, NS_SPILLED);
+    } else {
+      list_push(c, node, NS_COLORED);
+      c->color[node] = color;
+    }
+  }
+
+  for (int node = c->heads[NS_COALESCED]; node >= 0; node = c->next[node]) {
+    int a = get_alias(c, node);
+    if (c->state[a] == NS_COLORED || is_precolored(a))
+      c->color[node] = c->color[a];
+  }
+}
+
+void alloc_regs_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  ra_ctx c;
+  c.k = x86_usable_regs(ag);
+  build_x86_cfg(&c.g, f, bst);
+  analyze_x86_liveness(&c.g);
+  compute_x86_loop_depths(&c.g);
+
+  size_t n = c.n = c.g.nodes;
+  c.state = malloc(sizeof(node_state) * n);
+  c.degree = calloc(n, sizeof(int));
+  c.alias = malloc(sizeof(int) * n);
+  c.color = malloc(sizeof(int) * n);
+  c.cost = calloc(n, sizeof(double));
+  c.adj = calloc(n, sizeof(int_vec));
+  c.moves_of = calloc(n, sizeof(int_vec));
+  c.prev = malloc(sizeof(int) * n);
+  c.next = malloc(sizeof(int) * n);
+  c.stamp = calloc(n, sizeof(int));
+  assert(c.state && c.degree && c.alias && c.color && c.cost && c.adj &&
+         c.moves_of && c.prev && c.next && c.stamp);
+  c.curr_stamp = 0;
+  memset(c.heads, -1, sizeof(c.heads));
+  memset(c.move_heads, -1, sizeof(c.move_heads));
+  vec_init(c.moves);
+  vec_init(c.select);
+  vec_init(c.spill_heap);
+
+  c.edges.cap = 64;
+  c.edges.size = 0;
+  c.edges.keys = calloc(c.edges.cap, sizeof(uint64_t));
+  assert(c.edges.keys);
+
+  for (size_t node = 0; node < n; ++node) {
+    c.alias[node] = node;
+    if (is_precolored(node)) {
+      c.state[node] = NS_PRECOLORED;
+      c.color[node] = node;
+    } else {
+      list_push(&c, node, NS_INITIAL);
+      c.color[node] = -1;
+    }
+  }
+
+  build(&c);
+  make_worklists(&c);
+
+  while (true) {
+    if (c.heads[NS_SIMPLIFY] >= 0)
+      simplify(&c);
+    else if (c.move_heads[MS_WORKLIST] >= 0)
+      coalesce(&c);
+    else if (c.heads[NS_FREEZE] >= 0)
+      freeze(&c);
+    else if (c.heads[NS_SPILL] >= 0)
+      select_spill(&c);
+    else
+      break;
+  }
+
+  assign_colors(&c);
+  x86_apply_colors(&c.g, c.color);
+
+  if (ag->verbose_asm)
+    x86_emit_regs_layout(ag, &c.g, c.color);
+
+  for (size_t node = 0; node < n; ++node) {
+    vec_free(c.adj[node]);
+    vec_free(c.moves_of[node]);
+  }
+  free(c.state);
+  free(c.degree);
+  free(c.alias);
+  free(c.color);
+  free(c.cost);
+  free(c.adj);
+  free(c.moves_of);
+  free(c.prev);
+  free(c.next);
+  free(c.stamp);
+  free(c.edges.keys);
+  vec_free(c.moves);
+  vec_free(c.select);
+  vec_free(c.spill_heap);
+  free_x86_cfg(&c.g);
+}
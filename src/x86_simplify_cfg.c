@@ -0,0 +1,184 @@
+#include "common.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same cleanup as tac_simplify_cfg.c, but on x86 of function, for jumps which
+// lowering of tac instrs leaves behind: jump chains are threaded, unreachable
+// instrs, unused labels and jumps to next label are removed.
+
+#define SIMPLIFY_CFG_MAX_ROUNDS 8
+#define SIMPLIFY_CFG_MAX_CHAIN 32
+
+typedef struct {
+  VEC(x86_instr *) instrs;
+  int *label_pos; // label -> position of label instr, -1 if none
+  int *refs;      // label -> number of reachable jumps to it
+  bool *keep;     // position -> instr stays
+  int max_label;
+} simplify_ctx;
+
+static bool is_jump(x86_instr *i) {
+  return i->op == X86_JMP || i->op == X86_JMPCC;
+}
+
+static int *jump_target(x86_instr *i) {
+  return i->op == X86_JMP ? &i->v.label : &i->v.jmpcc.label_idx;
+}
+
+// points res to labels jumped to by instr, returns amount of them
+static size_t jump_targets(x86_instr *i, int **res) {
+  if (i->op == X86_JMP_TABLE) {
+    *res = i->v.jtab.labels;
+    return i->v.jtab.labels_len;
+  }
+  if (!is_jump(i))
+    return 0;
+  *res = jump_target(i);
+  return 1;
+}
+
+// labels and comments don't emit code
+static bool is_marker(x86_instr *i) {
+  return i->op == X86_LABEL || i->op == X86_COMMENT;
+}
+
+static x86_instr *skip_markers(simplify_ctx *c, int pos) {
+  for (size_t p = pos; p < c->instrs.size; ++p)
+    if (!is_marker(c->instrs.data[p]))
+      return c->instrs.data[p];
+  return NULL;
+}
+
+static int thread(simplify_ctx *c, int target) {
+  for (int n = 0; n < SIMPLIFY_CFG_MAX_CHAIN; ++n) {
+    x86_instr *next = skip_markers(c, c->label_pos[target]);
+    if (next == NULL || next->op != X86_JMP || next->v.label == target)
+      break;
+    target = next->v.label;
+  }
+  return target;
+}
+
+static bool thread_jumps(simplify_ctx *c) {
+  bool changed = false;
+  vec_foreach(x86_instr *, c->instrs, it) {
+    int *targets;
+    size_t n = jump_targets(*it, &targets);
+    for (size_t j = 0; j < n; ++j) {
+      int to = thread(c, targets[j]);
+      changed |= to != targets[j];
+      targets[j] = to;
+    }
+  }
+  return changed;
+}
+
+static void find_reachable(simplify_ctx *c) {
+  size_t n = c->instrs.size;
+  memset(c->refs, 0, sizeof(int) * (c->max_label + 1));
+  memset(c->keep, 0, sizeof(bool) * n);
+
+  bool again = true;
+  while (again) {
+    again = false;
+    bool reach = true;
+    for (size_t p = 0; p < n; ++p) {
+      x86_instr *i = c->instrs.data[p];
+      if (i->op == X86_LABEL && c->refs[i->v.label] > 0)
+        reach = true;
+      if (reach && !c->keep[p]) {
+        c->keep[p] = true;
+        int *targets;
+        size_t nt = jump_targets(i, &targets);
+        for (size_t j = 0; j < nt; ++j)
+          if (c->refs[targets[j]]++ == 0 && c->label_pos[targets[j]] < (int)p)
+            again = true;
+      }
+      if (i->op == X86_JMP || i->op == X86_RET || i->op == X86_JMP_TABLE ||
+          i->op == X86_TAIL_CALL)
+        reach = false;
+    }
+  }
+}
+
+static bool jumps_to_next(simplify_ctx *c, size_t pos) {
+  int target = c->label_pos[*jump_target(c->instrs.data[pos])];
+  if (target < (int)pos)
+    return false;
+  for (size_t p = pos + 1; p < (size_t)target; ++p)
+    if (c->keep[p] && !is_marker(c->instrs.data[p]))
+      return false;
+  return true;
+}
+
+static bool remove_dead(simplify_ctx *c, x86_func *f) {
+  bool changed = false;
+  for (size_t p = 0; p < c->instrs.size; ++p) {
+    x86_instr *i = c->instrs.data[p];
+    if (!c->keep[p])
+      continue;
+    // flags written by cmp of removed jcc are never read
+    if ((i->op == X86_LABEL && c->refs[i->v.label] == 0) ||
+        (is_jump(i) && jumps_to_next(c, p))) {
+      if (is_jump(i))
+        --c->refs[*jump_target(i)];
+      c->keep[p] = false;
+    }
+  }
+
+  for (size_t p = 0; p < c->instrs.size; ++p) {
+    if (!c->keep[p]) {
+      x86_remove_instr(f, c->instrs.data[p]);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void collect(simplify_ctx *c, x86_func *f) {
+  vec_clear(c->instrs);
+  for (int l = 0; l <= c->max_label; ++l)
+    c->label_pos[l] = -1;
+  for (x86_instr *i = f->first; i != NULL; i = i->next) {
+    if (i->op == X86_LABEL)
+      c->label_pos[i->v.label] = c->instrs.size;
+    vec_push_back(c->instrs, i);
+  }
+}
+
+void simplify_x86_cfg_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  (void)ag;
+  (void)bst;
+  simplify_ctx c;
+  vec_init(c.instrs);
+
+  c.max_label = 0;
+  size_t n = 0;
+  for (x86_instr *i = f->first; i != NULL; i = i->next, ++n)
+    if (i->op == X86_LABEL && i->v.label > c.max_label)
+      c.max_label = i->v.label;
+
+  c.label_pos = malloc(sizeof(int) * (c.max_label + 1));
+  c.refs = malloc(sizeof(int) * (c.max_label + 1));
+  c.keep = malloc(sizeof(bool) * (n ? n : 1));
+  assert(c.label_pos && c.refs && c.keep);
+
+  for (int round = 0; round < SIMPLIFY_CFG_MAX_ROUNDS; ++round) {
+    collect(&c, f);
+    bool changed = thread_jumps(&c);
+    find_reachable(&c);
+    changed |= remove_dead(&c, f);
+    if (!changed)
+      break;
+  }
+
+  free(c.label_pos);
+  free(c.refs);
+  free(c.keep);
+  vec_free(c.instrs);
+}
@@ -0,0 +1,237 @@
+#include "common.h"
+#include "table.h"
+#include "vec.h"
+#include "x86.h"
+#include "x86_cfg.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stack slot sharing. Pseudos left in memory after register allocation (all of
+// them without it) get one live interval each, same as in linear scan. Visited
+// by start, pseudo takes slot of same size whose last user ended before it,
+// it's renamed to first pseudo of slot then, so fix_pseudo_for_func gives them
+// one offset. Moves between pseudos which ended up in same slot are dropped.
+//
+// Instr at position p reads at 2p and writes at 2p + 1, so dst of instr can
+// share slot with src which dies at it (fix_instructions_for_func reads all
+// memory srcs before writing dst).
+
+typedef struct {
+  int start;
+  int end;
+} slot_range;
+
+typedef struct {
+  int end;  // end of last interval in slot
+  int node; // first pseudo of slot, others are renamed to it
+} slot;
+
+typedef VEC(slot) slot_heap; // min heap by end
+
+typedef struct {
+  x86_cfg g;
+  slot_range *iv; // per node, start is -1 if not seen
+  int *rep;       // per node, pseudo node whose name it takes
+  int pos;        // position of current instr during walk
+} slots_ctx;
+
+static struct {
+  long before; // bytes of slots if each pseudo had its own
+  long after;
+  int moves;   // removed moves
+} stats;
+
+static void extend(slots_ctx *c, int node, int p) {
+  if (node < X86_ALLOC_REGS)
+    return;
+  slot_range *r = &c->iv[node];
+  if (r->start < 0) {
+    r->start = r->end = p;
+    return;
+  }
+  if (p < r->start)
+    r->start = p;
+  if (p > r->end)
+    r->end = p;
+}
+
+static void walk_instr(x86_instr *i, x86_instr_nodes *in, x86_live *live,
+                       void *ctx) {
+  (void)i;
+  (void)live;
+  slots_ctx *c = ctx;
+  int p = c->pos--;
+  for (int j = 0; j < in->ndefs; ++j)
+    extend(c, in->defs[j], 2 * p + 1);
+  for (int j = 0; j < in->nuses; ++j)
+    extend(c, in->uses[j], 2 * p);
+}
+
+static void build_intervals(slots_ctx *c) {
+  x86_live live;
+  x86_live_init(&live, c->g.nodes);
+
+  int pos = 0;
+  for (size_t bi = 0; bi < c->g.blocks.size; ++bi) {
+    x86_block *b = &c->g.blocks.data[bi];
+    int first = pos;
+    for (x86_instr *i = b->first;; i = i->next) {
+      ++pos;
+      if (i == b->last)
+        break;
+    }
+    int last = pos - 1;
+
+    c->pos = last;
+    x86_block_walk(&c->g, b, &live, walk_instr, c);
+
+    bitset_foreach(&b->live_in, idx) {
+      extend(c, c->g.live_nodes.data[idx], 2 * first);
+    }
+    bitset_foreach(&b->live_out, idx) {
+      extend(c, c->g.live_nodes.data[idx], 2 * last + 1);
+    }
+  }
+
+  x86_live_free(&live);
+}
+
+static void heap_push(slot_heap *h, slot s) {
+  vec_push_back(*h, s);
+  size_t i = h->size - 1;
+  while (i > 0 && h->data[(i - 1) / 2].end > s.end) {
+    h->data[i] = h->data[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->data[i] = s;
+}
+
+static slot heap_pop(slot_heap *h) {
+  slot res = h->data[0];
+  slot s = vec_back(*h);
+  vec_pop_back(*h);
+
+  size_t n = h->size, i = 0;
+  while (n > 0) {
+    size_t child = i * 2 + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && h->data[child + 1].end < h->data[child].end)
+      ++child;
+    if (h->data[child].end >= s.end)
+      break;
+    h->data[i] = h->data[child];
+    i = child;
+  }
+  if (n > 0)
+    h->data[i] = s;
+  return res;
+}
+
+static int type_size(x86_asm_type t) {
+  return t == X86_QUADWORD ? 8 : 4;
+}
+
+static x86_asm_type pseudo_type(slots_ctx *c, int node) {
+  be_syme *e = ht_get(c->g.bst, c->g.pseudos.data[node - X86_ALLOC_REGS]);
+  assert(e != NULL && e->t == BE_SYME_OBJ);
+  return e->v.obj.type;
+}
+
+static slots_ctx *sort_ctx;
+
+static int interval_cmp(const void *a, const void *b) {
+  return sort_ctx->iv[*(int *)a].start - sort_ctx->iv[*(int *)b].start;
+}
+
+static void assign_slots(slots_ctx *c) {
+  int_vec order;
+  vec_init(order);
+  for (size_t node = X86_ALLOC_REGS; node < c->g.nodes; ++node)
+    if (c->iv[node].start >= 0)
+      vec_push_back(order, node);
+
+  sort_ctx = c;
+  if (!vec_empty(order))
+    qsort(order.data, order.size, sizeof(int), interval_cmp);
+
+  // slots of longwords and quadwords
+  slot_heap heaps[2];
+  vec_init(heaps[0]);
+  vec_init(heaps[1]);
+
+  vec_foreach(int, order, it) {
+    int node = *it;
+    x86_asm_type t = pseudo_type(c, node);
+    slot_heap *h = &heaps[t == X86_QUADWORD];
+    stats.before += type_size(t);
+
+    slot s = {c->iv[node].end, node};
+    if (!vec_empty(*h) && h->data[0].end < c->iv[node].start) {
+      s.node = heap_pop(h).node;
+      c->rep[node] = s.node;
+    } else {
+      stats.after += type_size(t);
+    }
+    heap_push(h, s);
+  }
+
+  vec_free(heaps[0]);
+  vec_free(heaps[1]);
+  vec_free(order);
+}
+
+static void rename_pseudos(slots_ctx *c) {
+  for (x86_instr *i = c->g.f->first; i != NULL;) {
+    x86_instr *next = i->next;
+
+    x86_op_ref refs[X86_INSTR_MAX_OPS];
+    int n = x86_instr_ops(i, refs);
+    for (int j = 0; j < n; ++j) {
+      x86_op *op = refs[j].op;
+      int node = x86_op_node(&c->g, op);
+      if (node >= X86_ALLOC_REGS && c->rep[node] != node)
+        op->v.pseudo = c->g.pseudos.data[c->rep[node] - X86_ALLOC_REGS];
+    }
+
+    if (i->op == X86_MOV && i->v.binary.src.t == X86_OP_PSEUDO &&
+        i->v.binary.dst.t == X86_OP_PSEUDO &&
+        !strcmp(i->v.binary.src.v.pseudo, i->v.binary.dst.v.pseudo)) {
+      x86_remove_instr(c->g.f, i);
+      ++stats.moves;
+    }
+    i = next;
+  }
+}
+
+void share_stack_slots_for_func(x86_asm_gen *ag, x86_func *f, ht *bst) {
+  (void)ag;
+  slots_ctx c;
+  build_x86_cfg(&c.g, f, bst);
+  analyze_x86_liveness(&c.g);
+
+  size_t n = c.g.nodes;
+  c.iv = malloc(sizeof(slot_range) * n);
+  c.rep = malloc(sizeof(int) * n);
+  assert(c.iv && c.rep);
+  for (size_t node = 0; node < n; ++node) {
+    c.iv[node].start = c.iv[node].end = -1;
+    c.rep[node] = node;
+  }
+
+  build_intervals(&c);
+  assign_slots(&c);
+  rename_pseudos(&c);
+
+  free(c.iv);
+  free(c.rep);
+  free_x86_cfg(&c.g);
+}
+
+void print_stack_slot_stats(void) {
+  fprintf(stderr, "stack-slots      frame bytes %ld -> %ld\n", stats.before,
+          stats.after);
+  fprintf(stderr, "stack-slots      removed moves %d\n", stats.moves);
+}
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+# Randomized check of division and modulo by constants.
+#
+# Each generated program computes x / d, x % d, x /= d and x %= d with d a
+# constant for int, unsigned int, long and unsigned long, and compares them
+# against the same operations with d passed as a variable (idiv/div path).
+# Divisors are edge values plus random ones, dividends are edge values plus
+# random ones of all magnitudes. Programs are compiled by ascc at every
+# optimization level and outputs (failing divisors and a checksum) have to
+# match between levels, and with $CC if it is set.
+#
+# usage: tests/divconst.py [seeds] [dividends per seed]
+# env:   ASCC (default build/release/ascc), CC (optional reference compiler)
+
+import concurrent.futures
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+LEVELS = ['-O0', '-O1', '-O2', '-Os']
+
+TYPES = {
+    'int': (32, True, ''),
+    'unsigned': (32, False, 'u'),
+    'long': (64, True, 'l'),
+    'unsigned long': (64, False, 'ul'),
+}
+
+FIXED_S = [1, -1, 2, 3, 5, 6, 7, 9, 10, 11, 12, 13, 25, 100, 125, 641, 1000,
+           7919, 65536, 65537, -2, -3, -5, -7, -8, -10, -641, -1000, -65536]
+FIXED_U = [1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 641, 1000, 65536, 65537]
+
+
+def lit(v, t):
+    w, signed, suf = TYPES[t]
+    if signed and v < 0:
+        # -INT_MIN literal doesn't fit in its type
+        if v == -(1 << (w - 1)):
+            return '(-%d%s - 1%s)' % ((1 << (w - 1)) - 1, suf, suf)
+        return '(-%d%s)' % (-v, suf)
+    if t == 'int' and v > 2**31 - 1:
+        return None
+    return '%d%s' % (v, suf)
+
+
+def divisors(rng):
+    res = {}
+    for t, (w, signed, _) in TYPES.items():
+        d = list(FIXED_S if signed else FIXED_U)
+        if signed:
+            d += [2**30, 2**31 - 1, -(2**31), -(2**30), -(2**31) + 1]
+            if w == 64:
+                d += [2**32 + 1, 1000000007, 2**62, 2**63 - 1, -(2**63),
+                      10**18, 3**39, -(3**39), -(2**40)]
+            for _ in range(12):
+                v = rng.randint(2, 2**rng.randint(2, w - 2))
+                d.append(v if rng.random() < .6 else -v)
+        else:
+            d += [2**31, 2**31 + 1, 2**32 - 1, 2**32 - 2, 0x80000001,
+                  0x7fffffff]
+            if w == 64:
+                d += [2**63, 2**63 + 1, 2**64 - 1, 7**22, 2**32 + 1, 10**19,
+                      1000000007]
+            for _ in range(12):
+                d.append(rng.randint(2, 2**rng.randint(2, w) - 1))
+        res[t] = [x for x in dict.fromkeys(d) if lit(x, t) is not None]
+    return res
+
+
+def gen(seed, iters):
+    rng = random.Random(seed)
+    out = [
+        'int putchar(int c);',
+        'static int pr(unsigned long x) {',
+        '  if (x >= 10ul) pr(x / 10ul);',
+        '  putchar((int)(x % 10ul) + 48);',
+        '  return 0; }',
+        'static unsigned long st = %dul;' % (seed * 2654435761 % 2**63 + 1),
+        'static unsigned long rnd(void) {',
+        '  st = st * 6364136223846793005ul + 1442695040888963407ul;',
+        '  return st; }',
+        'static unsigned long fails = 0;',
+        'static unsigned long sum = 0;',
+    ]
+    checks = []
+    n = 0
+    for t, ds in divisors(rng).items():
+        w, signed, suf = TYPES[t]
+        tn = t.replace(' ', '_')
+        out.append('%s vq_%s(%s x, %s y) { return x / y; }' % (t, tn, t, t))
+        out.append('%s vr_%s(%s x, %s y) { return x %% y; }' % (t, tn, t, t))
+        for d in ds:
+            L = lit(d, t)
+            out.append('%s q%d(%s x) { return x / %s; }' % (t, n, t, L))
+            out.append('%s r%d(%s x) { return x %% %s; }' % (t, n, t, L))
+            out.append('%s aq%d(%s x) { x /= %s; return x; }' % (t, n, t, L))
+            out.append('%s ar%d(%s x) { x %%= %s; return x; }' % (t, n, t, L))
+            # INT_MIN / -1 overflows
+            guard = ''
+            if signed and d == -1:
+                guard = 'if (x != (-%d%s - 1%s)) ' % ((1 << (w - 1)) - 1,
+                                                     suf, suf)
+            checks.append((t, tn, n, L, guard))
+            n += 1
+
+    out.append('static int check(unsigned long v) {')
+    for t, tn, k, L, guard in checks:
+        out.append(
+            '  { %s x = (%s)v; %s{ %s a = q%d(x); %s b = r%d(x);\n'
+            '    if (a != vq_%s(x, %s) || b != vr_%s(x, %s) || aq%d(x) != a'
+            ' || ar%d(x) != b) { fails = fails + 1ul; pr(%dul); putchar(10); }'
+            '\n    sum = sum * 31ul + (unsigned long)a + (unsigned long)b; } }'
+            % (t, t, guard, t, k, t, k, tn, L, tn, L, k, k, k))
+    out.append('  return 0; }')
+
+    out.append('int main(void) {')
+    for e in [0, 1, 2, 3, 2**31 - 1, 2**31, 2**31 + 1, 2**32 - 1, 2**32,
+              2**63 - 1, 2**63, 2**63 + 1, 2**64 - 1, 2**64 - 2, 2**64 - 3,
+              2**64 - 1000]:
+        out.append('  check(%dul);' % e)
+    out += [
+        '  for (int i = 0; i < %d; i++) {' % iters,
+        '    unsigned long r = rnd();',
+        '    unsigned long v = rnd() >> (int)(r & 63ul);',
+        '    if ((r & 64ul) != 0ul) v = 0ul - v;',
+        '    check(v);',
+        '    if ((r & 128ul) != 0ul) check((unsigned long)(int)v); }',
+        '  pr(fails); putchar(10); pr(sum); putchar(10);',
+        '  return fails != 0ul; }',
+    ]
+    return '\n'.join(out) + '\n'
+
+
+def run(cmd, src, exe):
+    r = subprocess.run(cmd + [src, '-o', exe], stdout=subprocess.DEVNULL,
+                       stderr=subprocess.PIPE, text=True)
+    if r.returncode != 0:
+        return 'compile failed: ' + r.stderr.strip()
+    r = subprocess.run([exe], capture_output=True, text=True, timeout=600)
+    return '%src=%d' % (r.stdout, r.returncode)
+
+
+def check_seed(seed, iters, ascc, cc, tmp):
+    src = os.path.join(tmp, 'd%d.c' % seed)
+    with open(src, 'w') as f:
+        f.write(gen(seed, iters))
+    builds = [([ascc, o], o) for o in LEVELS]
+    if cc:
+        builds.append(([cc, '-w', '-O1'], cc))
+    outs = {}
+    for cmd, name in builds:
+        exe = os.path.join(tmp, 'd%d%s' % (seed, name.replace('/', '_')))
+        outs[name] = run(cmd, src, exe)
+    ref = outs[builds[-1][1]]
+    errs = []
+    for name, out in outs.items():
+        if not out.endswith('rc=0') or out != ref:
+            errs.append('seed %d %s: %s' % (seed, name,
+                                            out.strip().replace('\n', ' ')))
+    return errs
+
+
+def main():
+    seeds = int(sys.argv[1]) if len(sys.argv) > 1 else 8
+    iters = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    ascc = os.path.abspath(os.environ.get(
+        'ASCC', os.path.join(root, 'build', 'release', 'ascc')))
+    cc = os.environ.get('CC')
+    fails = 0
+    with tempfile.TemporaryDirectory() as tmp, \
+            concurrent.futures.ThreadPoolExecutor(os.cpu_count()) as ex:
+        jobs = [ex.submit(check_seed, s, iters, ascc, cc, tmp)
+                for s in range(1, seeds + 1)]
+        for j in jobs:
+            for e in j.result():
+                print(e)
+                fails += 1
+    print('divconst: %d seeds, %d failures' % (seeds, fails))
+    return fails != 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())